@@ -0,0 +1,179 @@
+//
+// Fan duty at power on
+//
+// The configured boot duty gets the fan going straight from the C runtime
+// startup code, before variables are even set up, rather than waiting on
+// the Arduino core and USB. PwmOutput takes over from there in setup(),
+// and UsbPwmDevice::begin() puts the same duty back.
+//
+// This also keeps track of how long after start the PWM came on and the
+// host got the device configured. Time zero is when the application
+// starts, after the bootloader hands over.
+//
+
+#include <Arduino.h>
+
+#include "BootDuty.h"
+#include "Counters.h"
+#include "EepromLayout.h"
+
+#include <avr/eeprom.h>
+
+// Stored as magic, u16 duty ratio, u16 duty in cycles at BOOT_PERIOD. The
+// cycles are worked out when the ratio is set, so start up code doesn't
+// have to. BOOT_MAGIC_RATIO_ONLY is the older layout without them, which
+// boot_begin() brings up to date.
+#define BOOT_MAGIC 0xB1
+#define BOOT_MAGIC_RATIO_ONLY 0xB0
+#define BOOT_RATIO_OFFSET 1
+#define BOOT_CYCLES_OFFSET 3
+
+// Same as PwmOutput's default period, 25KHz
+#define BOOT_PERIOD 640
+
+#define TICKS_TO_US(ticks) ((uint32_t)(ticks) * COUNTERS_TICK_CYCLES / (F_CPU / 1000000))
+
+// Timer3 count of when the PWM came on; the C runtime doesn't clear this
+static uint16_t pwm_ticks __attribute__((section(".noinit")));
+
+// Times since start, in microseconds, sent to the host as is
+static struct {
+    uint32_t pwm_us;
+    // 0 until the host first configures the device
+    uint32_t configured_us;
+} times;
+
+// micros() starts from the core's init(), about this far into the
+// application
+static unsigned long init_offset_us;
+
+static uint16_t stored_duty;
+static bool store_pending;
+
+static uint16_t ratio_to_cycles(uint16_t ratio)
+{
+    return ((uint32_t)ratio * BOOT_PERIOD + 32767) / 65535;
+}
+
+static void start_timer1()
+{
+    TCCR1A = 0b10000010;    // COM1A[1:0] = 10, WGM1[1:0] = 10
+    TCCR1B = 0b00011001;    // WGM1[3:2] = 11, CS1[2:0] = 001
+}
+
+//
+// Called from .init3, right after .init2 has set up the stack and cleared
+// the zero register, which is all compiled code needs. Nothing here can
+// use initialized or zeroed variables, as they aren't set up yet.
+//
+extern "C" void boot_start() __attribute__((used, noinline));
+extern "C" void boot_start()
+{
+    // Clock for the start up times, at the same rate as the performance
+    // counters use it
+    TCCR3A = 0;
+    TCCR3B = _BV(CS31);
+    TCNT3 = 0;
+
+    uint16_t duty = 0;
+    if (eeprom_read_byte((const uint8_t*)EEPROM_BOOT_DUTY) == BOOT_MAGIC) {
+        duty = eeprom_read_word((const uint16_t*)(EEPROM_BOOT_DUTY + BOOT_CYCLES_OFFSET));
+    }
+    if (duty) {
+        // Same setup as pwm_begin() and pwm_set_ratio() do later
+        ICR1 = BOOT_PERIOD - 1;
+        OCR1A = duty - 1;
+        TCNT1 = 0;
+        start_timer1();
+        DDRB |= _BV(5);
+    }
+    pwm_ticks = TCNT3;
+}
+
+// Naked, so the compiler adds no prologue or epilogue and execution falls
+// through to .init4; GCC only supports basic asm in naked functions, so
+// everything else is in boot_start()
+void boot_early() __attribute__((naked, used, section(".init3")));
+void boot_early()
+{
+    asm volatile ("call boot_start");
+}
+
+//
+// Runs with the other constructors, just before main() calls the core's
+// init(), which starts micros() from 0 and sets Timer3 up its own way
+//
+static void boot_constructor() __attribute__((constructor));
+static void boot_constructor()
+{
+    init_offset_us = TICKS_TO_US(TCNT3);
+}
+
+//
+// Called by main() right after init(), which put Timer1 into its own PWM
+// mode, so put back the boot PWM until setup() takes over
+//
+void initVariant()
+{
+    if (TCCR1A & _BV(COM1A1)) {
+        start_timer1();
+    }
+}
+
+void boot_begin()
+{
+    static_assert(BOOT_CYCLES_OFFSET + 2 <= EEPROM_BOOT_DUTY_SIZE, "boot duty too big");
+    uint8_t magic = eeprom_read_byte((const uint8_t*)EEPROM_BOOT_DUTY);
+    if (magic == BOOT_MAGIC || magic == BOOT_MAGIC_RATIO_ONLY) {
+        stored_duty = eeprom_read_word((const uint16_t*)(EEPROM_BOOT_DUTY + BOOT_RATIO_OFFSET));
+        // Older layout gets its cycles added, for the next start
+        store_pending = magic == BOOT_MAGIC_RATIO_ONLY;
+    }
+    if (TCCR1A & _BV(COM1A1)) {
+        times.pwm_us = TICKS_TO_US(pwm_ticks);
+    }
+}
+
+void boot_poll()
+{
+    if (!times.configured_us && USBDevice.configured()) {
+        uint32_t configured_us = micros() + init_offset_us;
+        uint8_t old_sreg = SREG;
+        cli();
+        times.configured_us = configured_us;
+        SREG = old_sreg;
+    }
+    if (store_pending) {
+        // Too slow to do from the USB interrupt
+        uint16_t ratio;
+        uint8_t old_sreg = SREG;
+        cli();
+        ratio = stored_duty;
+        store_pending = false;
+        SREG = old_sreg;
+        // Magic last, so start up never sees new cycles without the rest
+        eeprom_update_byte((uint8_t*)EEPROM_BOOT_DUTY, 0xff);
+        eeprom_update_word((uint16_t*)(EEPROM_BOOT_DUTY + BOOT_RATIO_OFFSET), ratio);
+        eeprom_update_word((uint16_t*)(EEPROM_BOOT_DUTY + BOOT_CYCLES_OFFSET),
+                           ratio_to_cycles(ratio));
+        eeprom_update_byte((uint8_t*)EEPROM_BOOT_DUTY, BOOT_MAGIC);
+    }
+}
+
+uint16_t boot_duty()
+{
+    return stored_duty;
+}
+
+bool boot_set_duty(uint16_t ratio)
+{
+    stored_duty = ratio;
+    store_pending = true;
+    return true;
+}
+
+bool boot_read_times(int(*send)(uint8_t, const void*, int))
+{
+    static_assert(sizeof(times) == BOOT_TIMES_LENGTH, "boot times length mismatch");
+    return send(0, &times, sizeof(times)) >= 0;
+}
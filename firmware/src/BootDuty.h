@@ -0,0 +1,16 @@
+#ifndef BootDuty_h
+#define BootDuty_h
+
+#include <stdint.h>
+
+// Bytes sent by boot_read_times
+#define BOOT_TIMES_LENGTH 8
+
+void boot_begin();
+void boot_poll();
+// Duty ratio the fan starts at, 0 for off
+uint16_t boot_duty();
+bool boot_set_duty(uint16_t ratio);
+bool boot_read_times(int(*send)(uint8_t, const void*, int));
+
+#endif
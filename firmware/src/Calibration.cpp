@@ -0,0 +1,179 @@
+//
+// On-device fan characterization
+//
+// Steps the fan through evenly spaced duty ratios from 0% to 100%, waits for
+// the tachometer reading to settle at each one, and records the resulting
+// RPM. How long each step takes is down to the tach, not a fixed dwell, so
+// a fan that settles quickly gets through the sweep in seconds. The table
+// is stored in EEPROM so it survives reboot.
+//
+
+#include <Arduino.h>
+
+#include "Calibration.h"
+#include "EepromLayout.h"
+#include "UsbPwmDevice.h"
+
+#include <avr/eeprom.h>
+
+#define CAL_MAGIC 0xCA
+
+// How often to sample RPM while waiting for it to settle
+#define CAL_SAMPLE_MS 100
+// Samples in a row that must agree before a step counts as settled; only
+// readings over tach edges all from after the step started count
+#define CAL_STABLE_SAMPLES 3
+// RPM reading takes up to 1 sec to drop to 0 on stall, so a stopped fan
+// only counts as settled after that
+#define CAL_STALL_MS 1250
+#define CAL_MAX_STEP_MS 8000
+
+// This is what gets sent to the host, all values little-endian
+struct CalibrationTable {
+    uint8_t points;
+    uint8_t state;
+    // Lowest duty ratio in the table at which the fan started spinning
+    uint16_t start_ratio;
+    uint16_t max_rpm;
+    uint16_t rpm[CAL_POINTS];
+};
+
+static CalibrationTable table;
+static uint8_t step;
+static unsigned long step_start;
+static unsigned long step_start_us;
+static unsigned long next_sample;
+// Reading the samples since have to agree with
+static uint16_t stable_rpm;
+static uint8_t stable_count;
+static uint16_t saved_ratio;
+
+static uint16_t step_ratio(uint8_t i)
+{
+    return (uint32_t)65535 * i / (CAL_POINTS - 1);
+}
+
+static void set_ratio(uint16_t ratio)
+{
+    uint8_t old_sreg = SREG;
+    cli();
+    TheUsbPwmDevice.setDutyRatio(ratio);
+    SREG = old_sreg;
+}
+
+static void start_step(unsigned long now)
+{
+    set_ratio(step_ratio(step));
+    step_start = now;
+    step_start_us = micros();
+    next_sample = now + CAL_SAMPLE_MS;
+    stable_count = 0;
+}
+
+static void finish()
+{
+    if (table.max_rpm) {
+        table.state = CAL_STATE_VALID;
+        eeprom_update_byte((uint8_t*)EEPROM_CALIBRATION, CAL_MAGIC);
+        eeprom_update_block(&table, (void*)(EEPROM_CALIBRATION + 1), sizeof(table));
+    } else {
+        // No tach signal at full speed, nothing worth keeping
+        table.state = CAL_STATE_FAILED;
+    }
+    set_ratio(saved_ratio);
+}
+
+void calibration_begin()
+{
+    static_assert(sizeof(table) + 1 <= EEPROM_CALIBRATION_SIZE, "calibration table too big");
+    static_assert(sizeof(table) == CAL_TABLE_LENGTH, "calibration table length mismatch");
+
+    if (eeprom_read_byte((const uint8_t*)EEPROM_CALIBRATION) == CAL_MAGIC) {
+        eeprom_read_block(&table, (const void*)(EEPROM_CALIBRATION + 1), sizeof(table));
+    }
+    if (table.points != CAL_POINTS || table.state != CAL_STATE_VALID) {
+        memset(&table, 0, sizeof(table));
+    }
+}
+
+void calibration_start()
+{
+    uint8_t old_sreg = SREG;
+    cli();
+    saved_ratio = TheUsbPwmDevice.getDutyRatio();
+    SREG = old_sreg;
+
+    memset(&table, 0, sizeof(table));
+    table.points = CAL_POINTS;
+    table.state = CAL_STATE_RUNNING;
+    step = 0;
+    start_step(millis());
+}
+
+void calibration_abort()
+{
+    // Whoever aborted is taking over the fan, so don't restore duty
+    if (table.state == CAL_STATE_RUNNING) {
+        table.state = CAL_STATE_FAILED;
+    }
+}
+
+void calibration_poll(unsigned long now)
+{
+    if (table.state != CAL_STATE_RUNNING || (long)(now - next_sample) < 0) {
+        return;
+    }
+    next_sample += CAL_SAMPLE_MS;
+
+    uint8_t old_sreg = SREG;
+    cli();
+    uint16_t rpm = TheUsbPwmDevice.getRpm();
+    bool fresh = (long)(TheUsbPwmDevice.getRpmSince() - step_start_us) >= 0;
+    SREG = old_sreg;
+
+    unsigned long elapsed = now - step_start;
+    uint16_t diff = rpm > stable_rpm ? rpm - stable_rpm : stable_rpm - rpm;
+    if (rpm ? !fresh : elapsed < CAL_STALL_MS) {
+        // Still partly from the step before
+        stable_count = 0;
+    } else if (stable_count && diff <= stable_rpm / 64 + 10) {
+        // Allow about 2% jitter, plus some slack for very slow fans. Against
+        // the first reading rather than the last, so a slow ramp doesn't
+        // pass for settled.
+        stable_count++;
+    } else {
+        stable_rpm = rpm;
+        stable_count = 1;
+    }
+
+    if (stable_count < CAL_STABLE_SAMPLES && elapsed < CAL_MAX_STEP_MS) {
+        return;
+    }
+
+    table.rpm[step] = rpm;
+    if (rpm) {
+        if (!table.max_rpm) {
+            // First step to spin; step 0 is ratio 0, so start_ratio itself
+            // can't say whether one was found
+            table.start_ratio = step_ratio(step);
+        }
+        if (rpm > table.max_rpm) {
+            table.max_rpm = rpm;
+        }
+    }
+    if (++step < CAL_POINTS) {
+        start_step(now);
+    } else {
+        finish();
+    }
+}
+
+uint8_t calibration_state()
+{
+    return table.state;
+}
+
+bool calibration_read(int(*send)(uint8_t, const void*, int))
+{
+    return send(0, &table, sizeof(table)) >= 0;
+}
@@ -0,0 +1,23 @@
+#ifndef Calibration_h
+#define Calibration_h
+
+#include <stdint.h>
+
+#define CAL_STATE_NONE 0
+#define CAL_STATE_RUNNING 1
+#define CAL_STATE_VALID 2
+#define CAL_STATE_FAILED 3
+
+// Number of duty steps in the table, evenly spaced from 0% to 100%
+#define CAL_POINTS 16
+// Bytes sent by calibration_read
+#define CAL_TABLE_LENGTH (6 + CAL_POINTS * 2)
+
+void calibration_begin();
+void calibration_start();
+void calibration_abort();
+void calibration_poll(unsigned long now);
+uint8_t calibration_state();
+bool calibration_read(int(*send)(uint8_t, const void*, int));
+
+#endif
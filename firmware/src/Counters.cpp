@@ -0,0 +1,113 @@
+//
+// Performance counters
+//
+// Counts of what the firmware has been doing and how long the interrupt
+// handlers that matter most took at worst, for diagnosing missed tach edges
+// and slow USB responses. Timer3 is otherwise unused, so it runs free as
+// the cycle counter, which the schedule's compare match also goes by.
+//
+
+#include <Arduino.h>
+
+#include "Counters.h"
+
+// This is what gets sent to the host, all values little-endian
+static struct {
+    // Time since last clear, filled in when read
+    uint32_t elapsed_us;
+    uint32_t tach_edges;
+    uint32_t loop_iterations;
+    uint32_t setup_served;
+    uint32_t setup_rejected;
+    // Worst handler durations, in units of COUNTERS_TICK_CYCLES
+    uint16_t tach_isr_max;
+    uint16_t setup_max;
+    uint16_t watchdog_resets;
+} counters;
+
+static unsigned long clear_time;
+
+// Left alone by the C runtime and the bootloader, so this survives resets
+// other than power loss. armed is set while running normally and cleared
+// just before the firmware resets itself on purpose, so finding it still
+// set at start means the watchdog did it.
+#define PERSIST_MAGIC 0xa55a
+static struct {
+    uint16_t resets;
+    uint16_t check;
+    uint8_t armed;
+} persist __attribute__((section(".noinit")));
+
+void counters_begin()
+{
+    TCCR3A = 0;
+    TCCR3B = _BV(CS31);
+    TCCR3C = 0;
+    TIMSK3 = 0;
+
+    if (persist.check != (persist.resets ^ PERSIST_MAGIC)) {
+        // Power on; RAM is garbage
+        persist.resets = 0;
+        persist.armed = 0;
+    } else if (persist.armed && persist.resets != 0xffff) {
+        persist.resets++;
+    }
+    persist.check = persist.resets ^ PERSIST_MAGIC;
+    persist.armed = 1;
+    counters.watchdog_resets = persist.resets;
+    clear_time = micros();
+}
+
+void counters_expect_reset()
+{
+    persist.armed = 0;
+}
+
+void counters_loop()
+{
+    // Read from the USB interrupt, so can't be caught half updated
+    uint8_t old_sreg = SREG;
+    cli();
+    counters.loop_iterations++;
+    SREG = old_sreg;
+}
+
+void counters_tach_edge(uint16_t start)
+{
+    uint16_t duration = counters_now() - start;
+    counters.tach_edges++;
+    if (duration > counters.tach_isr_max) {
+        counters.tach_isr_max = duration;
+    }
+}
+
+void counters_setup(bool served, uint16_t start)
+{
+    uint16_t duration = counters_now() - start;
+    if (served) {
+        counters.setup_served++;
+    } else {
+        counters.setup_rejected++;
+    }
+    if (duration > counters.setup_max) {
+        counters.setup_max = duration;
+    }
+}
+
+void counters_clear()
+{
+    uint8_t old_sreg = SREG;
+    cli();
+    memset(&counters, 0, sizeof(counters));
+    persist.resets = 0;
+    persist.check = persist.resets ^ PERSIST_MAGIC;
+    clear_time = micros();
+    SREG = old_sreg;
+}
+
+bool counters_read(int(*send)(uint8_t, const void*, int))
+{
+    static_assert(sizeof(counters) == COUNTERS_LENGTH, "counters length mismatch");
+    counters.elapsed_us = micros() - clear_time;
+    return send(0, &counters, sizeof(counters)) >= 0;
+}
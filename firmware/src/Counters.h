@@ -0,0 +1,30 @@
+#ifndef Counters_h
+#define Counters_h
+
+#include <avr/io.h>
+#include <stdint.h>
+
+// Handler durations are in counts of Timer3, which runs free at this many
+// CPU cycles per count
+#define COUNTERS_TICK_CYCLES 8
+
+// Bytes sent by counters_read
+#define COUNTERS_LENGTH 26
+
+void counters_begin();
+void counters_expect_reset();
+void counters_loop();
+void counters_clear();
+bool counters_read(int(*send)(uint8_t, const void*, int));
+
+// Timestamp to pass in at the end of a handler; only for use with
+// interrupts disabled
+static inline uint16_t counters_now()
+{
+    return TCNT3;
+}
+
+void counters_tach_edge(uint16_t start);
+void counters_setup(bool served, uint16_t start);
+
+#endif
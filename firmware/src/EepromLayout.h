@@ -0,0 +1,21 @@
+#ifndef EepromLayout_h
+#define EepromLayout_h
+
+//
+// Fixed EEPROM addresses, so stored settings survive firmware updates that
+// add or rearrange other stored data.
+//
+
+// Fan calibration table, see Calibration.cpp
+#define EEPROM_CALIBRATION 0x000
+#define EEPROM_CALIBRATION_SIZE 0x40
+
+// Fan duty at power on, see BootDuty.cpp
+#define EEPROM_BOOT_DUTY 0x040
+#define EEPROM_BOOT_DUTY_SIZE 0x08
+
+// Serial number, name and location, see Identity.cpp
+#define EEPROM_IDENTITY 0x080
+#define EEPROM_IDENTITY_SIZE 0x60
+
+#endif
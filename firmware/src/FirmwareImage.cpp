@@ -0,0 +1,53 @@
+//
+// Firmware image check
+//
+// CRC of the application image in flash, so hosts can tell which build a
+// board is running, such as to confirm an update took. The whole image
+// takes tens of milliseconds, so it gets done a piece at a time from the
+// main loop after start.
+//
+
+#include <Arduino.h>
+#include <util/crc16.h>
+
+#include "FirmwareImage.h"
+
+// The image ends with the initial values of .data, which get copied to RAM
+// at start
+extern const uint8_t __data_load_end[];
+
+// Bytes of flash done per image_poll
+#define IMAGE_CHUNK 64
+
+static uint16_t image_offset;
+static uint16_t image_crc = 0xffff;
+
+void image_poll()
+{
+    uint16_t end = (uint16_t)(uintptr_t)__data_load_end;
+    if (image_offset == end) {
+        return;
+    }
+    uint16_t stop = end - image_offset > IMAGE_CHUNK ? image_offset + IMAGE_CHUNK : end;
+    uint16_t crc = image_crc;
+    for (uint16_t addr = image_offset; addr < stop; addr++) {
+        crc = _crc16_update(crc, pgm_read_byte(addr));
+    }
+
+    // Read from the USB interrupt, so can't be caught half updated
+    uint8_t old_sreg = SREG;
+    cli();
+    image_crc = crc;
+    image_offset = stop;
+    SREG = old_sreg;
+}
+
+bool image_read(int(*send)(uint8_t, const void*, int))
+{
+    // Image length in bytes, 0 until the CRC is done, then CRC-16 (as for
+    // Modbus) of the image
+    uint16_t end = (uint16_t)(uintptr_t)__data_load_end;
+    uint16_t reply[2] = { image_offset == end ? end : (uint16_t)0, image_crc };
+    static_assert(sizeof(reply) == IMAGE_INFO_LENGTH, "image info length mismatch");
+    return send(0, reply, sizeof(reply)) >= 0;
+}
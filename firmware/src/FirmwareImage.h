@@ -0,0 +1,12 @@
+#ifndef FirmwareImage_h
+#define FirmwareImage_h
+
+#include <stdint.h>
+
+// Bytes sent by image_read
+#define IMAGE_INFO_LENGTH 4
+
+void image_poll();
+bool image_read(int(*send)(uint8_t, const void*, int));
+
+#endif
@@ -0,0 +1,222 @@
+//
+// USB frame clock
+//
+// The host starts a USB frame every millisecond, off its own clock, and
+// every device on the bus sees the same frame numbers. Locking to that
+// turns micros() times, which drift apart from board to board by as much
+// as the resonator tolerance, into host times that line up across every
+// board on the bus.
+//
+// The Arduino core keeps the start of frame interrupt to itself, so this
+// watches the frame number from the main loop instead. Every SYNC_FRAMES
+// frames it waits, just before the next frame is due, for the number to
+// change, and feeds when it did into a simple phase-locked loop that tracks
+// both the offset and the rate of micros() against the frames.
+//
+
+#include <Arduino.h>
+
+#include "FrameClock.h"
+
+// Furthest ahead, in frames, frame_clock_device_time takes; well short of
+// where the sums overflow
+#define MAX_AHEAD_FRAMES 0x100000L
+// Frames between measurements
+#define SYNC_FRAMES 64
+// How far ahead of a frame start the wait begins; loop passes further out
+// just come back later
+#define SPIN_US 100
+// Measurements off by more than this start over rather than get filtered
+#define MAX_ERROR_US 500
+// Far more than any resonator is off by, about 3%
+#define MAX_DRIFT 0x8000L
+// Wait after finding no frames coming before looking again
+#define RETRY_MS 100
+
+// Frames since start, extended from the 11-bit frame number, whose bits
+// these keep as the low ones
+static uint32_t frames;
+static uint16_t last_raw;
+static bool frames_started;
+
+// micros() time sync_frame started at, as filtered
+static uint32_t sync_frame;
+static unsigned long sync_us;
+// Host microseconds per micros() microsecond, less 1, in units of 2^-20
+static int32_t drift;
+static bool locked;
+static unsigned long give_up_ms;
+static bool gave_up;
+
+// This is what gets sent to the host, all values little-endian
+struct FrameClockInfo {
+    uint32_t frame;
+    // Host microseconds since frame started, FRAME_US_UNLOCKED if not
+    // locked
+    uint16_t frame_us;
+    // micros() at the same moment
+    uint32_t device_us;
+    // How much faster micros() runs than the host clock, in parts per
+    // million
+    int16_t drift_ppm;
+};
+
+static uint16_t read_raw()
+{
+    // Not latched, so could change between the two halves
+    uint8_t low, high;
+    do {
+        low = UDFNUML;
+        high = UDFNUMH;
+    } while (low != UDFNUML);
+    return ((uint16_t)(high & 0x07) << 8) | low;
+}
+
+// Only call with interrupts disabled
+static uint32_t current_frame(uint16_t raw)
+{
+    return frames + ((raw - last_raw) & 0x7ff);
+}
+
+// micros() time to host microseconds since sync_frame started
+static int32_t host_elapsed(unsigned long now_us)
+{
+    int32_t elapsed = (int32_t)(now_us - sync_us);
+    return elapsed + (int32_t)(((int64_t)elapsed * drift) >> 20);
+}
+
+// micros() time the given number of frames after sync_frame starts
+static unsigned long device_time(uint32_t frame_count)
+{
+    int32_t host_us = (int32_t)(frame_count * 1000);
+    return sync_us + host_us - (int32_t)(((int64_t)host_us * drift) >> 20);
+}
+
+static void measure(uint32_t frame, unsigned long start_us)
+{
+    uint32_t count = frame - sync_frame;
+    unsigned long predicted = device_time(count);
+    int32_t error = (int32_t)(start_us - predicted);
+    uint8_t old_sreg = SREG;
+    cli();
+    if (!locked || error > MAX_ERROR_US || error < -MAX_ERROR_US || count > 0x10000) {
+        // First time, or lost track, maybe from a suspend; keep the rate,
+        // which won't have changed much
+        sync_us = start_us;
+        locked = true;
+    } else {
+        // Late means micros() runs fast. Rate comes around slowly; phase
+        // takes a quarter of the error, which smooths over measurements
+        // delayed by interrupts.
+        drift -= ((error << 20) / (int32_t)(count * 1000)) / 8;
+        if (drift > MAX_DRIFT || drift < -MAX_DRIFT) {
+            drift = 0;
+        }
+        sync_us = predicted + error / 4;
+    }
+    sync_frame = frame;
+    SREG = old_sreg;
+}
+
+void frame_clock_poll()
+{
+    if (!USBDevice.configured()) {
+        locked = false;
+        frames_started = false;
+        return;
+    }
+
+    uint16_t raw = read_raw();
+    uint8_t old_sreg = SREG;
+    cli();
+    if (!frames_started) {
+        frames = raw;
+        frames_started = true;
+    } else {
+        frames = current_frame(raw);
+    }
+    last_raw = raw;
+    uint32_t frame = frames;
+    SREG = old_sreg;
+
+    if (locked && frame - sync_frame < SYNC_FRAMES) {
+        return;
+    }
+    if (gave_up && millis() - give_up_ms < RETRY_MS) {
+        return;
+    }
+    if (locked && frame - sync_frame == SYNC_FRAMES &&
+        (long)(device_time(frame + 1 - sync_frame) - micros()) > SPIN_US) {
+        // Not due yet; a later pass will be closer. Once past that frame,
+        // as when micros() runs slow and the prediction comes late, just
+        // wait for the next one.
+        return;
+    }
+
+    // Wait for the next frame with interrupts on, so only the detection
+    // gets delayed by them
+    uint8_t low = UDFNUML;
+    unsigned long wait_start = micros();
+    while (UDFNUML == low) {
+        if (micros() - wait_start > 1100) {
+            // Suspended, no frames coming
+            locked = false;
+            gave_up = true;
+            give_up_ms = millis();
+            return;
+        }
+    }
+    gave_up = false;
+    cli();
+    unsigned long start_us = micros();
+    raw = read_raw();
+    frame = current_frame(raw);
+    SREG = old_sreg;
+    measure(frame, start_us);
+}
+
+bool frame_clock_time(unsigned long now_us, uint32_t* frame, uint16_t* frame_us)
+{
+    if (!locked) {
+        return false;
+    }
+    int32_t elapsed = host_elapsed(now_us);
+    // Reads can come a little before the loop has moved sync_frame on to a
+    // frame that already started
+    int32_t whole = elapsed >= 0 ? elapsed / 1000 : (elapsed - 999) / 1000;
+    *frame = sync_frame + whole;
+    *frame_us = elapsed - whole * 1000;
+    return true;
+}
+
+bool frame_clock_device_time(uint32_t frame, unsigned long* device_us)
+{
+    uint32_t count = frame - sync_frame;
+    if (!locked || count > MAX_AHEAD_FRAMES) {
+        return false;
+    }
+    *device_us = device_time(count);
+    return true;
+}
+
+bool frame_clock_read(int(*send)(uint8_t, const void*, int))
+{
+    static_assert(sizeof(FrameClockInfo) == FRAME_CLOCK_LENGTH, "frame clock length mismatch");
+    unsigned long now_us = micros();
+    uint32_t frame;
+    uint16_t frame_us;
+    if (!frame_clock_time(now_us, &frame, &frame_us)) {
+        // Still say which frame it is, even if not where in it
+        uint8_t old_sreg = SREG;
+        cli();
+        frame = frames_started ? current_frame(read_raw()) : 0;
+        SREG = old_sreg;
+        frame_us = FRAME_US_UNLOCKED;
+    }
+    FrameClockInfo info;
+    info.frame = frame;
+    info.frame_us = frame_us;
+    info.device_us = now_us;
+    info.drift_ppm = -((drift * 15625) >> 14);
+    return send(0, &info, sizeof(info)) >= 0;
+}
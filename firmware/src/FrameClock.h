@@ -0,0 +1,23 @@
+#ifndef FrameClock_h
+#define FrameClock_h
+
+#include <stdint.h>
+
+// Bytes sent by frame_clock_read
+#define FRAME_CLOCK_LENGTH 12
+
+// frame_clock_read's frame_us while not locked to the bus
+#define FRAME_US_UNLOCKED 0xffff
+
+void frame_clock_poll();
+// Host time, in frames and microseconds into the frame, of a micros()
+// time; false if not locked to the bus. Only for use with interrupts
+// disabled.
+bool frame_clock_time(unsigned long now_us, uint32_t* frame, uint16_t* frame_us);
+// micros() time a host frame starts at; false if not locked to the bus, or
+// the frame is before the last measurement or too far ahead. Only for use
+// with interrupts disabled.
+bool frame_clock_device_time(uint32_t frame, unsigned long* device_us);
+bool frame_clock_read(int(*send)(uint8_t, const void*, int));
+
+#endif
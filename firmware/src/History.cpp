@@ -0,0 +1,115 @@
+//
+// Telemetry history
+//
+// Every interval, the main loop records fan speed, duty and stall state in
+// a ring buffer. Each sample gets a sequence number, so a host that polls
+// only now and then can ask for everything after the last sample it saw.
+//
+
+#include <Arduino.h>
+
+#include "History.h"
+#include "UsbPwmDevice.h"
+
+// About a minute and a half at the default interval
+#define HISTORY_ENTRIES 96
+// Replies are kept to one control packet, as they are built and sent from
+// the USB interrupt
+#define HISTORY_READ_ENTRIES ((HISTORY_READ_LENGTH - 6) / sizeof(HistoryEntry))
+
+// This is what gets sent to the host, all values little-endian
+struct HistoryEntry {
+    uint16_t rpm;
+    // High byte of duty ratio
+    uint8_t duty;
+    uint8_t flags;
+};
+
+static HistoryEntry entries[HISTORY_ENTRIES];
+// Where the next sample goes
+static uint8_t head;
+static uint8_t count;
+static uint16_t next_seq;
+static uint16_t interval = HISTORY_DEFAULT_INTERVAL_MS;
+static unsigned long next_sample;
+
+void history_poll(unsigned long now)
+{
+    if (!interval || (long)(now - next_sample) < 0) {
+        return;
+    }
+    next_sample += interval;
+    if ((long)(now - next_sample) >= 0) {
+        // Fell well behind somehow; don't try to catch up
+        next_sample = now + interval;
+    }
+
+    HistoryEntry entry;
+    entry.flags = TheUsbPwmDevice.checkStall() ? HISTORY_FLAG_STALL : 0;
+    uint8_t old_sreg = SREG;
+    cli();
+    entry.rpm = TheUsbPwmDevice.getRpm();
+    entry.duty = TheUsbPwmDevice.getDutyRatio() >> 8;
+    // Reads come from the USB interrupt, so update all at once
+    entries[head] = entry;
+    head = (head + 1) % HISTORY_ENTRIES;
+    if (count < HISTORY_ENTRIES) {
+        count++;
+    }
+    next_seq++;
+    SREG = old_sreg;
+}
+
+bool history_set_interval(uint16_t interval_ms)
+{
+    if (interval_ms && interval_ms < HISTORY_MIN_INTERVAL_MS) {
+        return false;
+    }
+    // Old samples would be mistaken for the new interval, so drop them;
+    // sequence numbers carry on
+    uint8_t old_sreg = SREG;
+    cli();
+    interval = interval_ms;
+    count = 0;
+    next_sample = millis() + interval_ms;
+    SREG = old_sreg;
+    return true;
+}
+
+uint16_t history_interval()
+{
+    return interval;
+}
+
+bool history_read(uint16_t seq, int(*send)(uint8_t, const void*, int))
+{
+    struct {
+        // Sequence number of first entry sent, which is later than asked
+        // for if that was already overwritten
+        uint16_t first;
+        // Sequence number the next sample will get
+        uint16_t next;
+        uint16_t interval;
+        HistoryEntry entries[HISTORY_READ_ENTRIES];
+    } reply;
+    static_assert(sizeof(reply) == HISTORY_READ_LENGTH, "history reply length mismatch");
+
+    uint16_t oldest = next_seq - count;
+    if ((uint16_t)(seq - oldest) > count) {
+        // Too old, or not from this boot
+        seq = oldest;
+    }
+    uint8_t n = next_seq - seq;
+    if (n > HISTORY_READ_ENTRIES) {
+        n = HISTORY_READ_ENTRIES;
+    }
+    uint8_t index = (head + HISTORY_ENTRIES - (uint8_t)(next_seq - seq)) % HISTORY_ENTRIES;
+    for (uint8_t i = 0; i < n; i++) {
+        reply.entries[i] = entries[index];
+        index = (index + 1) % HISTORY_ENTRIES;
+    }
+    reply.first = seq;
+    reply.next = next_seq;
+    reply.interval = interval;
+    return send(0, &reply, sizeof(reply) - sizeof(reply.entries) + n * sizeof(HistoryEntry)) >= 0;
+}
@@ -0,0 +1,20 @@
+#ifndef History_h
+#define History_h
+
+#include <stdint.h>
+
+#define HISTORY_DEFAULT_INTERVAL_MS 1000
+#define HISTORY_MIN_INTERVAL_MS 100
+
+// Bits of entry flags
+#define HISTORY_FLAG_STALL 0x01
+
+// Most bytes sent by history_read, which fits one control packet
+#define HISTORY_READ_LENGTH 62
+
+void history_poll(unsigned long now);
+bool history_set_interval(uint16_t interval_ms);
+uint16_t history_interval();
+bool history_read(uint16_t seq, int(*send)(uint8_t, const void*, int));
+
+#endif
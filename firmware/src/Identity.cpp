@@ -0,0 +1,92 @@
+//
+// Board identity
+//
+// A serial number to use instead of the one made up from the chip's own
+// serial number, plus a name and location for people to tell boards apart
+// by. They are kept in EEPROM and read into RAM at start, so the USB
+// descriptors that carry them don't have to wait on EEPROM.
+//
+
+#include <Arduino.h>
+
+#include "EepromLayout.h"
+#include "Identity.h"
+
+#include <avr/eeprom.h>
+
+#define IDENTITY_MAGIC 0x1D
+
+static const uint8_t max_lengths[IDENTITY_COUNT] = {
+    IDENTITY_SERIAL_MAX, IDENTITY_TEXT_MAX, IDENTITY_TEXT_MAX
+};
+
+// Stored as is, each string padded out with NULs
+static struct {
+    char serial[IDENTITY_SERIAL_MAX];
+    char name[IDENTITY_TEXT_MAX];
+    char location[IDENTITY_TEXT_MAX];
+} strings;
+
+static char* const fields[IDENTITY_COUNT] = { strings.serial, strings.name, strings.location };
+
+static uint8_t lengths[IDENTITY_COUNT];
+static bool store_pending;
+
+//
+// Runs with the other constructors, before main() attaches USB, so the
+// descriptors are right from the first time the host asks for them
+//
+static void identity_constructor() __attribute__((constructor));
+static void identity_constructor()
+{
+    static_assert(sizeof(strings) + 1 <= EEPROM_IDENTITY_SIZE, "identity too big");
+
+    if (eeprom_read_byte((const uint8_t*)EEPROM_IDENTITY) == IDENTITY_MAGIC) {
+        eeprom_read_block(&strings, (const void*)(EEPROM_IDENTITY + 1), sizeof(strings));
+    }
+    for (uint8_t i = 0; i < IDENTITY_COUNT; i++) {
+        lengths[i] = strnlen(fields[i], max_lengths[i]);
+    }
+}
+
+void identity_poll()
+{
+    if (!store_pending) {
+        return;
+    }
+    // Too slow to do from the USB interrupt; a set coming in part way
+    // through just gets written again next time
+    store_pending = false;
+    eeprom_update_byte((uint8_t*)EEPROM_IDENTITY, IDENTITY_MAGIC);
+    eeprom_update_block(&strings, (void*)(EEPROM_IDENTITY + 1), sizeof(strings));
+}
+
+uint8_t identity_get(uint8_t which, const char** text)
+{
+    *text = fields[which];
+    return lengths[which];
+}
+
+bool identity_set(uint8_t which, const uint8_t* data, uint8_t length)
+{
+    uint8_t n = 0;
+    while (n < length && data[n]) {
+        // Printable ASCII only, and for the serial number, nothing that
+        // Windows won't take in a device instance ID
+        char c = data[n];
+        if (c < 0x20 || c >= 0x7f ||
+            (which == IDENTITY_SERIAL && (c == ' ' || c == ','))) {
+            return false;
+        }
+        n++;
+    }
+    if (n > max_lengths[which]) {
+        return false;
+    }
+
+    memset(fields[which], 0, max_lengths[which]);
+    memcpy(fields[which], data, n);
+    lengths[which] = n;
+    store_pending = true;
+    return true;
+}
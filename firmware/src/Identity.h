@@ -0,0 +1,23 @@
+#ifndef Identity_h
+#define Identity_h
+
+#include <stdint.h>
+
+// Settable strings identifying a board, kept in EEPROM
+#define IDENTITY_SERIAL 0
+#define IDENTITY_NAME 1
+#define IDENTITY_LOCATION 2
+#define IDENTITY_COUNT 3
+
+// Longest of each; the serial number has to fit what the USB core leaves
+// room for
+#define IDENTITY_SERIAL_MAX 16
+#define IDENTITY_TEXT_MAX 32
+
+void identity_poll();
+// Returns length, 0 if not set; text is not terminated
+uint8_t identity_get(uint8_t which, const char** text);
+// Text ends at the first NUL or after length bytes, so a lone NUL clears it
+bool identity_set(uint8_t which, const uint8_t* data, uint8_t length);
+
+#endif
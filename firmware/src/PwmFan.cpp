@@ -5,6 +5,15 @@
 #include <Arduino.h>
 
 #include "UsbPwmDevice.h"
+#include "BootDuty.h"
+#include "Calibration.h"
+#include "Counters.h"
+#include "FirmwareImage.h"
+#include "FrameClock.h"
+#include "History.h"
+#include "Identity.h"
+#include "Schedule.h"
+#include "TachCapture.h"
 
 #include "USBCore.h"
 
@@ -18,6 +27,9 @@
 // failsafe for development and should not be needed in released firmware
 //#define BOOTLOAD_ON_WATCHDOG
 
+// The register console on the USB serial port; builds with CDC_DISABLED
+// have only the vendor interface
+#ifdef CDC_ENABLED
 #define STATE_IDLE 0
 #define STATE_READ_REGISTER 1
 #define STATE_WRITE_REGISTER 2
@@ -29,7 +41,7 @@ static long command_value;
 static bool command_hex_mode;
 
 static int command_buffer_length;
-static uint8_t command_buffer[20];
+static uint8_t command_buffer[64];
 
 static int sendToBuffer(uint8_t flags, const void* data, int length)
 {
@@ -53,16 +65,26 @@ static void serialChar(char c)
         Serial.println();
         if (command_state == STATE_READ_REGISTER && command_register >= 0) {
             cli();
-            bool rv = TheUsbPwmDevice.readRegister(command_register, sendToBuffer);
+            bool rv = TheUsbPwmDevice.readRegister(command_register, 0, sendToBuffer);
             sei();
             if (rv) {
-                if (command_register == 0xf8) {
+                if (command_register >= 0xf8 && command_register <= 0xfa) {
+                    // Serial number, name, location
                     for (uint8_t i = 0; i < command_buffer_length; i++) {
                         Serial.write(command_buffer[i]);
                     }
                     Serial.println();
-                } else {
+                } else if (command_buffer_length == 2) {
                     Serial.println(*(uint16_t*)command_buffer);
+                } else {
+                    // Register block, dump as hex bytes
+                    for (uint8_t i = 0; i < command_buffer_length; i++) {
+                        if (command_buffer[i] < 0x10) {
+                            Serial.write('0');
+                        }
+                        Serial.print(command_buffer[i], HEX);
+                    }
+                    Serial.println();
                 }
             } else {
                 Serial.println(F("READ ERROR"));
@@ -153,6 +175,7 @@ static void serialChar(char c)
         }
     }
 }
+#endif // CDC_ENABLED
 
 void setup()
 {
@@ -171,17 +194,28 @@ void setup()
     // Power off unneeded hardware units
     ADCSRA = 0;
     ACSR = 0b10000000;
+#ifdef PWM_TIMER4
+    // pwm_begin() turns Timer1 off once it has taken over from the boot PWM
+    PRR0 = 0b10000101;
+    PRR1 = 0b00000001;
+#else
     PRR0 = 0b10000101;
-    PRR1 = 0b00011001;
+    PRR1 = 0b00010001;
+#endif
     DIDR1 = 0b00000001;
     DIDR0 = 0b11110011;
     DIDR2 = 0b00011111;
 
+    boot_begin();
+    counters_begin();
     TheUsbPwmDevice.begin();
+    calibration_begin();
 
+#ifdef CDC_ENABLED
     Serial.begin(115200);
+#endif
 
-#ifdef SERIAL_CONNECT_WAIT
+#if defined(SERIAL_CONNECT_WAIT) && defined(CDC_ENABLED)
     int wait_count = 0;
     while (!Serial && wait_count++ < 50) {
         delay(100);
@@ -233,9 +267,21 @@ void loop()
         }
     }
 
+    calibration_poll(now);
+    history_poll(now);
+    capture_poll(now, TheUsbPwmDevice.getCaptureEndpoint());
+    image_poll();
+    boot_poll();
+    identity_poll();
+    frame_clock_poll();
+    schedule_poll();
+
+#ifdef CDC_ENABLED
     while (Serial.available()) {
         serialChar((char)Serial.read());
     }
+#endif
+    counters_loop();
 
     // WDTO_120MS is what the CDC driver uses to initiate reboot, so don't
     // interfere with that.
@@ -243,6 +289,8 @@ void loop()
         // Note that wdt.h implies wdt_reset() is the right way to inform
         // watchdog things are OK, but that just seems to disable it?
         wdt_enable(WDTO_2S);
+    } else {
+        counters_expect_reset();
     }
 
     // Idle the CPU until next interrupt
@@ -0,0 +1,368 @@
+//
+// PWM output generation
+//
+// The fan PWM input is on PB5, which is driven by Timer1 (OC1A) by default,
+// or by the complementary Timer4 output (~OC4B) when built with PWM_TIMER4
+// defined. Timer4 runs from the USB PLL for finer duty resolution.
+//
+// Either way, when duty is set as a ratio, the overflow interrupt can dither
+// between adjacent duty values to get resolution finer than one timer tick.
+//
+
+#include <Arduino.h>
+
+#include "PwmOutput.h"
+
+#ifndef PWM_TIMER4
+
+static bool dither;
+
+static uint8_t pending_tccr1a;
+static uint16_t pending_icr1;
+static bool pending_period;
+// Fraction of a cycle to add to OCR1A, in 1/256 units
+static uint8_t duty_frac;
+static uint8_t dither_acc;
+static uint16_t duty_ocr;
+
+// TOP value for the PWM period, including one not yet applied
+static uint16_t pwm_top()
+{
+    return pending_period ? pending_icr1 : ICR1;
+}
+
+ISR(TIMER1_OVF_vect)
+{
+    if (pending_period) {
+        // OCR1A is double-buffered and has already picked up its new value at
+        // BOTTOM, so updating TOP here puts both on the same PWM period.
+        ICR1 = pending_icr1;
+        if (TCNT1 >= pending_icr1) {
+            TCNT1 = 0;
+        }
+        pending_period = false;
+    }
+    TCCR1A = pending_tccr1a;
+    if (duty_frac) {
+        // First order sigma-delta: carry out of the accumulator means the
+        // next period gets the extra cycle.
+        uint8_t acc = dither_acc + duty_frac;
+        OCR1A = duty_ocr + (acc < dither_acc);
+        dither_acc = acc;
+    } else {
+        TIMSK1 = 0;
+    }
+}
+
+// Duty is in cycles, up to the whole period, which for period 0 (65536)
+// doesn't fit in 16 bits
+static void load_duty(uint32_t duty, uint8_t frac)
+{
+    uint8_t new_tccr1a;
+    if (duty) {
+        new_tccr1a = 0b10000010;    // COM1A[1:0] = 10, WGM1[1:0] = 10
+        duty_ocr = duty - 1;
+        OCR1A = duty_ocr;
+    } else {
+        // Special case for value 0: turn PWM off
+        new_tccr1a = 0b00000010;    // COM1A[1:0] = 00, WGM1[1:0] = 10
+        frac = 0;
+    }
+    duty_frac = frac;
+    if (pending_tccr1a != new_tccr1a || frac) {
+        // TCCR1A is not double-buffered the way OCR1A is, so defer
+        // update to the end of this PWM period. Dithering also needs to
+        // step OCR1A at the end of every period.
+        pending_tccr1a = new_tccr1a;
+        TIFR1 = _BV(TOV1);
+        TIMSK1 = _BV(TOIE1);
+    }
+}
+
+void pwm_begin()
+{
+    // Configure Timer 1 for 25KHz PWM, start with output off (0% duty cycle)
+    TIMSK1 = 0;
+    ICR1 = 639;
+    OCR1A = 0;
+    TCNT1 = 0;
+    TCCR1A = pending_tccr1a = 0b00000010;    // COM1A[1:0] = 00, WGM1[1:0] = 10
+    pending_period = false;
+    duty_frac = 0;
+    dither = false;
+    TCCR1B = 0b00011001;    // WGM1[3:2] = 11, CS1[2:0] = 001
+}
+
+bool pwm_output_on()
+{
+    return pending_tccr1a & 0b10000000;
+}
+
+uint16_t pwm_period()
+{
+    return pwm_top() + 1;
+}
+
+uint16_t pwm_duty()
+{
+    if (!pwm_output_on()) {
+        return 0;
+    }
+    // Full duty on a 65536 cycle period reads back as near as it can
+    return OCR1A == 0xffff ? 0xffff : OCR1A + 1;
+}
+
+void pwm_set_duty(uint16_t duty)
+{
+    load_duty(duty, 0);
+}
+
+void pwm_set_ratio(uint16_t ratio)
+{
+    uint32_t period = (uint32_t)pwm_top() + 1;
+    if (!dither || ratio == 0xffff) {
+        // Full scale comes out as the whole period, even when that's 65536
+        load_duty(((uint32_t)ratio * period + 32767) / 65535, 0);
+    } else {
+        // Stretch to 0..65536 so full scale covers the whole period; result
+        // is in 1/65536 cycle units.
+        uint32_t fine = ((uint32_t)ratio + (ratio >> 15)) * period;
+        load_duty(fine >> 16, (uint8_t)(fine >> 8));
+    }
+}
+
+void pwm_set_period(uint16_t period, bool sync)
+{
+    if (sync) {
+        // ICR1 is not double-buffered at all, so hand it to the overflow
+        // interrupt along with TCCR1A.
+        pending_icr1 = period - 1;
+        pending_period = true;
+        TIFR1 = _BV(TOV1);
+        TIMSK1 = _BV(TOIE1);
+    } else {
+        pending_period = false;
+        ICR1 = period - 1;
+        TCNT1 = 0;
+    }
+}
+
+bool pwm_update_pending()
+{
+    return pending_period || TCCR1A != pending_tccr1a;
+}
+
+void pwm_lock()
+{
+    // OCR1A buffer and overflow interrupt already line everything up
+}
+
+void pwm_unlock()
+{
+}
+
+#else
+
+// Timer4 is clocked from the 48MHz USB PLL output, so 3 ticks per 16MHz
+// cycle before prescaling. 48MHz actually gives more duty steps at 25KHz
+// than the 64MHz setting would, since the counter is only 10 bits.
+#define T4_TICKS_PER_CYCLE 3
+#define T4_MAX_TOP 1023
+
+static bool dither;
+
+static uint16_t period_cycles;
+static uint8_t prescale_shift;
+static uint16_t top;
+static bool use_ratio;
+static uint16_t duty_cycles;
+static uint16_t duty_ratio;
+static uint16_t duty_ticks;
+// Fraction of a tick to add to duty_ticks, in 1/256 units
+static uint8_t duty_frac;
+static uint8_t dither_acc;
+static uint8_t pending_tccr4a;
+
+static void write_ocr4b(uint16_t high_ticks)
+{
+    // The fan is on the complementary output, which is high from compare
+    // match to TOP
+    uint16_t ocr = top - high_ticks;
+    TC4H = ocr >> 8;
+    OCR4B = (uint8_t)ocr;
+}
+
+ISR(TIMER4_OVF_vect)
+{
+    TCCR4A = pending_tccr4a;
+    if (duty_frac) {
+        // First order sigma-delta: carry out of the accumulator means this
+        // period gets the extra tick.
+        uint8_t acc = dither_acc + duty_frac;
+        write_ocr4b(duty_ticks + (acc < dither_acc));
+        dither_acc = acc;
+    } else {
+        TIMSK4 = 0;
+    }
+}
+
+static void load_duty(uint16_t high_ticks, uint8_t frac)
+{
+    if (high_ticks >= top) {
+        // Complementary output can't stay high through BOTTOM, so this is
+        // as close to 100% as it gets.
+        high_ticks = top;
+        frac = 0;
+    }
+    duty_ticks = high_ticks;
+    duty_frac = frac;
+
+    uint8_t new_tccr4a;
+    if (high_ticks || frac) {
+        new_tccr4a = 0b00010001;    // COM4B[1:0] = 01, PWM4B = 1
+        write_ocr4b(high_ticks);
+    } else {
+        // Turn PWM off
+        new_tccr4a = 0b00000001;    // COM4B[1:0] = 00, PWM4B = 1
+    }
+    if (pending_tccr4a != new_tccr4a || frac) {
+        // TCCR4A is not double-buffered, and dithering has to step OCR4B
+        // every period, so both are handled by the overflow interrupt.
+        pending_tccr4a = new_tccr4a;
+        TIFR4 = _BV(TOV4);
+        TIMSK4 = _BV(TOIE4);
+    }
+}
+
+void pwm_begin()
+{
+    // The boot duty comes from Timer1 on the same pin, so shut that down
+    TCCR1A = 0;
+    TCCR1B = 0;
+    PRR0 |= _BV(PRTIM1);
+
+    // Run Timer 4 at 25KHz from the PLL, which the USB core already has
+    // running at 48MHz, start with output off (0% duty cycle)
+    TIMSK4 = 0;
+    TCCR4B = 0;
+    PLLFRQ = (PLLFRQ & 0b11001111) | 0b00010000;    // PLLTM[1:0] = 01
+    TCCR4C = 0;
+    TCCR4D = 0;     // WGM4[1:0] = 00
+    TCCR4E = 0;
+    DT4 = 0;
+    TCCR4A = pending_tccr4a = 0b00000001;    // COM4B[1:0] = 00, PWM4B = 1
+    prescale_shift = 0xff;
+    dither = false;
+    use_ratio = false;
+    duty_cycles = 0;
+    dither_acc = 0;
+    pwm_set_period(640, false);
+    TC4H = 0;
+    TCNT4 = 0;
+}
+
+bool pwm_output_on()
+{
+    return pending_tccr4a & 0b00010000;
+}
+
+uint16_t pwm_period()
+{
+    return period_cycles;
+}
+
+uint16_t pwm_duty()
+{
+    if (!pwm_output_on()) {
+        return 0;
+    } else if (!use_ratio) {
+        return duty_cycles;
+    }
+    return ((uint32_t)duty_ticks << prescale_shift) / T4_TICKS_PER_CYCLE;
+}
+
+void pwm_set_duty(uint16_t duty)
+{
+    use_ratio = false;
+    duty_cycles = duty;
+    uint32_t ticks = ((uint32_t)duty * T4_TICKS_PER_CYCLE) >> prescale_shift;
+    if (duty && !ticks) {
+        ticks = 1;
+    }
+    load_duty(ticks > top ? top : ticks, 0);
+}
+
+void pwm_set_ratio(uint16_t ratio)
+{
+    use_ratio = true;
+    duty_ratio = ratio;
+    // Stretch to 0..65536 so full scale covers the whole period; result is
+    // in 1/65536 tick units.
+    uint32_t fine = ((uint32_t)ratio + (ratio >> 15)) * (top + 1);
+    if (dither) {
+        load_duty(fine >> 16, (uint8_t)(fine >> 8));
+    } else {
+        load_duty((fine + 32768) >> 16, 0);
+    }
+}
+
+void pwm_set_period(uint16_t period, bool sync)
+{
+    // OCR4C and OCR4B are both double-buffered, so there's no need to treat
+    // sync differently.
+    (void)sync;
+
+    uint32_t ticks = ((uint32_t)(uint16_t)(period - 1) + 1) * T4_TICKS_PER_CYCLE;
+    uint8_t shift = 0;
+    while (ticks > T4_MAX_TOP + 1) {
+        ticks >>= 1;
+        shift++;
+    }
+
+    uint8_t old_tccr4e = TCCR4E;
+    TCCR4E = old_tccr4e | _BV(TLOCK4);
+    period_cycles = period;
+    top = ticks - 1;
+    TC4H = top >> 8;
+    OCR4C = (uint8_t)top;
+    if (shift != prescale_shift) {
+        // The prescaler is not buffered, so the period in progress will come
+        // out a bit off.
+        prescale_shift = shift;
+        TCCR4B = shift + 1;     // CS4[3:0]
+    }
+    if (use_ratio) {
+        pwm_set_ratio(duty_ratio);
+    } else {
+        pwm_set_duty(duty_cycles);
+    }
+    TCCR4E = old_tccr4e;
+}
+
+bool pwm_update_pending()
+{
+    return TCCR4A != pending_tccr4a;
+}
+
+void pwm_lock()
+{
+    TCCR4E |= _BV(TLOCK4);
+}
+
+void pwm_unlock()
+{
+    TCCR4E &= ~_BV(TLOCK4);
+}
+
+#endif
+
+bool pwm_dither()
+{
+    return dither;
+}
+
+void pwm_set_dither(bool enable)
+{
+    // Takes effect on the next change of duty ratio
+    dither = enable;
+}
@@ -0,0 +1,31 @@
+#ifndef PwmOutput_h
+#define PwmOutput_h
+
+#include <stdint.h>
+
+//
+// Duty and period are in units of 16MHz clock cycles no matter which timer
+// is generating the output. A period of 0 means 65536.
+//
+// Unless noted, changes take effect at the end of the current PWM period.
+// They are only safe to call with interrupts disabled.
+//
+
+void pwm_begin();
+bool pwm_output_on();
+uint16_t pwm_period();
+uint16_t pwm_duty();
+void pwm_set_duty(uint16_t duty);
+// Duty as fraction of period, 0..65535 = 0..100%
+void pwm_set_ratio(uint16_t ratio);
+// If not sync, restarts the PWM period immediately (where the timer allows)
+void pwm_set_period(uint16_t period, bool sync);
+bool pwm_update_pending();
+// Dither between adjacent duty values to hit a ratio more precisely
+bool pwm_dither();
+void pwm_set_dither(bool enable);
+// Hold off applying changes so a group of them land on the same period
+void pwm_lock();
+void pwm_unlock();
+
+#endif
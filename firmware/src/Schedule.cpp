@@ -0,0 +1,151 @@
+//
+// Scheduled duty changes
+//
+// The host queues duty changes for set times ahead, so a fleet of fans can
+// be started in a precise stagger, or all changed on the same USB frame,
+// without USB request timing getting in the way. Once the next one is close
+// enough, a Timer3 compare match goes off at its time and sets the duty,
+// which the PWM timer's overflow interrupt then puts out at the end of the
+// current period, the same as for any other duty change.
+//
+
+#include <Arduino.h>
+
+#include "Schedule.h"
+#include "Calibration.h"
+#include "Counters.h"
+#include "FrameClock.h"
+#include "UsbPwmDevice.h"
+
+// Timer3 counts per microsecond
+#define TICKS_PER_US (F_CPU / 1000000 / COUNTERS_TICK_CYCLES)
+// Timer3 wraps every 32.768 ms, so only arm the compare for changes this
+// close
+#define ARM_US 16000
+// Closer than this, the compare could be missed while setting it up, so
+// just apply it
+#define MIN_WAIT_US 8
+
+// Sent to the host as is, all values little-endian
+struct Entry {
+    uint32_t when_us;
+    uint16_t ratio;
+};
+
+static Entry entries[SCHEDULE_ENTRIES];
+static uint8_t count;
+
+static void remove_first()
+{
+    count--;
+    memmove(&entries[0], &entries[1], count * sizeof(entries[0]));
+}
+
+// Apply whatever is due and set the compare up for the next one if it's
+// close; only call with interrupts disabled
+static void arm(bool first_due)
+{
+    TIMSK3 &= ~_BV(OCIE3A);
+    while (count) {
+        int32_t wait_us = first_due ? 0 : (int32_t)(entries[0].when_us - micros());
+        first_due = false;
+        if (wait_us > ARM_US) {
+            // schedule_poll will come back to it
+            return;
+        }
+        if (wait_us >= MIN_WAIT_US) {
+            OCR3A = TCNT3 + (uint16_t)wait_us * TICKS_PER_US;
+            TIFR3 = _BV(OCF3A);
+            TIMSK3 |= _BV(OCIE3A);
+            return;
+        }
+        // Host is taking over the fan, as for a duty register write
+        calibration_abort();
+        TheUsbPwmDevice.setDutyRatio(entries[0].ratio);
+        remove_first();
+    }
+}
+
+ISR(TIMER3_COMPA_vect)
+{
+    // micros() only counts in steps of 4, so may not have quite caught up
+    // with the compare
+    arm(true);
+}
+
+void schedule_clear()
+{
+    uint8_t old_sreg = SREG;
+    cli();
+    count = 0;
+    TIMSK3 &= ~_BV(OCIE3A);
+    SREG = old_sreg;
+}
+
+// Called from the setup handler, with interrupts disabled
+bool schedule_add(const uint8_t* data, uint8_t length)
+{
+    if (length == 1 && data[0] == SCHEDULE_FLAG_CLEAR) {
+        schedule_clear();
+        return true;
+    }
+    if (length != SCHEDULE_WRITE_LENGTH) {
+        return false;
+    }
+    uint8_t flags = data[0];
+    unsigned long when_us;
+    uint16_t ratio;
+    memcpy(&when_us, data + 1, sizeof(when_us));
+    memcpy(&ratio, data + 5, sizeof(ratio));
+    if ((flags & SCHEDULE_FLAG_FRAME) && !frame_clock_device_time(when_us, &when_us)) {
+        // Can't tell when that frame is
+        return false;
+    }
+    if ((int32_t)(when_us - micros()) < 0) {
+        // Already too late
+        return false;
+    }
+
+    if (flags & SCHEDULE_FLAG_CLEAR) {
+        count = 0;
+    }
+    if (count == SCHEDULE_ENTRIES) {
+        return false;
+    }
+    // Keep soonest first; same time goes after what's already there
+    uint8_t i = count;
+    while (i && (int32_t)(when_us - entries[i - 1].when_us) < 0) {
+        entries[i] = entries[i - 1];
+        i--;
+    }
+    entries[i].when_us = when_us;
+    entries[i].ratio = ratio;
+    count++;
+    arm(false);
+    return true;
+}
+
+void schedule_poll()
+{
+    if (!count || (TIMSK3 & _BV(OCIE3A))) {
+        return;
+    }
+    uint8_t old_sreg = SREG;
+    cli();
+    arm(false);
+    SREG = old_sreg;
+}
+
+bool schedule_read(int(*send)(uint8_t, const void*, int))
+{
+    // One send, as the serial console's only keeps the last
+    uint8_t reply[SCHEDULE_READ_LENGTH];
+    static_assert(sizeof(entries) + 1 == sizeof(reply), "schedule length mismatch");
+    uint8_t old_sreg = SREG;
+    cli();
+    uint8_t length = 1 + count * sizeof(entries[0]);
+    reply[0] = count;
+    memcpy(reply + 1, entries, length - 1);
+    SREG = old_sreg;
+    return send(0, reply, length) >= 0;
+}
@@ -0,0 +1,25 @@
+#ifndef Schedule_h
+#define Schedule_h
+
+#include <stdint.h>
+
+// Duty changes that can be queued at once
+#define SCHEDULE_ENTRIES 8
+
+// Bytes in a schedule write: u8 flags, u32 when, u16 duty ratio
+#define SCHEDULE_WRITE_LENGTH 7
+// when is a frame count, as the frame clock gives, not a micros() time
+#define SCHEDULE_FLAG_FRAME 0x01
+// Drop everything queued first; on its own, a write of just the flags
+#define SCHEDULE_FLAG_CLEAR 0x80
+
+// Bytes sent by schedule_read: u8 count, then u32 micros() time, u16 duty
+// ratio for each queued change, soonest first
+#define SCHEDULE_READ_LENGTH (1 + SCHEDULE_ENTRIES * 6)
+
+void schedule_clear();
+bool schedule_add(const uint8_t* data, uint8_t length);
+void schedule_poll();
+bool schedule_read(int(*send)(uint8_t, const void*, int));
+
+#endif
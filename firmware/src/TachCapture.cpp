@@ -0,0 +1,138 @@
+//
+// Raw tachometer edge capture
+//
+// While running, the time between every pair of tach edges is logged to a
+// ring buffer, as 16-bit counts of CAPTURE_TICK_US. The main loop moves the
+// intervals out to the host through a bulk IN endpoint, a packet at a time,
+// so draining never holds up the tach interrupt the way a long control read
+// would.
+//
+
+#include <Arduino.h>
+
+#include "TachCapture.h"
+
+#include "USBAPI.h"
+#include "USBCore.h"
+
+// One byte indices wrap around by themselves, at the cost of one entry
+#define CAPTURE_ENTRIES 256
+#define PACKET_ENTRIES (USB_EP_SIZE / 2)
+// Send part packets once intervals have been waiting this long
+#define CAPTURE_FLUSH_MS 50
+
+static uint16_t buffer[CAPTURE_ENTRIES];
+// head is written by the tach interrupt, tail by the main loop
+static volatile uint8_t head;
+static volatile uint8_t tail;
+static volatile uint8_t state;
+// Bumped by every start, so the main loop can tell its view is stale
+static volatile uint8_t generation;
+static bool have_edge;
+static bool lost_edges;
+static unsigned long last_edge;
+static uint16_t dropped;
+static unsigned long waiting_since;
+
+void capture_start()
+{
+    uint8_t old_sreg = SREG;
+    cli();
+    head = tail = 0;
+    generation++;
+    have_edge = false;
+    lost_edges = false;
+    dropped = 0;
+    state = CAPTURE_STATE_RUNNING;
+    SREG = old_sreg;
+}
+
+void capture_stop()
+{
+    // Whatever is already buffered still gets sent
+    state = CAPTURE_STATE_STOPPED;
+}
+
+// Called from the tach interrupt
+void capture_edge(unsigned long time)
+{
+    if (state != CAPTURE_STATE_RUNNING) {
+        return;
+    }
+    unsigned long ticks = (time - last_edge) / CAPTURE_TICK_US;
+    last_edge = time;
+    if (!have_edge) {
+        // Need two edges for an interval
+        have_edge = true;
+        return;
+    }
+    uint8_t next = head + 1;
+    if (next == tail) {
+        // Buffer full, host isn't keeping up
+        if (dropped < 0xffff) {
+            dropped++;
+        }
+        lost_edges = true;
+        return;
+    }
+    if (lost_edges || ticks >= CAPTURE_GAP) {
+        buffer[head] = CAPTURE_GAP;
+        lost_edges = false;
+    } else {
+        buffer[head] = (uint16_t)ticks;
+    }
+    head = next;
+}
+
+void capture_poll(unsigned long now, uint8_t endpoint)
+{
+    uint8_t gen = generation;
+    uint8_t first = tail;
+    uint8_t count = head - first;
+    if (count == 0) {
+        waiting_since = now;
+        return;
+    }
+    // Fill whole packets where possible, rather than sending every
+    // interval on its own
+    if (count < PACKET_ENTRIES && now - waiting_since < CAPTURE_FLUSH_MS) {
+        return;
+    }
+    // Host hasn't taken the last packet yet; don't block on it
+    if (USB_SendSpace(endpoint) < USB_EP_SIZE) {
+        return;
+    }
+
+    uint16_t packet[PACKET_ENTRIES];
+    if (count > PACKET_ENTRIES) {
+        count = PACKET_ENTRIES;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        packet[i] = buffer[(uint8_t)(first + i)];
+    }
+    if (USB_Send(endpoint | TRANSFER_RELEASE, packet, count * sizeof(packet[0])) < 0) {
+        return;
+    }
+
+    uint8_t old_sreg = SREG;
+    cli();
+    // A restart while sending means these entries are gone already
+    if (generation == gen) {
+        tail = first + count;
+    }
+    SREG = old_sreg;
+    waiting_since = now;
+}
+
+uint8_t capture_state()
+{
+    return state;
+}
+
+bool capture_read_status(int(*send)(uint8_t, const void*, int))
+{
+    // Buffered intervals, then edges lost since start
+    uint16_t status[2] = { (uint8_t)(head - tail), dropped };
+    static_assert(sizeof(status) == CAPTURE_STATUS_LENGTH, "capture status length mismatch");
+    return send(0, status, sizeof(status)) >= 0;
+}
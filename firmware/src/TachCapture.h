@@ -0,0 +1,23 @@
+#ifndef TachCapture_h
+#define TachCapture_h
+
+#include <stdint.h>
+
+#define CAPTURE_STATE_STOPPED 0
+#define CAPTURE_STATE_RUNNING 1
+
+// Intervals are counted in these units, which is the resolution of micros()
+#define CAPTURE_TICK_US 4
+// Interval too long to count, or some edges before it were lost
+#define CAPTURE_GAP 0xffff
+// Bytes sent by capture_read_status
+#define CAPTURE_STATUS_LENGTH 4
+
+void capture_start();
+void capture_stop();
+void capture_edge(unsigned long time);
+void capture_poll(unsigned long now, uint8_t endpoint);
+uint8_t capture_state();
+bool capture_read_status(int(*send)(uint8_t, const void*, int));
+
+#endif
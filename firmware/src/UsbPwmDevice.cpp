@@ -5,6 +5,16 @@
 #include <Arduino.h>
 
 #include "UsbPwmDevice.h"
+#include "BootDuty.h"
+#include "Calibration.h"
+#include "Counters.h"
+#include "FirmwareImage.h"
+#include "FrameClock.h"
+#include "History.h"
+#include "Identity.h"
+#include "PwmOutput.h"
+#include "Schedule.h"
+#include "TachCapture.h"
 
 #include "PluggableUSB.h"
 #include "USBCore.h"
@@ -20,23 +30,56 @@
 #define SERIAL_BYTES ISERIAL_MAX_LEN
 #endif
 
+static_assert(IDENTITY_SERIAL_MAX <= ISERIAL_MAX_LEN, "configured serial number too long");
+
+// String descriptor index of the interface name, clear of the core's
+#define INAME 0x10
+
 #define NUM_PULSE_TIMES 16
 
-static uint8_t pending_tccr1a;
+// Bits of stagedMask
+#define STAGED_DUTY 0x01
+#define STAGED_PERIOD 0x02
+#define STAGED_RATIO 0x04
+#define STAGED_MODE 0x08
 
-ISR(TIMER1_OVF_vect)
-{
-    TCCR1A = pending_tccr1a;
-    TIMSK1 = 0;
-}
+// A staged set left open this long is dropped, so a host that goes away
+// part way through doesn't leave every later PWM write held up
+#define STAGE_TIMEOUT_MS 250
 
 static uint8_t pulse_index;
 static unsigned long pulse_times[NUM_PULSE_TIMES];
 static volatile unsigned long last_pulse;
 static volatile unsigned long pulse_delta;
 
+// Revolution period statistics since last read, all in units of
+// STATS_TICK_US, sent to the host as is
+#define STATS_TICK_US 4
+static struct {
+    uint16_t count;
+    uint16_t min;
+    uint16_t max;
+    uint32_t sum;
+    uint64_t sum_squares;
+} period_stats = { 0, 0xffff, 0, 0, 0 };
+
+// Tach reading along with when it was taken, in micros() time, all taken
+// together in one read so hosts can tell how fresh it is, work out rates
+// from it and line up readings from several boards. Sent to the host as
+// is, all values little-endian.
+struct TachSample {
+    uint32_t now_us;
+    // 0 if there hasn't been one yet
+    uint32_t edge_us;
+    // Time taken by the last NUM_PULSE_TIMES edges
+    uint32_t span_us;
+    uint16_t rpm;
+    uint16_t duty_ratio;
+};
+
 ISR(INT1_vect)
 {
+    uint16_t start = counters_now();
     uint8_t i = (pulse_index + 1) % NUM_PULSE_TIMES;
     pulse_index = i;
     unsigned long old_time = pulse_times[i];
@@ -44,24 +87,61 @@ ISR(INT1_vect)
     last_pulse = new_time;
     pulse_times[i] = new_time;
     pulse_delta = new_time - old_time;
+    capture_edge(new_time);
+
+    // 2 pulses per revolution; anything longer than 16 bits can count is a
+    // near stall, and gets counted as the longest
+    unsigned long rev_ticks =
+        (new_time - pulse_times[(i + NUM_PULSE_TIMES - 2) % NUM_PULSE_TIMES]) / STATS_TICK_US;
+    uint16_t period = rev_ticks > 0xffff ? 0xffff : (uint16_t)rev_ticks;
+    if (period < period_stats.min) {
+        period_stats.min = period;
+    }
+    if (period > period_stats.max) {
+        period_stats.max = period;
+    }
+    // Keep mean and variance consistent by freezing them if the host stops
+    // reading; 16x16 bit multiply keeps this cheap enough for every edge
+    if (period_stats.count != 0xffff) {
+        period_stats.count++;
+        period_stats.sum += period;
+        period_stats.sum_squares += (uint32_t)period * period;
+    }
+    counters_tach_edge(start);
 }
 
-UsbPwmDevice::UsbPwmDevice(void) : PluggableUSBModule(0, 1, NULL), ledMode(0)
+UsbPwmDevice::UsbPwmDevice(void) : PluggableUSBModule(1, 1, endpointTypes), ledMode(0),
+    ratioMode(false), dutyRatio(0), stageState(STAGE_IDLE), stagedMask(0)
 {
+    // Tach edge capture data
+    endpointTypes[0] = EP_TYPE_BULK_IN;
     PluggableUSB().plug(this);
 }
 
 int UsbPwmDevice::getInterface(uint8_t* interfaceCount)
 {
     *interfaceCount += 1;
-    InterfaceDescriptor iface =
-        D_INTERFACE(pluggedInterface, 0, USB_DEVICE_CLASS_VENDOR_SPECIFIC, 0xFD, 0xFF);
-    return USB_SendControl(0, &iface, sizeof(iface));
+    struct {
+        InterfaceDescriptor iface;
+        EndpointDescriptor capture;
+    } descriptors = {
+        D_INTERFACE(pluggedInterface, 1, USB_DEVICE_CLASS_VENDOR_SPECIFIC, 0xFD, 0xFF),
+        D_ENDPOINT(USB_ENDPOINT_IN(pluggedEndpoint), USB_ENDPOINT_TYPE_BULK, USB_EP_SIZE, 0)
+    };
+    const char* name;
+    if (identity_get(IDENTITY_NAME, &name)) {
+        // Shows up as the interface string, e.g. in sysfs on Linux
+        descriptors.iface.iInterface = INAME;
+    }
+    return USB_SendControl(0, &descriptors, sizeof(descriptors));
 }
 
 #define VERSION_MAJOR 0
-#define VERSION_MINOR 1
-static const uint8_t version[2] PROGMEM = { VERSION_MINOR, VERSION_MAJOR };
+#define VERSION_MINOR 3
+
+// PluggableUSB numbers its modules' interfaces from just after the CDC
+// ones, which aren't there at all in builds with CDC_DISABLED
+#define FAN_INTERFACE (CDC_ACM_INTERFACE + CDC_INTERFACE_COUNT)
 
 //
 // USB Binary Device Object Store (BOS) descriptor.
@@ -75,14 +155,19 @@ static const uint8_t version[2] PROGMEM = { VERSION_MINOR, VERSION_MAJOR };
 // Note that use of this descriptor is usually conditional on the device
 // reporting its USB version as at least 2.1.
 //
+// The fan interface's capability ends with the version, interface number,
+// capability bits and number of fan channels, so hosts can pick what to use
+// without asking the device anything more.
+//
 const uint8_t BOS_DESCRIPTOR[] PROGMEM = {
-    0x05, 0x0f, 0x38, 0x00, 0x02, 0x1c, 0x10, 0x05,
+    0x05, 0x0f, 0x3b, 0x00, 0x02, 0x1c, 0x10, 0x05,
     0x00, 0xdf, 0x60, 0xdd, 0xd8, 0x89, 0x45, 0xc7,
     0x4c, 0x9c, 0xd2, 0x65, 0x9d, 0x9e, 0x64, 0x8a,
     0x9f, 0x00, 0x00, 0x03, 0x06, 0xb2, 0x00, 0x02,
-    0x00, 0x17, 0x10, 0x05, 0x00, 0x3b, 0xf9, 0xd9,
+    0x00, 0x1a, 0x10, 0x05, 0x00, 0x3b, 0xf9, 0xd9,
     0x1a, 0x4c, 0x49, 0xda, 0x4d, 0xa1, 0xe5, 0x2e,
-    0x2b, 0xab, 0x18, 0x10, 0x52, VERSION_MINOR, VERSION_MAJOR, 0x02
+    0x2b, 0xab, 0x18, 0x10, 0x52, VERSION_MINOR, VERSION_MAJOR, FAN_INTERFACE,
+    CAPABILITIES & 0xff, CAPABILITIES >> 8, FAN_CHANNELS
 };
 
 //
@@ -100,7 +185,7 @@ const uint8_t BOS_DESCRIPTOR[] PROGMEM = {
 const uint8_t MS_OS_20_DESCRIPTORS[] PROGMEM = {
     0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x06,
     0xb2, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00,
-    0xa8, 0x00, 0x08, 0x00, 0x02, 0x00, 0x02, 0x00,
+    0xa8, 0x00, 0x08, 0x00, 0x02, 0x00, FAN_INTERFACE, 0x00,
     0xa0, 0x00, 0x14, 0x00, 0x03, 0x00, 0x57, 0x49,
     0x4e, 0x55, 0x53, 0x42, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x84, 0x00,
@@ -128,118 +213,550 @@ int UsbPwmDevice::getDescriptor(USBSetup& setup)
     if (setup.wValueH == 0x0F && setup.wValueL == 0 && setup.wIndex == 0) {
         return USB_SendControl(TRANSFER_PGM, &BOS_DESCRIPTOR, sizeof(BOS_DESCRIPTOR));
     }
+    const char* name;
+    uint8_t length;
+    if (setup.wValueH == USB_STRING_DESCRIPTOR_TYPE && setup.wValueL == INAME &&
+        (length = identity_get(IDENTITY_NAME, &name))) {
+        // The core's own string descriptor sender is private to it, so this
+        // widens the ASCII name to UTF-16 itself
+        uint8_t header[2] = { (uint8_t)(2 + 2 * length), USB_STRING_DESCRIPTOR_TYPE };
+        if (USB_SendControl(0, header, sizeof(header)) < 0) {
+            return -1;
+        }
+        for (uint8_t i = 0; i < length; i++) {
+            uint8_t c[2] = { (uint8_t)name[i], 0 };
+            if (USB_SendControl(0, c, sizeof(c)) < 0) {
+                return -1;
+            }
+        }
+        return 1;
+    }
     return 0;
 }
 
-bool UsbPwmDevice::readRegister(uint8_t reg, int(*send)(uint8_t, const void*, int))
-{
-    if (reg == 0x00) {
-        return send(TRANSFER_PGM, &version, sizeof(version)) >= 0;
-    } else if (reg == 0x10) {
-        uint16_t pwm_duty;
-        if (pending_tccr1a & 0b10000000) {
-            pwm_duty = OCR1A + 1;
-        } else {
-            pwm_duty = 0;
-        }
-        return send(0, &pwm_duty, sizeof(pwm_duty)) >= 0;
-    } else if (reg == 0x11) {
-        uint16_t pwm_period = ICR1 + 1;
-        return send(0, &pwm_period, sizeof(pwm_period)) >= 0;
-    } else if (reg == 0x12) {
-        // Interrupts are disabled, so can access these without worrying about
-        // atomicity
-        unsigned long delta = pulse_delta;
-        unsigned long check_time = pulse_times[pulse_index];
+// The schema register sends the leading fields of each table entry as is,
+// as many as fit in a control packet
+#define SCHEMA_ENTRY_LENGTH 7
+#define SCHEMA_READ_LENGTH (2 + (64 - 2) / SCHEMA_ENTRY_LENGTH * SCHEMA_ENTRY_LENGTH)
 
-        uint16_t rpm;
-        if (delta == 0 || micros() - check_time > 1000000) {
-            // No pulse in over a second, assume stalled
-            rpm = 0;
+//
+// Register table
+//
+// Sorted by register number, which is how findRegister looks them up.
+// Access, range and staging are checked from the flags before a handler
+// gets called, so handlers only do the register's own work.
+//
+const UsbPwmDevice::RegisterInfo UsbPwmDevice::registers[] PROGMEM = {
+    { 0x00, REG_READ, 2, 0, 0, getVersion, NULL, NULL },
+    { 0x01, REG_READ | REG_BLOCK, SCHEMA_READ_LENGTH, 0, 0, NULL, readSchema, NULL },
+    { 0x02, REG_READ | REG_BLOCK, 4, 0, 0, NULL, readCapabilities, NULL },
+    { 0x03, REG_READ | REG_BLOCK, IMAGE_INFO_LENGTH, 0, 0, NULL, readImage, NULL },
+    { 0x10, REG_READ | REG_WRITE | REG_STAGED | REG_FAN_CONTROL, 2, 0, 0xffff,
+      pwm_duty, NULL, writeDuty },
+    { 0x11, REG_READ | REG_WRITE | REG_STAGED, 2, 0, 0xffff, pwm_period, NULL, writePeriod },
+    { 0x12, REG_READ, 2, 0, 0, getTachometer, NULL, NULL },
+    { 0x13, REG_READ | REG_WRITE, 2, STAGE_IDLE, STAGE_COMMIT, getStage, NULL, writeStage },
+    { 0x14, REG_READ | REG_WRITE | REG_STAGED | REG_FAN_CONTROL, 2, 0, 0xffff,
+      getRatio, NULL, writeRatio },
+    { 0x15, REG_READ | REG_WRITE | REG_STAGED, 2, 0, PWM_MODE_MASK, getMode, NULL, writeMode },
+    { 0x16, REG_READ | REG_BLOCK | REG_CLEAR_ON_READ, sizeof(period_stats), 0, 0,
+      NULL, readStats, NULL },
+    { 0x17, REG_READ | REG_WRITE, 2, 0, 0xffff, boot_duty, NULL, boot_set_duty },
+    { 0x18, REG_READ | REG_BLOCK, BOOT_TIMES_LENGTH, 0, 0, NULL, readBootTimes, NULL },
+    { 0x19, REG_READ | REG_BLOCK, sizeof(TachSample), 0, 0, NULL, readTachSample, NULL },
+    { 0x1a, REG_READ | REG_BLOCK, FRAME_CLOCK_LENGTH, 0, 0, NULL, readFrameClock, NULL },
+    { 0x1b, REG_READ | REG_BLOCK | REG_WRITE_BLOCK, SCHEDULE_READ_LENGTH, 0, 0, NULL, readSchedule,
+      NULL, writeSchedule },
+    { 0x20, REG_READ | REG_WRITE, 2, 0, 1, getCalibration, NULL, writeCalibration },
+    { 0x21, REG_READ | REG_BLOCK, CAL_TABLE_LENGTH, 0, 0, NULL, readCalibrationTable, NULL },
+    { 0x30, REG_READ | REG_WRITE, 2, 0, 1, getCapture, NULL, writeCapture },
+    { 0x31, REG_READ | REG_BLOCK, CAPTURE_STATUS_LENGTH, 0, 0, NULL, readCaptureStatus, NULL },
+    { 0x40, REG_READ | REG_WRITE, 2, 0, 0xffff, history_interval, NULL, history_set_interval },
+    { 0x41, REG_READ | REG_BLOCK, HISTORY_READ_LENGTH, 0, 0, NULL, history_read, NULL },
+    { 0x50, REG_READ | REG_WRITE | REG_BLOCK, COUNTERS_LENGTH, 0, 0, NULL, readCounters,
+      writeCounters },
+    { 0xf0, REG_WRITE, 2, 0, 0xffff, NULL, NULL, writeReset },
+    { 0xf1, REG_READ | REG_WRITE, 2, 0, LED_MODE_MAX, getLed, NULL, writeLed },
+    { 0xf8, REG_READ | REG_BLOCK | REG_WRITE_BLOCK, SERIAL_BYTES, 0, 0, NULL, readSerialNumber,
+      NULL, writeSerialNumber },
+    { 0xf9, REG_READ | REG_BLOCK | REG_WRITE_BLOCK, IDENTITY_TEXT_MAX, 0, 0, NULL, readName,
+      NULL, writeName },
+    { 0xfa, REG_READ | REG_BLOCK | REG_WRITE_BLOCK, IDENTITY_TEXT_MAX, 0, 0, NULL, readLocation,
+      NULL, writeLocation },
+};
+
+#define REGISTER_COUNT (sizeof(registers) / sizeof(registers[0]))
+
+bool UsbPwmDevice::findRegister(uint8_t reg, RegisterInfo& info)
+{
+    uint8_t low = 0;
+    uint8_t high = REGISTER_COUNT;
+    while (low < high) {
+        uint8_t mid = (low + high) / 2;
+        uint8_t mid_reg = pgm_read_byte(&registers[mid].reg);
+        if (mid_reg < reg) {
+            low = mid + 1;
+        } else if (mid_reg > reg) {
+            high = mid;
         } else {
-            // 2 pulses per revolution
-            rpm = (unsigned long)60000000*(NUM_PULSE_TIMES/2)/delta;
+            memcpy_P(&info, &registers[mid], sizeof(info));
+            return true;
         }
-        return send(0, &rpm, sizeof(rpm)) >= 0;
-    } else if (reg == 0xf1) {
-        uint16_t mode = ledMode;
-        return send(0, &mode, sizeof(mode)) >= 0;
-    } else if (reg == 0xf8) {
-        char buf[SERIAL_BYTES];
-        getShortName(buf);
-        return send(0, buf, SERIAL_BYTES) >= 0;
     }
     return false;
 }
 
+// value is the wValue of the read request, 0 from the serial console
+bool UsbPwmDevice::readRegister(uint8_t reg, uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    RegisterInfo info;
+    if (!findRegister(reg, info) || !(info.flags & REG_READ)) {
+        return false;
+    }
+    if (info.flags & REG_BLOCK) {
+        return info.read(value, send);
+    }
+    uint16_t data = info.get();
+    return send(0, &data, sizeof(data)) >= 0;
+}
+
 bool UsbPwmDevice::writeRegister(uint8_t reg, uint16_t value)
 {
-    if (reg == 0x10) {
-        // Set PWM duty high time
-        uint8_t new_tccr1a;
-        if (value) {
-            new_tccr1a = 0b10000010;    // COM1A[1:0] = 10, WGM1[1:0] = 10
-            OCR1A = value - 1;
-        } else {
-            // Special case for value 0: turn PWM off
-            new_tccr1a = 0b00000010;    // COM1A[1:0] = 00, WGM1[1:0] = 10
-        }
-        if (pending_tccr1a != new_tccr1a) {
-            if (value) {
-                // Fan was not running before, so prime the stall detection
-                pulse_times[pulse_index] = micros();
-            }
-            // TCCR1A is not double-buffered the way OCR1A is, so defer
-            // update to the end of this PWM period.
-            pending_tccr1a = new_tccr1a;
-            TIFR1 = _BV(TOV1);
-            TIMSK1 = _BV(TOIE1);
-        }
+    RegisterInfo info;
+    if (!findRegister(reg, info) || !(info.flags & REG_WRITE) ||
+        value < info.min || value > info.max) {
+        return false;
+    }
+    if (info.flags & REG_FAN_CONTROL) {
+        // Host is taking over the fan
+        calibration_abort();
+    }
+    expireStage();
+    if ((info.flags & REG_STAGED) && stageState == STAGE_OPEN) {
+        // Hold PWM settings until commit so they all land together
+        stageWrite(reg, value);
         return true;
+    }
+    return info.write(value);
+}
+
+// data is what came in the data stage of the write request
+bool UsbPwmDevice::writeRegisterBlock(uint8_t reg, const uint8_t* data, uint8_t length)
+{
+    RegisterInfo info;
+    if (!findRegister(reg, info) || !(info.flags & REG_WRITE_BLOCK) || length > info.length) {
+        return false;
+    }
+    return info.writeBlock(data, length);
+}
+
+//
+// Register handlers
+//
+
+uint16_t UsbPwmDevice::getVersion()
+{
+    return (VERSION_MAJOR << 8) | VERSION_MINOR;
+}
+
+bool UsbPwmDevice::readSchema(uint16_t first, int(*send)(uint8_t, const void*, int))
+{
+    // Entries starting from table index first, after the total count and the
+    // index actually sent from
+    static_assert(offsetof(RegisterInfo, get) == SCHEMA_ENTRY_LENGTH,
+                  "register table layout doesn't match schema");
+    uint8_t reply[SCHEMA_READ_LENGTH];
+    uint8_t length = 2;
+    reply[0] = REGISTER_COUNT;
+    reply[1] = first < REGISTER_COUNT ? first : REGISTER_COUNT;
+    for (uint8_t i = reply[1]; i < REGISTER_COUNT && length < sizeof(reply); i++) {
+        memcpy_P(&reply[length], &registers[i], SCHEMA_ENTRY_LENGTH);
+        length += SCHEMA_ENTRY_LENGTH;
+    }
+    return send(0, reply, length) >= 0;
+}
+
+bool UsbPwmDevice::readCapabilities(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    // Same as in the BOS descriptor, for hosts that can't see that, plus
+    // the tach capture endpoint
+    struct {
+        uint16_t capabilities;
+        uint8_t channels;
+        uint8_t capture_endpoint;
+    } reply = { CAPABILITIES, FAN_CHANNELS, USB_ENDPOINT_IN(TheUsbPwmDevice.pluggedEndpoint) };
+    return send(0, &reply, sizeof(reply)) >= 0;
+}
+
+bool UsbPwmDevice::readImage(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    return image_read(send);
+}
+
+uint16_t UsbPwmDevice::getTachometer()
+{
+    return TheUsbPwmDevice.getRpm();
+}
+
+uint16_t UsbPwmDevice::getStage()
+{
+    // Report commit as pending until the overflow interrupt applies it
+    TheUsbPwmDevice.expireStage();
+    return pwm_update_pending() ? STAGE_COMMIT : TheUsbPwmDevice.stageState;
+}
+
+uint16_t UsbPwmDevice::getRatio()
+{
+    return TheUsbPwmDevice.getDutyRatio();
+}
+
+uint16_t UsbPwmDevice::getMode()
+{
+    return pwm_dither() ? PWM_MODE_DITHER : 0;
+}
+
+bool UsbPwmDevice::readStats(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    // Reset on read, so each read covers the time since the last one
+    bool rv = send(0, &period_stats, sizeof(period_stats)) >= 0;
+    period_stats.count = 0;
+    period_stats.min = 0xffff;
+    period_stats.max = 0;
+    period_stats.sum = 0;
+    period_stats.sum_squares = 0;
+    return rv;
+}
+
+bool UsbPwmDevice::readBootTimes(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    return boot_read_times(send);
+}
+
+bool UsbPwmDevice::readTachSample(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    // Interrupts are disabled, so no edge can come in part way through
+    TachSample sample;
+    sample.now_us = micros();
+    sample.edge_us = last_pulse;
+    sample.span_us = pulse_delta;
+    sample.rpm = TheUsbPwmDevice.getRpm();
+    sample.duty_ratio = TheUsbPwmDevice.getDutyRatio();
+    return send(0, &sample, sizeof(sample)) >= 0;
+}
+
+bool UsbPwmDevice::readFrameClock(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    return frame_clock_read(send);
+}
+
+bool UsbPwmDevice::readSchedule(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    return schedule_read(send);
+}
+
+uint16_t UsbPwmDevice::getCalibration()
+{
+    return calibration_state();
+}
+
+bool UsbPwmDevice::readCalibrationTable(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    return calibration_read(send);
+}
+
+uint16_t UsbPwmDevice::getCapture()
+{
+    return capture_state();
+}
+
+bool UsbPwmDevice::readCaptureStatus(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    return capture_read_status(send);
+}
+
+bool UsbPwmDevice::readCounters(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    return counters_read(send);
+}
+
+uint16_t UsbPwmDevice::getLed()
+{
+    return TheUsbPwmDevice.ledMode;
+}
+
+bool UsbPwmDevice::readSerialNumber(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    char buf[SERIAL_BYTES];
+    return send(0, buf, TheUsbPwmDevice.getShortName(buf)) >= 0;
+}
+
+bool UsbPwmDevice::readName(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    const char* name;
+    uint8_t length = identity_get(IDENTITY_NAME, &name);
+    return send(0, name, length) >= 0;
+}
+
+bool UsbPwmDevice::readLocation(uint16_t value, int(*send)(uint8_t, const void*, int))
+{
+    (void)value;
+    const char* location;
+    uint8_t length = identity_get(IDENTITY_LOCATION, &location);
+    return send(0, location, length) >= 0;
+}
+
+uint16_t UsbPwmDevice::getRpm()
+{
+    // Interrupts are disabled, so can access these without worrying about
+    // atomicity
+    unsigned long delta = pulse_delta;
+    unsigned long check_time = pulse_times[pulse_index];
+
+    if (delta == 0 || micros() - check_time > 1000000) {
+        // No pulse in over a second, assume stalled
+        return 0;
+    }
+    // 2 pulses per revolution
+    return (unsigned long)60000000*(NUM_PULSE_TIMES/2)/delta;
+}
+
+unsigned long UsbPwmDevice::getRpmSince()
+{
+    // Interrupts are disabled, as for getRpm
+    return pulse_times[pulse_index] - pulse_delta;
+}
+
+uint16_t UsbPwmDevice::getDutyRatio()
+{
+    if (ratioMode) {
+        return dutyRatio;
+    }
+    uint32_t period = (uint32_t)(uint16_t)(pwm_period() - 1) + 1;
+    uint16_t duty = pwm_duty();
+    if (duty >= period) {
+        return 0xffff;
+    }
+    return ((uint32_t)duty * 65535 + period / 2) / period;
+}
+
+void UsbPwmDevice::setDuty(uint16_t value, bool ratio)
+{
+    bool was_on = pwm_output_on();
+    ratioMode = ratio;
+    if (ratio) {
+        dutyRatio = value;
+        pwm_set_ratio(value);
+    } else {
+        pwm_set_duty(value);
+    }
+    if (!was_on && pwm_output_on()) {
+        // Fan was not running before, so prime the stall detection
+        pulse_times[pulse_index] = micros();
+    }
+}
+
+void UsbPwmDevice::setPeriod(uint16_t value, bool sync)
+{
+    pwm_set_period(value, sync);
+    if (ratioMode) {
+        // Duty has to follow the period
+        pwm_set_ratio(dutyRatio);
+    }
+}
+
+void UsbPwmDevice::setMode(uint16_t value)
+{
+    pwm_set_dither(value & PWM_MODE_DITHER);
+    if (ratioMode) {
+        pwm_set_ratio(dutyRatio);
+    }
+}
+
+void UsbPwmDevice::commitStaged()
+{
+    pwm_lock();
+    if (stagedMask & STAGED_MODE) {
+        setMode(stagedMode);
+    }
+    if (stagedMask & STAGED_DUTY) {
+        setDuty(stagedDuty, false);
+    } else if (stagedMask & STAGED_RATIO) {
+        setDuty(stagedRatio, true);
+    }
+    if (stagedMask & STAGED_PERIOD) {
+        setPeriod(stagedPeriod, true);
+    }
+    pwm_unlock();
+    stagedMask = 0;
+    stageState = STAGE_IDLE;
+}
+
+void UsbPwmDevice::expireStage()
+{
+    if (stageState == STAGE_OPEN && millis() - stageOpenMs >= STAGE_TIMEOUT_MS) {
+        stagedMask = 0;
+        stageState = STAGE_IDLE;
+    }
+}
+
+void UsbPwmDevice::stageWrite(uint8_t reg, uint16_t value)
+{
+    if (reg == 0x10) {
+        stagedDuty = value;
+        stagedMask = (stagedMask & ~STAGED_RATIO) | STAGED_DUTY;
     } else if (reg == 0x11) {
-        // Set PWM period time
-        ICR1 = value - 1;
-        TCNT1 = 0;
-        return true;
-    } else if (reg == 0xf0) {
-        // Reboot control
-        uint16_t key;
-        if (value == 1) {
-            // Reset configuration to default
-            begin();
-            return true;
-        } else if (value == 2) {
-            // Regular reboot
-            key = 0x0000;
-        } else if (value == 3) {
-            // Reboot into bootloader
-            key = MAGIC_KEY;
-        } else if (value == 255) {
-            // Watchdog test
-        } else {
-            // Silently ignore any other value
-            return true;
-        }
+        stagedPeriod = value;
+        stagedMask |= STAGED_PERIOD;
+    } else if (reg == 0x14) {
+        stagedRatio = value;
+        stagedMask = (stagedMask & ~STAGED_DUTY) | STAGED_RATIO;
+    } else if (reg == 0x15) {
+        stagedMode = value;
+        stagedMask |= STAGED_MODE;
+    }
+}
 
-        cli();
-        // Mimic what CDC_Setup does to invoke bootloader
-        if (value != 255) {
-            *(volatile uint16_t *)(RAMEND-1) = key;
-            *(volatile uint16_t *)MAGIC_KEY_POS = key;
-            wdt_enable(WDTO_15MS);
-        }
-        while (true) {
-            sleep_mode();
-        }
-        // Never returns
-    } else if (reg == 0xf1) {
-        // LED control
-        if (value <= LED_MODE_MAX) {
-            ledMode = (uint8_t)value;
+bool UsbPwmDevice::writeDuty(uint16_t value)
+{
+    // Set PWM duty high time
+    TheUsbPwmDevice.setDuty(value, false);
+    return true;
+}
+
+bool UsbPwmDevice::writePeriod(uint16_t value)
+{
+    // Set PWM period time; if duty has to follow, change both together
+    TheUsbPwmDevice.setPeriod(value, TheUsbPwmDevice.ratioMode);
+    return true;
+}
+
+bool UsbPwmDevice::writeStage(uint16_t value)
+{
+    UsbPwmDevice& dev = TheUsbPwmDevice;
+    if (value == STAGE_COMMIT) {
+        if (dev.stageState == STAGE_OPEN) {
+            dev.commitStaged();
         }
+    } else {
+        // Either start a new set or discard the current one
+        dev.stagedMask = 0;
+        dev.stageState = (uint8_t)value;
+        dev.stageOpenMs = millis();
+    }
+    return true;
+}
+
+bool UsbPwmDevice::writeRatio(uint16_t value)
+{
+    // Set PWM duty as fraction of period, 65535 = 100%
+    TheUsbPwmDevice.setDuty(value, true);
+    return true;
+}
+
+bool UsbPwmDevice::writeMode(uint16_t value)
+{
+    TheUsbPwmDevice.setMode(value);
+    return true;
+}
+
+bool UsbPwmDevice::writeCalibration(uint16_t value)
+{
+    if (value == 1) {
+        calibration_start();
+    } else {
+        calibration_abort();
+    }
+    return true;
+}
+
+bool UsbPwmDevice::writeCapture(uint16_t value)
+{
+    if (value == 1) {
+        capture_start();
+    } else {
+        capture_stop();
+    }
+    return true;
+}
+
+bool UsbPwmDevice::writeCounters(uint16_t value)
+{
+    (void)value;
+    counters_clear();
+    return true;
+}
+
+bool UsbPwmDevice::writeReset(uint16_t value)
+{
+    uint16_t key;
+    if (value == 1) {
+        // Reset configuration to default
+        TheUsbPwmDevice.begin();
+        return true;
+    } else if (value == 2) {
+        // Regular reboot
+        key = 0x0000;
+    } else if (value == 3) {
+        // Reboot into bootloader
+        key = MAGIC_KEY;
+    } else if (value == 255) {
+        // Watchdog test
+    } else {
+        // Silently ignore any other value
         return true;
     }
-    return false;
+
+    cli();
+    // Mimic what CDC_Setup does to invoke bootloader
+    if (value != 255) {
+        counters_expect_reset();
+        *(volatile uint16_t *)(RAMEND-1) = key;
+        *(volatile uint16_t *)MAGIC_KEY_POS = key;
+        wdt_enable(WDTO_15MS);
+    }
+    while (true) {
+        sleep_mode();
+    }
+    // Never returns
+}
+
+bool UsbPwmDevice::writeLed(uint16_t value)
+{
+    TheUsbPwmDevice.ledMode = (uint8_t)value;
+    return true;
+}
+
+// Identity strings take effect in descriptors from the next enumeration
+bool UsbPwmDevice::writeSerialNumber(const uint8_t* data, uint8_t length)
+{
+    return identity_set(IDENTITY_SERIAL, data, length);
+}
+
+bool UsbPwmDevice::writeName(const uint8_t* data, uint8_t length)
+{
+    return identity_set(IDENTITY_NAME, data, length);
+}
+
+bool UsbPwmDevice::writeLocation(const uint8_t* data, uint8_t length)
+{
+    return identity_set(IDENTITY_LOCATION, data, length);
+}
+
+bool UsbPwmDevice::writeSchedule(const uint8_t* data, uint8_t length)
+{
+    return schedule_add(data, length);
 }
 
 bool UsbPwmDevice::checkStall()
@@ -247,7 +764,7 @@ bool UsbPwmDevice::checkStall()
     bool stalled = false;
     uint8_t old_sreg = SREG;
     cli();
-    if (pending_tccr1a & 0b10000000) {
+    if (pwm_output_on()) {
         unsigned long check_time = pulse_times[pulse_index];
         if (pulse_delta == 0 || micros() - check_time > 500000) {
             stalled = true;
@@ -258,15 +775,65 @@ bool UsbPwmDevice::checkStall()
 }
 
 bool UsbPwmDevice::setup(USBSetup& setup)
+{
+    uint16_t start = counters_now();
+    bool served = handleSetup(setup);
+    counters_setup(served, start);
+    return served;
+}
+
+//
+// Register replies all fit in one control packet, and by the time setup()
+// gets called for an IN request the core has already waited for the
+// endpoint 0 bank to be free and selected it. So they go straight into the
+// FIFO, rather than through USB_SendControl, which goes back to check the
+// bank and the transfer length for every byte. The core sends the packet
+// once setup() returns.
+//
+static uint8_t control_left;
+
+static int sendControlDirect(uint8_t flags, const void* data, int length)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    uint8_t count = length < control_left ? length : control_left;
+    control_left -= count;
+    if (flags & TRANSFER_PGM) {
+        while (count--) {
+            UEDATX = pgm_read_byte(p++);
+        }
+    } else {
+        while (count--) {
+            UEDATX = *p++;
+        }
+    }
+    return length;
+}
+
+bool UsbPwmDevice::handleSetup(USBSetup& setup)
 {
     if (setup.bmRequestType == (REQUEST_DEVICETOHOST | REQUEST_VENDOR | REQUEST_DEVICE) &&
         setup.bRequest == 0x02 && setup.wIndex == 0x07) {
         return USB_SendControl(TRANSFER_PGM, &MS_OS_20_DESCRIPTORS, sizeof(MS_OS_20_DESCRIPTORS)) >= 0;
     } else if (setup.bmRequestType == (REQUEST_DEVICETOHOST | REQUEST_VENDOR | REQUEST_INTERFACE) &&
                setup.wIndex == pluggedInterface) {
-        return readRegister(setup.bRequest, USB_SendControl);
+        static_assert(SCHEMA_READ_LENGTH <= USB_EP_SIZE && HISTORY_READ_LENGTH <= USB_EP_SIZE &&
+                      CAL_TABLE_LENGTH <= USB_EP_SIZE && COUNTERS_LENGTH <= USB_EP_SIZE &&
+                      SCHEDULE_READ_LENGTH <= USB_EP_SIZE,
+                      "register reply too long for sendControlDirect");
+        control_left = setup.wLength < USB_EP_SIZE ? setup.wLength : USB_EP_SIZE;
+        return readRegister(setup.bRequest, ((uint16_t)setup.wValueH << 8) | setup.wValueL,
+                            sendControlDirect);
     } else if (setup.bmRequestType == (REQUEST_HOSTTODEVICE | REQUEST_VENDOR | REQUEST_INTERFACE) &&
                setup.wIndex == pluggedInterface) {
+        if (setup.wLength) {
+            static_assert(SCHEDULE_WRITE_LENGTH <= IDENTITY_TEXT_MAX, "schedule write too long");
+            uint8_t data[IDENTITY_TEXT_MAX];
+            if (setup.wLength > sizeof(data) ||
+                USB_RecvControl(data, setup.wLength) != setup.wLength) {
+                return false;
+            }
+            return writeRegisterBlock(setup.bRequest, data, setup.wLength);
+        }
         return writeRegister(setup.bRequest, ((uint16_t)setup.wValueH << 8) | setup.wValueL);
     }
 
@@ -275,10 +842,18 @@ bool UsbPwmDevice::setup(USBSetup& setup)
 
 //
 // This winds up as the serial number string descriptor and has a max length
-// of ISERIAL_MAX_LEN chars. It must be an ASCII string.
+// of ISERIAL_MAX_LEN chars. It must be an ASCII string. A configured serial
+// number takes the place of the one made from the chip's.
 //
 uint8_t UsbPwmDevice::getShortName(char *name)
 {
+    const char* serial;
+    uint8_t length = identity_get(IDENTITY_SERIAL, &serial);
+    if (length) {
+        memcpy(name, serial, length);
+        return length;
+    }
+
     uint16_t bits = 0;
     int have_bits = 0;
     int i = 0;
@@ -297,13 +872,25 @@ uint8_t UsbPwmDevice::getShortName(char *name)
 
 int UsbPwmDevice::begin(void)
 {
-    // Configure Timer 1 for 25KHz PWM, start with output off (0% duty cycle)
-    TIMSK1 = 0;
-    ICR1 = 639;
-    OCR1A = 0;
-    TCNT1 = 0;
-    TCCR1A = pending_tccr1a = 0b00000010;    // COM1A[1:0] = 00, WGM1[1:0] = 10
-    TCCR1B = 0b00011001;    // WGM1[3:2] = 11, CS1[2:0] = 001
+    calibration_abort();
+    capture_stop();
+    schedule_clear();
+    if (history_interval() != HISTORY_DEFAULT_INTERVAL_MS) {
+        history_set_interval(HISTORY_DEFAULT_INTERVAL_MS);
+    }
+    pwm_begin();
+#ifdef PWM_TIMER4
+    pwm_set_dither(true);
+#endif
+
+    ratioMode = false;
+    dutyRatio = 0;
+    stageState = STAGE_IDLE;
+    stagedMask = 0;
+    if (boot_duty()) {
+        // Carry on from the boot PWM, or go back to it on config reset
+        setDuty(boot_duty(), true);
+    }
 
     EIMSK = 0;
     EICRA = 0b00001100;
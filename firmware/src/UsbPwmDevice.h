@@ -10,15 +10,75 @@
 #define LED_MODE_BLINK 3
 #define LED_MODE_MAX LED_MODE_BLINK
 
+#define PWM_MODE_DITHER 0x01
+#define PWM_MODE_MASK PWM_MODE_DITHER
+
+#define STAGE_IDLE 0
+#define STAGE_OPEN 1
+#define STAGE_COMMIT 2
+
+// Capability bits, for features hosts can't tell from the version number
+#define CAP_STAGING 0x0001
+#define CAP_DUTY_RATIO 0x0002
+#define CAP_DITHER 0x0004
+// PWM from the PLL-clocked Timer4
+#define CAP_FAST_PWM 0x0008
+#define CAP_CALIBRATION 0x0010
+#define CAP_CAPTURE 0x0020
+#define CAP_TACH_STATS 0x0040
+#define CAP_HISTORY 0x0080
+#define CAP_COUNTERS 0x0100
+#define CAP_SCHEMA 0x0200
+#define CAP_IMAGE_CRC 0x0400
+#define CAP_BOOT_DUTY 0x0800
+#define CAP_IDENTITY 0x1000
+#define CAP_TACH_SAMPLE 0x2000
+#define CAP_FRAME_CLOCK 0x4000
+#define CAP_SCHEDULE 0x8000
+
+#define CAPABILITIES_COMMON (CAP_STAGING | CAP_DUTY_RATIO | CAP_DITHER | CAP_CALIBRATION | \
+                             CAP_CAPTURE | CAP_TACH_STATS | CAP_HISTORY | CAP_COUNTERS | \
+                             CAP_SCHEMA | CAP_IMAGE_CRC | CAP_BOOT_DUTY | CAP_IDENTITY | \
+                             CAP_TACH_SAMPLE | CAP_FRAME_CLOCK | CAP_SCHEDULE)
+#ifdef PWM_TIMER4
+#define CAPABILITIES (CAPABILITIES_COMMON | CAP_FAST_PWM)
+#else
+#define CAPABILITIES CAPABILITIES_COMMON
+#endif
+
+// Fans this firmware drives
+#define FAN_CHANNELS 1
+
+// Register flags, as reported in the register schema
+#define REG_READ 0x01
+#define REG_WRITE 0x02
+// Reads return a block of up to length bytes, not a 16-bit value
+#define REG_BLOCK 0x04
+// Writes are held while a staged set is open
+#define REG_STAGED 0x08
+// Writes take the fan over from calibration
+#define REG_FAN_CONTROL 0x10
+// Reads reset what they return
+#define REG_CLEAR_ON_READ 0x20
+// Writes carry up to length bytes in the data stage, not a value
+#define REG_WRITE_BLOCK 0x40
+
 class UsbPwmDevice : public PluggableUSBModule
 {
 public:
     UsbPwmDevice(void);
     int begin(void);
-    bool readRegister(uint8_t reg, int(*send)(uint8_t, const void*, int));
+    bool readRegister(uint8_t reg, uint16_t value, int(*send)(uint8_t, const void*, int));
     bool writeRegister(uint8_t reg, uint16_t value);
+    bool writeRegisterBlock(uint8_t reg, const uint8_t* data, uint8_t length);
     uint8_t getLedMode() { return ledMode; }
+    uint8_t getCaptureEndpoint() { return pluggedEndpoint; }
     bool checkStall();
+    uint16_t getRpm();
+    // micros() time of the oldest tach edge getRpm's reading covers
+    unsigned long getRpmSince();
+    uint16_t getDutyRatio();
+    void setDutyRatio(uint16_t ratio) { setDuty(ratio, true); }
 
 protected:
     int getInterface(uint8_t* interfaceCount);
@@ -27,7 +87,81 @@ protected:
     uint8_t getShortName(char* name);
 
 private:
+    // Entry of the register table; the fields up to max are also what the
+    // schema register sends for it
+    struct RegisterInfo {
+        uint8_t reg;
+        uint8_t flags;
+        // 2 for values, most that gets sent for blocks
+        uint8_t length;
+        // Range of values writes accept
+        uint16_t min;
+        uint16_t max;
+        uint16_t (*get)();
+        bool (*read)(uint16_t value, int(*send)(uint8_t, const void*, int));
+        bool (*write)(uint16_t value);
+        bool (*writeBlock)(const uint8_t* data, uint8_t length);
+    };
+    static const RegisterInfo registers[];
+    static bool findRegister(uint8_t reg, RegisterInfo& info);
+
+    void setDuty(uint16_t value, bool ratio);
+    void setPeriod(uint16_t value, bool sync);
+    void setMode(uint16_t value);
+    void expireStage();
+    void stageWrite(uint8_t reg, uint16_t value);
+    void commitStaged();
+    bool handleSetup(USBSetup& setup);
+
+    // Register handlers, see the table in UsbPwmDevice.cpp
+    static uint16_t getVersion();
+    static uint16_t getTachometer();
+    static uint16_t getStage();
+    static uint16_t getRatio();
+    static uint16_t getMode();
+    static uint16_t getCalibration();
+    static uint16_t getCapture();
+    static uint16_t getLed();
+    static bool readSchema(uint16_t first, int(*send)(uint8_t, const void*, int));
+    static bool readCapabilities(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readImage(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readStats(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readBootTimes(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readTachSample(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readFrameClock(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readSchedule(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readCalibrationTable(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readCaptureStatus(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readCounters(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readSerialNumber(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readName(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool readLocation(uint16_t value, int(*send)(uint8_t, const void*, int));
+    static bool writeDuty(uint16_t value);
+    static bool writePeriod(uint16_t value);
+    static bool writeStage(uint16_t value);
+    static bool writeRatio(uint16_t value);
+    static bool writeMode(uint16_t value);
+    static bool writeCalibration(uint16_t value);
+    static bool writeCapture(uint16_t value);
+    static bool writeCounters(uint16_t value);
+    static bool writeReset(uint16_t value);
+    static bool writeLed(uint16_t value);
+    static bool writeSerialNumber(const uint8_t* data, uint8_t length);
+    static bool writeName(const uint8_t* data, uint8_t length);
+    static bool writeLocation(const uint8_t* data, uint8_t length);
+    static bool writeSchedule(const uint8_t* data, uint8_t length);
+
+    uint8_t endpointTypes[1];
     uint8_t ledMode;
+    bool ratioMode;
+    uint16_t dutyRatio;
+    uint8_t stageState;
+    unsigned long stageOpenMs;
+    uint8_t stagedMask;
+    uint16_t stagedDuty;
+    uint16_t stagedPeriod;
+    uint16_t stagedRatio;
+    uint16_t stagedMode;
 };
 
 extern UsbPwmDevice TheUsbPwmDevice;
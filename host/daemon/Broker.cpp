@@ -0,0 +1,489 @@
+//
+// Unix socket access to fan devices for other local processes
+//
+
+#include "Broker.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Limits on what a client can leave sitting in buffers
+#define MAX_LINE_LENGTH 256
+#define MAX_OUTPUT_LENGTH 65536
+
+static bool parse_number(const std::string& word, unsigned long max, unsigned long& value)
+{
+    if (word.empty()) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    value = strtoul(word.c_str(), &end, 0);
+    return *end == '\0' && errno == 0 && value <= max;
+}
+
+static std::string to_hex(const uint8_t* data, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < length; i++) {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+Broker::Broker(usbfan::Context& usb, EventLoop& loop)
+    : usb(usb), loop(loop), listenFd(-1), nextClient(0)
+{
+    idleId = loop.addIdle([this]() { idle(); });
+}
+
+Broker::~Broker()
+{
+    for (auto& entry : clients) {
+        drop(entry.second);
+    }
+    for (auto& batch : batches) {
+        if (batch->busy()) {
+            batch->cancel();
+        }
+    }
+    if (listenFd >= 0) {
+        loop.remove(listenFd);
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+    loop.removeIdle(idleId);
+}
+
+bool Broker::listen(const char* path, std::string& error)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error = std::string(path) + ": socket path too long";
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        error = std::string("socket: ") + strerror(errno);
+        return false;
+    }
+    // Left over from an earlier run that didn't exit cleanly
+    unlink(path);
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || chmod(path, 0660) != 0 ||
+        ::listen(listenFd, 16) != 0) {
+        error = std::string(path) + ": " + strerror(errno);
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+    socketPath = path;
+    loop.add(listenFd, EPOLLIN, [this](uint32_t) { accept(); });
+    return true;
+}
+
+void Broker::addDevice(usbfan::Device* device)
+{
+    DeviceState& state = devices[device];
+    state.device = device;
+    state.gone = false;
+    state.inFlight = 0;
+    state.writeSeq = 0;
+}
+
+bool Broker::removeDevice(usbfan::Device* device)
+{
+    auto it = devices.find(device);
+    if (it == devices.end()) {
+        return true;
+    }
+    // Fail anything new until it's really gone
+    it->second.gone = true;
+    if (it->second.inFlight) {
+        return false;
+    }
+    devices.erase(it);
+    return true;
+}
+
+void Broker::update(usbfan::Device* device, uint8_t reg, const uint8_t* data, int length)
+{
+    auto it = devices.find(device);
+    if (it != devices.end() && length >= 0) {
+        CacheEntry& entry = it->second.cache[CacheKey(reg, length)];
+        entry.data.assign(data, data + length);
+        entry.time = Clock::now();
+    }
+}
+
+void Broker::invalidate(usbfan::Device* device)
+{
+    auto it = devices.find(device);
+    if (it != devices.end()) {
+        it->second.cache.clear();
+    }
+}
+
+Broker::DeviceState* Broker::findDevice(const std::string& selector)
+{
+    std::string serial = selector;
+    long iface = -1;
+    std::string::size_type slash = selector.rfind('/');
+    if (slash != std::string::npos) {
+        unsigned long value;
+        if (!parse_number(selector.substr(slash + 1), 0xff, value)) {
+            return nullptr;
+        }
+        serial.erase(slash);
+        iface = value;
+    }
+    for (auto& entry : devices) {
+        DeviceState& state = entry.second;
+        if (!state.gone && state.device->serialNumber() == serial &&
+            (iface < 0 || state.device->interfaceNumber() == iface)) {
+            return &state;
+        }
+    }
+    return nullptr;
+}
+
+usbfan::Batch* Broker::acquireBatch()
+{
+    if (spareBatches.empty()) {
+        batches.emplace_back(new usbfan::Batch(usb));
+        return batches.back().get();
+    }
+    usbfan::Batch* batch = spareBatches.back();
+    spareBatches.pop_back();
+    return batch;
+}
+
+void Broker::releaseBatch(usbfan::Batch& batch)
+{
+    // Batches can't be destroyed from their own callbacks, so keep them
+    batch.clear();
+    spareBatches.push_back(&batch);
+}
+
+void Broker::accept()
+{
+    int fd;
+    while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        unsigned id = nextClient++;
+        clients[id] = Client{ fd, "", "", false, false, false };
+        loop.add(fd, EPOLLIN, [this, id](uint32_t events) { clientEvent(id, events); });
+    }
+}
+
+void Broker::clientEvent(unsigned id, uint32_t events)
+{
+    auto it = clients.find(id);
+    if (it == clients.end() || it->second.dead) {
+        return;
+    }
+    Client& client = it->second;
+    if (events & EPOLLOUT) {
+        flush(client);
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        char buf[512];
+        ssize_t len;
+        while ((len = recv(client.fd, buf, sizeof(buf), 0)) > 0) {
+            client.in.append(buf, len);
+        }
+        if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            drop(client);
+            return;
+        }
+    }
+    processInput(id);
+}
+
+void Broker::processInput(unsigned id)
+{
+    Client& client = clients[id];
+    client.processing = true;
+    // One request at a time keeps the responses in order
+    while (!client.dead && !client.waiting) {
+        std::string::size_type end = client.in.find('\n');
+        if (end == std::string::npos) {
+            if (client.in.size() > MAX_LINE_LENGTH) {
+                drop(client);
+            }
+            break;
+        }
+        std::string line = client.in.substr(0, end);
+        client.in.erase(0, end + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+
+        std::string response;
+        client.waiting = true;
+        if (handleRequest(id, line, response)) {
+            client.waiting = false;
+            send(client, response);
+        }
+    }
+    client.processing = false;
+}
+
+bool Broker::handleRequest(unsigned id, const std::string& line, std::string& response)
+{
+    std::istringstream words(line);
+    std::string command, selector, word;
+    words >> command;
+    if (command == "list") {
+        std::string list;
+        unsigned count = 0;
+        for (auto& entry : devices) {
+            const usbfan::Device& device = *entry.second.device;
+            if (!entry.second.gone) {
+                list += "\n" + device.serialNumber() + " " +
+                        std::to_string(device.interfaceNumber()) + " " +
+                        std::to_string(device.bus()) + " " + std::to_string(device.address());
+                count++;
+            }
+        }
+        response = "ok " + std::to_string(count) + list;
+        return true;
+    } else if (command != "read" && command != "write") {
+        response = "error unknown command";
+        return true;
+    }
+
+    std::vector<unsigned long> args;
+    words >> selector;
+    while (words >> word) {
+        unsigned long value;
+        if (!parse_number(word, 0xffffffff, value)) {
+            response = "error bad number '" + word + "'";
+            return true;
+        }
+        args.push_back(value);
+    }
+    DeviceState* state = findDevice(selector);
+    if (!state) {
+        response = "error no such device";
+        return true;
+    }
+
+    if (command == "read") {
+        unsigned long length = args.size() > 1 ? args[1] : 2;
+        if (args.empty() || args.size() > 3 || args[0] > 0xff ||
+            length > usbfan::MAX_REGISTER_LENGTH) {
+            response = "error usage: read <dev> <reg> [length [max_age]]";
+            return true;
+        }
+        return startRead(id, *state, CacheKey(args[0], length), args.size() > 2 ? args[2] : 0,
+                         response);
+    }
+
+    if (args.size() != 2 || args[0] > 0xff || args[1] > 0xffff) {
+        response = "error usage: write <dev> <reg> <value>";
+        return true;
+    }
+    state->writes.push_back(WriteRequest{ id, (uint8_t)args[0], (uint16_t)args[1] });
+    if (state->writes.size() == 1) {
+        startWrite(*state);
+    }
+    return false;
+}
+
+bool Broker::startRead(unsigned id, DeviceState& state, CacheKey key, unsigned maxAge,
+                       std::string& response)
+{
+    auto cached = state.cache.find(key);
+    if (cached != state.cache.end()) {
+        auto age = std::chrono::duration_cast<std::chrono::milliseconds>(
+            Clock::now() - cached->second.time).count();
+        if (age <= maxAge) {
+            response = "ok " + std::to_string(age) + " " +
+                       to_hex(cached->second.data.data(), cached->second.data.size());
+            return true;
+        }
+    }
+
+    for (PendingRead& pending : state.reads) {
+        if (pending.key == key && pending.writeSeq == state.writeSeq) {
+            // Same read already on its way, share the result
+            pending.clients.push_back(id);
+            return false;
+        }
+    }
+
+    auto read = state.reads.insert(state.reads.end(), PendingRead{ key, state.writeSeq, { id } });
+    state.inFlight++;
+    usbfan::Batch* batch = acquireBatch();
+    batch->read(*state.device, key.first, key.second);
+    usbfan::Device* device = state.device;
+    int rv = batch->submit([this, device, read](usbfan::Batch& b) { readDone(device, read, b); });
+    if (rv != LIBUSB_SUCCESS) {
+        state.reads.erase(read);
+        state.inFlight--;
+        releaseBatch(*batch);
+        response = std::string("error ") + libusb_error_name(rv);
+        return true;
+    }
+    return false;
+}
+
+void Broker::readDone(usbfan::Device* device, std::list<PendingRead>::iterator read,
+                      usbfan::Batch& batch)
+{
+    DeviceState& state = devices[device];
+    state.inFlight--;
+    const usbfan::Batch::Op& op = batch[0];
+    std::string response;
+    if (op.status == LIBUSB_SUCCESS) {
+        // A write since it started may have changed the value after the
+        // device sent it
+        if (read->writeSeq == state.writeSeq) {
+            update(device, read->key.first, op.data, op.actualLength);
+        }
+        response = "ok 0 " + to_hex(op.data, op.actualLength);
+    } else {
+        if (op.status == LIBUSB_ERROR_NO_DEVICE) {
+            state.gone = true;
+        }
+        response = std::string("error ") + libusb_error_name(op.status);
+    }
+    releaseBatch(batch);
+
+    std::vector<unsigned> waiters;
+    waiters.swap(read->clients);
+    state.reads.erase(read);
+    for (unsigned id : waiters) {
+        complete(id, response);
+    }
+}
+
+void Broker::startWrite(DeviceState& state)
+{
+    const WriteRequest& request = state.writes.front();
+    state.inFlight++;
+    state.writeSeq++;
+    usbfan::Batch* batch = acquireBatch();
+    batch->write(*state.device, request.reg, request.value);
+    usbfan::Device* device = state.device;
+    int rv = batch->submit([this, device](usbfan::Batch& b) { writeDone(device, b); });
+    if (rv != LIBUSB_SUCCESS) {
+        // Not expected from an idle batch, but report it the same way
+        state.inFlight--;
+        releaseBatch(*batch);
+        unsigned id = request.client;
+        state.writes.pop_front();
+        complete(id, std::string("error ") + libusb_error_name(rv));
+        if (!state.writes.empty()) {
+            startWrite(state);
+        }
+    }
+}
+
+void Broker::writeDone(usbfan::Device* device, usbfan::Batch& batch)
+{
+    DeviceState& state = devices[device];
+    state.inFlight--;
+    int status = batch[0].status;
+    releaseBatch(batch);
+    // Writes can change what other registers read back
+    state.cache.clear();
+    state.writeSeq++;
+    if (status == LIBUSB_ERROR_NO_DEVICE) {
+        state.gone = true;
+    }
+
+    unsigned id = state.writes.front().client;
+    state.writes.pop_front();
+    complete(id, status == LIBUSB_SUCCESS ? "ok" : std::string("error ") + libusb_error_name(status));
+
+    if (state.gone) {
+        while (!state.writes.empty()) {
+            id = state.writes.front().client;
+            state.writes.pop_front();
+            complete(id, std::string("error ") + libusb_error_name(LIBUSB_ERROR_NO_DEVICE));
+        }
+    } else if (!state.writes.empty()) {
+        startWrite(state);
+    }
+}
+
+void Broker::complete(unsigned id, const std::string& response)
+{
+    auto it = clients.find(id);
+    if (it == clients.end() || it->second.dead) {
+        // Gave up waiting
+        return;
+    }
+    Client& client = it->second;
+    client.waiting = false;
+    send(client, response);
+    if (!client.processing) {
+        processInput(id);
+    }
+}
+
+void Broker::send(Client& client, const std::string& response)
+{
+    client.out += response;
+    client.out += '\n';
+    if (client.out.size() > MAX_OUTPUT_LENGTH) {
+        // Not reading its responses
+        drop(client);
+        return;
+    }
+    flush(client);
+}
+
+void Broker::flush(Client& client)
+{
+    bool was_blocked = false;
+    while (!client.out.empty()) {
+        ssize_t len = ::send(client.fd, client.out.data(), client.out.size(),
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                was_blocked = true;
+                break;
+            }
+            drop(client);
+            return;
+        }
+        client.out.erase(0, len);
+    }
+    loop.modify(client.fd, was_blocked ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+void Broker::drop(Client& client)
+{
+    if (!client.dead) {
+        // Could be in the middle of handling this client, so just close it
+        // here and clean up from idle
+        client.dead = true;
+        loop.remove(client.fd);
+        close(client.fd);
+    }
+}
+
+void Broker::idle()
+{
+    for (auto it = clients.begin(); it != clients.end();) {
+        if (it->second.dead && !it->second.processing) {
+            it = clients.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,134 @@
+#ifndef Broker_h
+#define Broker_h
+
+//
+// Unix socket access to fan devices for other local processes
+//
+// Clients send one request per line and get one response line back (or
+// more, for list), in order:
+//
+//   list                                  ok <count>, then per device:
+//                                         <serial> <interface> <bus> <address>
+//   read <dev> <reg> [length [max_age]]   ok <age_ms> <hex data>
+//   write <dev> <reg> <value>             ok
+//
+// <dev> is a serial number, optionally followed by /<interface>. Failures
+// get "error <message>" instead.
+//
+// Reads are answered from the cache without any USB traffic if the value
+// there is no older than max_age milliseconds (default 0, meaning always
+// read the device). Identical reads already in flight are shared instead of
+// issuing another transfer, unless a write to the device started or
+// finished since. Writes to each device are done one at a time, in order
+// received, and drop that device's cached values; reads that overlapped
+// one aren't cached.
+//
+
+#include "EventLoop.h"
+
+#include "usbfan/UsbFan.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Broker
+{
+public:
+    Broker(usbfan::Context& usb, EventLoop& loop);
+    ~Broker();
+    Broker(const Broker&) = delete;
+    Broker& operator=(const Broker&) = delete;
+
+    // Returns false with error set on failure
+    bool listen(const char* path, std::string& error);
+
+    void addDevice(usbfan::Device* device);
+    // Returns false if transfers are still in flight, in which case the
+    // device must be kept open and this called again later
+    bool removeDevice(usbfan::Device* device);
+    // Cache a register value that was read some other way
+    void update(usbfan::Device* device, uint8_t reg, const uint8_t* data, int length);
+    void invalidate(usbfan::Device* device);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    // Register and read length
+    typedef std::pair<uint8_t, uint16_t> CacheKey;
+
+    struct CacheEntry {
+        std::vector<uint8_t> data;
+        Clock::time_point time;
+    };
+    struct PendingRead {
+        CacheKey key;
+        // DeviceState::writeSeq when the read started
+        unsigned writeSeq;
+        // Clients waiting on it
+        std::vector<unsigned> clients;
+    };
+    struct WriteRequest {
+        unsigned client;
+        uint8_t reg;
+        uint16_t value;
+    };
+    struct DeviceState {
+        usbfan::Device* device;
+        bool gone;
+        unsigned inFlight;
+        std::map<CacheKey, CacheEntry> cache;
+        std::list<PendingRead> reads;
+        // Front one is in flight
+        std::deque<WriteRequest> writes;
+        // Goes up as each write starts and finishes, so reads can tell if
+        // they overlapped one
+        unsigned writeSeq;
+    };
+    struct Client {
+        int fd;
+        std::string in;
+        std::string out;
+        bool waiting;
+        bool processing;
+        bool dead;
+    };
+
+    void accept();
+    void clientEvent(unsigned id, uint32_t events);
+    void processInput(unsigned id);
+    // Returns false if the response will come later
+    bool handleRequest(unsigned id, const std::string& line, std::string& response);
+    bool startRead(unsigned id, DeviceState& state, CacheKey key, unsigned maxAge,
+                   std::string& response);
+    void readDone(usbfan::Device* device, std::list<PendingRead>::iterator read,
+                  usbfan::Batch& batch);
+    void startWrite(DeviceState& state);
+    void writeDone(usbfan::Device* device, usbfan::Batch& batch);
+    void complete(unsigned id, const std::string& response);
+    void send(Client& client, const std::string& response);
+    void flush(Client& client);
+    void drop(Client& client);
+    void idle();
+    DeviceState* findDevice(const std::string& selector);
+    usbfan::Batch* acquireBatch();
+    void releaseBatch(usbfan::Batch& batch);
+
+    usbfan::Context& usb;
+    EventLoop& loop;
+    int listenFd;
+    std::string socketPath;
+    std::map<usbfan::Device*, DeviceState> devices;
+    std::map<unsigned, Client> clients;
+    unsigned nextClient;
+    std::vector<std::unique_ptr<usbfan::Batch>> batches;
+    std::vector<usbfan::Batch*> spareBatches;
+    unsigned idleId;
+};
+
+#endif
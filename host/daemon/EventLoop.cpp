@@ -0,0 +1,176 @@
+//
+// Single threaded epoll event loop that also drives libusb
+//
+
+#include "EventLoop.h"
+
+#include <cerrno>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include <unistd.h>
+
+#define MAX_EVENTS 16
+
+EventLoop::EventLoop(usbfan::Context& usb) : usb(usb), running(false), nextIdle(0)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        throw std::system_error(errno, std::generic_category(), "epoll_create1");
+    }
+
+    const libusb_pollfd** fds = libusb_get_pollfds(usb.get());
+    if (fds) {
+        for (const libusb_pollfd** fd = fds; *fd; fd++) {
+            addUsbFd((*fd)->fd, (*fd)->events);
+        }
+        libusb_free_pollfds(fds);
+    }
+    libusb_set_pollfd_notifiers(usb.get(), pollfdAdded, pollfdRemoved, this);
+}
+
+EventLoop::~EventLoop()
+{
+    libusb_set_pollfd_notifiers(usb.get(), nullptr, nullptr, nullptr);
+    close(epfd);
+}
+
+void EventLoop::pollfdAdded(int fd, short events, void* userData)
+{
+    ((EventLoop*)userData)->addUsbFd(fd, events);
+}
+
+void EventLoop::pollfdRemoved(int fd, void* userData)
+{
+    EventLoop* loop = (EventLoop*)userData;
+    loop->usbFds.erase(fd);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EventLoop::addUsbFd(int fd, short events)
+{
+    epoll_event ev = {};
+    ev.events = ((events & POLLIN) ? (uint32_t)EPOLLIN : 0) | ((events & POLLOUT) ? (uint32_t)EPOLLOUT : 0);
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        usbFds.insert(fd);
+    }
+}
+
+bool EventLoop::add(int fd, uint32_t events, Handler handler)
+{
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        return false;
+    }
+    handlers[fd] = handler;
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events)
+{
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::remove(int fd)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    handlers.erase(fd);
+}
+
+int EventLoop::addTimer(unsigned intervalMs, std::function<void()> handler)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    itimerspec spec;
+    spec.it_interval.tv_sec = intervalMs / 1000;
+    spec.it_interval.tv_nsec = (intervalMs % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, nullptr) != 0 ||
+        !add(fd, EPOLLIN, [fd, handler](uint32_t) {
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                // If we fell behind, just run once
+                handler();
+            }
+        })) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void EventLoop::removeTimer(int fd)
+{
+    remove(fd);
+    close(fd);
+}
+
+unsigned EventLoop::addIdle(std::function<void()> idle)
+{
+    idleHandlers[nextIdle] = idle;
+    return nextIdle++;
+}
+
+void EventLoop::handleUsb()
+{
+    timeval zero = { 0, 0 };
+    libusb_handle_events_timeout_completed(usb.get(), &zero, nullptr);
+}
+
+void EventLoop::run()
+{
+    running = true;
+    while (running) {
+        int timeout = -1;
+        if (!libusb_pollfds_handle_timeouts(usb.get())) {
+            // Have to wake up for libusb transfer timeouts ourselves
+            timeval tv;
+            if (libusb_get_next_timeout(usb.get(), &tv) == 1) {
+                timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+            }
+        }
+
+        epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "epoll_wait");
+        }
+
+        bool usb_ready = count == 0;
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (usbFds.count(fd)) {
+                usb_ready = true;
+                continue;
+            }
+            // Handlers may remove other handlers, so look up each time
+            auto it = handlers.find(fd);
+            if (it != handlers.end()) {
+                Handler handler = it->second;
+                handler(events[i].events);
+            }
+        }
+        if (usb_ready) {
+            handleUsb();
+        }
+        for (auto it = idleHandlers.begin(); it != idleHandlers.end();) {
+            unsigned id = it->first;
+            std::function<void()> idle = it->second;
+            idle();
+            // Idle handlers may remove others too
+            it = idleHandlers.upper_bound(id);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef EventLoop_h
+#define EventLoop_h
+
+//
+// Single threaded epoll event loop that also drives libusb
+//
+
+#include "usbfan/UsbFan.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+
+class EventLoop
+{
+public:
+    typedef std::function<void(uint32_t events)> Handler;
+
+    // Throws std::system_error if epoll can't be set up
+    explicit EventLoop(usbfan::Context& usb);
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Events are EPOLLIN, EPOLLOUT, etc.
+    bool add(int fd, uint32_t events, Handler handler);
+    bool modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    // Periodic timerfd, returns the fd or -1 on error
+    int addTimer(unsigned intervalMs, std::function<void()> handler);
+    void removeTimer(int fd);
+
+    // Called after each round of event handling, for work that can't be
+    // done from inside libusb callbacks. Returns an id for removeIdle.
+    unsigned addIdle(std::function<void()> idle);
+    void removeIdle(unsigned id) { idleHandlers.erase(id); }
+
+    void run();
+    void stop() { running = false; }
+
+private:
+    static void pollfdAdded(int fd, short events, void* userData);
+    static void pollfdRemoved(int fd, void* userData);
+    void addUsbFd(int fd, short events);
+    void handleUsb();
+
+    usbfan::Context& usb;
+    int epfd;
+    bool running;
+    std::map<int, Handler> handlers;
+    std::set<int> usbFds;
+    std::map<unsigned, std::function<void()>> idleHandlers;
+    unsigned nextIdle;
+};
+
+#endif
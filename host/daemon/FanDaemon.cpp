@@ -0,0 +1,338 @@
+//
+// Temperature driven fan control for all attached fan devices
+//
+// Devices are opened once, as they show up, and stay open. Every control
+// interval, one batch writes the new duty to every fan and reads back the
+// speeds, so the whole round costs about one control transfer time no
+// matter how many fans there are.
+//
+
+#include "FanDaemon.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#define DEFAULT_INTERVAL_MS 1000
+
+// Temperature that can't be read gets treated as this hot, in
+// millidegrees C, so a broken sensor fails to full speed
+#define FAILSAFE_TEMP 1000000
+
+uint16_t FanConfig::dutyFor(int temp) const
+{
+    if (curve.empty()) {
+        return 0xffff;
+    } else if (temp <= curve.front().first) {
+        return curve.front().second;
+    } else if (temp >= curve.back().first) {
+        return curve.back().second;
+    }
+    size_t i = 1;
+    while (curve[i].first < temp) {
+        i++;
+    }
+    // Linear between points
+    const std::pair<int, uint16_t>& lo = curve[i - 1];
+    const std::pair<int, uint16_t>& hi = curve[i];
+    return lo.second + (int64_t)(hi.second - lo.second) * (temp - lo.first) / (hi.first - lo.first);
+}
+
+static int read_temperature(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return FAILSAFE_TEMP;
+    }
+    char buf[32];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return FAILSAFE_TEMP;
+    }
+    buf[len] = '\0';
+    char* end;
+    long temp = strtol(buf, &end, 10);
+    return end == buf ? FAILSAFE_TEMP : (int)temp;
+}
+
+FanDaemon::FanDaemon(usbfan::Context& usb, EventLoop& loop)
+    : usb(usb), loop(loop), batch(usb), intervalMs(DEFAULT_INTERVAL_MS), verbose(false),
+      broker(nullptr), timerFd(-1), hotplugRegistered(false)
+{
+}
+
+FanDaemon::~FanDaemon()
+{
+    stop();
+}
+
+bool FanDaemon::loadConfig(const char* path, std::string& error)
+{
+    std::ifstream file(path);
+    if (!file) {
+        error = std::string(path) + ": " + strerror(errno);
+        return false;
+    }
+
+    configs.clear();
+    intervalMs = DEFAULT_INTERVAL_MS;
+    std::string line;
+    for (int line_num = 1; std::getline(file, line); line_num++) {
+        std::string::size_type comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        std::istringstream words(line);
+        std::string keyword;
+        if (!(words >> keyword)) {
+            continue;
+        }
+        std::string where = std::string(path) + ":" + std::to_string(line_num) + ": ";
+
+        if (keyword == "interval") {
+            if (!(words >> intervalMs) || intervalMs < 10) {
+                error = where + "interval must be at least 10 milliseconds";
+                return false;
+            }
+        } else if (keyword == "fan") {
+            FanConfig config;
+            if (!(words >> config.serial >> config.tempPath)) {
+                error = where + "expected: fan <serial> <temperature file> <temp>:<duty%>...";
+                return false;
+            }
+            std::string point;
+            while (words >> point) {
+                double temp, duty;
+                char sep;
+                std::istringstream point_words(point);
+                if (!(point_words >> temp >> sep >> duty) || sep != ':' || duty < 0 ||
+                    duty > 100) {
+                    error = where + "bad curve point '" + point + "'";
+                    return false;
+                }
+                config.curve.emplace_back((int)(temp * 1000),
+                                          (uint16_t)(duty * 0xffff / 100 + 0.5));
+            }
+            if (config.curve.empty()) {
+                error = where + "fan needs at least one curve point";
+                return false;
+            }
+            std::sort(config.curve.begin(), config.curve.end());
+            configs.push_back(config);
+        } else {
+            error = where + "unknown keyword '" + keyword + "'";
+            return false;
+        }
+    }
+    return true;
+}
+
+const FanConfig* FanDaemon::configFor(const std::string& serial) const
+{
+    const FanConfig* wildcard = nullptr;
+    for (const FanConfig& config : configs) {
+        if (config.serial == serial) {
+            return &config;
+        } else if (config.serial == "*" && !wildcard) {
+            wildcard = &config;
+        }
+    }
+    return wildcard;
+}
+
+void FanDaemon::setBroker(Broker* newBroker)
+{
+    broker = newBroker;
+    if (broker) {
+        for (Fan& fan : fans) {
+            broker->addDevice(fan.device.get());
+        }
+    }
+}
+
+bool FanDaemon::start()
+{
+    loop.addIdle([this]() { idle(); });
+
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        // Enumerate flag gets existing devices reported as arrivals
+        int rv = libusb_hotplug_register_callback(
+            usb.get(), LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, this, &hotplugHandle);
+        if (rv != LIBUSB_SUCCESS) {
+            fprintf(stderr, "Hotplug registration failed: %s\n", libusb_error_name(rv));
+            return false;
+        }
+        hotplugRegistered = true;
+        idle();
+    } else {
+        fprintf(stderr, "No hotplug support, only devices attached now will be used\n");
+        for (auto& dev : usb.findDevices()) {
+            addDevice(std::move(dev));
+        }
+    }
+
+    timerFd = loop.addTimer(intervalMs, [this]() { tick(); });
+    if (timerFd < 0) {
+        fprintf(stderr, "Failed to create control timer: %s\n", strerror(errno));
+        return false;
+    }
+    // Don't wait a whole interval for the first round
+    tick();
+    return true;
+}
+
+void FanDaemon::stop()
+{
+    if (timerFd >= 0) {
+        loop.removeTimer(timerFd);
+        timerFd = -1;
+    }
+    if (hotplugRegistered) {
+        libusb_hotplug_deregister_callback(usb.get(), hotplugHandle);
+        hotplugRegistered = false;
+    }
+    if (batch.busy()) {
+        batch.cancel();
+    }
+    for (libusb_device* dev : arrived) {
+        libusb_unref_device(dev);
+    }
+    arrived.clear();
+    fans.clear();
+}
+
+int LIBUSB_CALL FanDaemon::hotplugCallback(libusb_context* ctx, libusb_device* dev,
+                                           libusb_hotplug_event event, void* userData)
+{
+    (void)ctx;
+    FanDaemon* daemon = (FanDaemon*)userData;
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        daemon->arrived.push_back(libusb_ref_device(dev));
+    } else {
+        auto it = std::find(daemon->arrived.begin(), daemon->arrived.end(), dev);
+        if (it != daemon->arrived.end()) {
+            libusb_unref_device(*it);
+            daemon->arrived.erase(it);
+        }
+        // Handles may still have transfers in flight, so only mark them
+        for (Fan& fan : daemon->fans) {
+            if (libusb_get_device(fan.device->handle()) == dev) {
+                fan.gone = true;
+            }
+        }
+    }
+    // Stay registered
+    return 0;
+}
+
+void FanDaemon::addDevice(std::unique_ptr<usbfan::Device> device)
+{
+    const FanConfig* config = configFor(device->serialNumber());
+    fprintf(stderr, "Fan %s attached on bus %d address %d, %s\n",
+            device->serialNumber().c_str(), device->bus(), device->address(),
+            config ? "controlling" : "not configured");
+    if (broker) {
+        broker->addDevice(device.get());
+    }
+    fans.push_back(Fan{ std::move(device), config, false });
+}
+
+void FanDaemon::idle()
+{
+    if (!arrived.empty()) {
+        std::vector<libusb_device*> devs;
+        devs.swap(arrived);
+        for (libusb_device* dev : devs) {
+            std::vector<std::unique_ptr<usbfan::Device>> found;
+            usb.openDevice(dev, found);
+            libusb_unref_device(dev);
+            for (auto& device : found) {
+                addDevice(std::move(device));
+            }
+        }
+    }
+
+    // Closing a handle with transfers outstanding isn't allowed
+    if (!batch.busy()) {
+        auto it = std::remove_if(fans.begin(), fans.end(), [this](const Fan& fan) {
+            if (!fan.gone || (broker && !broker->removeDevice(fan.device.get()))) {
+                return false;
+            }
+            fprintf(stderr, "Fan %s detached\n", fan.device->serialNumber().c_str());
+            return true;
+        });
+        fans.erase(it, fans.end());
+    }
+}
+
+void FanDaemon::tick()
+{
+    if (batch.busy()) {
+        // Last round hasn't finished, most likely a device is timing out
+        return;
+    }
+    batch.clear();
+    for (Fan& fan : fans) {
+        if (fan.gone || !fan.config) {
+            continue;
+        }
+        int temp = read_temperature(fan.config->tempPath);
+        batch.write(*fan.device, usbfan::REGISTER_PWM_DUTY_RATIO, fan.config->dutyFor(temp));
+        batch.read(*fan.device, usbfan::REGISTER_TACHOMETER);
+    }
+    if (batch.size() == 0) {
+        return;
+    }
+    // Keep well under the interval so a stuck device can't hold up rounds
+    unsigned timeout = std::min(intervalMs, usbfan::DEFAULT_TIMEOUT_MS);
+    int rv = batch.submit([this](usbfan::Batch&) { tickDone(); }, timeout);
+    if (rv != LIBUSB_SUCCESS) {
+        fprintf(stderr, "Batch submit failed: %s\n", libusb_error_name(rv));
+    }
+}
+
+void FanDaemon::tickDone()
+{
+    for (size_t i = 0; i + 1 < batch.size(); i += 2) {
+        const usbfan::Batch::Op& duty = batch[i];
+        const usbfan::Batch::Op& tach = batch[i + 1];
+        usbfan::Device* device = duty.device;
+        if (duty.status == LIBUSB_ERROR_NO_DEVICE) {
+            // In case hotplug events are not available or arrive late
+            for (Fan& fan : fans) {
+                if (fan.device.get() == device) {
+                    fan.gone = true;
+                }
+            }
+            continue;
+        } else if (duty.status != LIBUSB_SUCCESS || tach.status != LIBUSB_SUCCESS) {
+            int err = duty.status != LIBUSB_SUCCESS ? duty.status : tach.status;
+            fprintf(stderr, "Fan %s: %s\n", device->serialNumber().c_str(),
+                    libusb_error_name(err));
+            continue;
+        }
+        if (broker) {
+            // Saves clients from reading these again
+            uint8_t ratio[2] = { (uint8_t)duty.value, (uint8_t)(duty.value >> 8) };
+            broker->invalidate(device);
+            broker->update(device, usbfan::REGISTER_PWM_DUTY_RATIO, ratio, sizeof(ratio));
+            broker->update(device, usbfan::REGISTER_TACHOMETER, tach.data, tach.actualLength);
+        }
+        if (verbose) {
+            printf("%s: duty %5.1f%%, %u RPM\n", device->serialNumber().c_str(),
+                   duty.value * 100.0 / 0xffff, tach.value16());
+        }
+    }
+    if (verbose) {
+        fflush(stdout);
+    }
+}
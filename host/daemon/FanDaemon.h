@@ -0,0 +1,82 @@
+#ifndef FanDaemon_h
+#define FanDaemon_h
+
+//
+// Temperature driven fan control for all attached fan devices
+//
+
+#include "Broker.h"
+#include "EventLoop.h"
+
+#include "usbfan/UsbFan.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct FanConfig
+{
+    // Serial number to match, or "*" for any device not otherwise matched
+    std::string serial;
+    // File holding a temperature in millidegrees C, like hwmon or thermal
+    // zone sysfs attributes
+    std::string tempPath;
+    // (millidegrees C, duty ratio) points, sorted by temperature
+    std::vector<std::pair<int, uint16_t>> curve;
+
+    uint16_t dutyFor(int temp) const;
+};
+
+class FanDaemon
+{
+public:
+    FanDaemon(usbfan::Context& usb, EventLoop& loop);
+    ~FanDaemon();
+    FanDaemon(const FanDaemon&) = delete;
+    FanDaemon& operator=(const FanDaemon&) = delete;
+
+    // Returns false with error set if the file can't be used
+    bool loadConfig(const char* path, std::string& error);
+    void setVerbose(bool enable) { verbose = enable; }
+    // Share devices, and the values read from them, with a broker; pass
+    // nullptr to detach before destroying the broker
+    void setBroker(Broker* broker);
+
+    // Start watching for devices and running the control loop
+    bool start();
+    void stop();
+
+private:
+    struct Fan {
+        std::unique_ptr<usbfan::Device> device;
+        const FanConfig* config;
+        bool gone;
+    };
+
+    static int LIBUSB_CALL hotplugCallback(libusb_context* ctx, libusb_device* dev,
+                                           libusb_hotplug_event event, void* userData);
+    void addDevice(std::unique_ptr<usbfan::Device> device);
+    const FanConfig* configFor(const std::string& serial) const;
+    void idle();
+    void tick();
+    void tickDone();
+
+    usbfan::Context& usb;
+    EventLoop& loop;
+    usbfan::Batch batch;
+    std::vector<FanConfig> configs;
+    unsigned intervalMs;
+    bool verbose;
+    Broker* broker;
+    int timerFd;
+    bool hotplugRegistered;
+    libusb_hotplug_callback_handle hotplugHandle;
+    // Hotplug callbacks can't do synchronous I/O, so arrivals are opened
+    // from the idle handler
+    std::vector<libusb_device*> arrived;
+    std::vector<Fan> fans;
+};
+
+#endif
@@ -0,0 +1,111 @@
+//
+// Fan control daemon for USB PWM fan devices
+//
+// Everything runs on one thread: a single epoll loop waits on libusb's file
+// descriptors, the control timer and termination signals.
+//
+
+#include "Broker.h"
+#include "EventLoop.h"
+#include "FanDaemon.h"
+
+#include <csignal>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#define DEFAULT_CONFIG "/etc/usb-fand.conf"
+#define DEFAULT_SOCKET "/run/usb-fand.sock"
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-c config_file] [-s socket_path] [-v]\n", prog);
+    fprintf(stderr, "  -c  Configuration file, default " DEFAULT_CONFIG "\n");
+    fprintf(stderr, "  -s  Share devices with other processes through a socket at this path,\n");
+    fprintf(stderr, "      usually " DEFAULT_SOCKET "\n");
+    fprintf(stderr, "  -v  Print fan duty and speed every control interval\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* config_path = DEFAULT_CONFIG;
+    const char* socket_path = nullptr;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:vh")) != -1) {
+        switch (opt) {
+        case 'c':
+            config_path = optarg;
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    // Signals get handled on the event loop like everything else
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    int sig_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd < 0) {
+        perror("signalfd");
+        return 1;
+    }
+
+    try {
+        usbfan::Context usb;
+        EventLoop loop(usb);
+        FanDaemon daemon(usb, loop);
+
+        std::string error;
+        if (!daemon.loadConfig(config_path, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        daemon.setVerbose(verbose);
+
+        // Destroyed before the daemon, so its transfers are finished before
+        // the devices get closed
+        std::unique_ptr<Broker> broker;
+        if (socket_path) {
+            broker.reset(new Broker(usb, loop));
+            if (!broker->listen(socket_path, error)) {
+                fprintf(stderr, "%s\n", error.c_str());
+                return 1;
+            }
+            daemon.setBroker(broker.get());
+        }
+
+        loop.add(sig_fd, EPOLLIN, [&loop, sig_fd](uint32_t) {
+            signalfd_siginfo info;
+            if (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+                loop.stop();
+            }
+        });
+        if (!daemon.start()) {
+            return 1;
+        }
+        loop.run();
+        daemon.setBroker(nullptr);
+        broker.reset();
+        daemon.stop();
+        loop.remove(sig_fd);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    close(sig_fd);
+    return 0;
+}
@@ -0,0 +1,1010 @@
+//
+// Software model of a board running the USB PWM fan firmware
+//
+
+#include "EmulatedBoard.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Everything here mirrors firmware/src; keep the two in step
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 3
+
+#define FAN_INTERFACE 2
+// Everything but Timer4 PWM, like the default firmware build
+#define CAPABILITIES 0xfff7
+#define FAN_CHANNELS 1
+// There is no real flash image, so the image register reports a made-up one
+#define IMAGE_LENGTH 0x5a2e
+#define IMAGE_CRC 0x4d3b
+
+#define DEFAULT_PERIOD 640
+#define LED_MODE_MAX 3
+#define PWM_MODE_DITHER 0x01
+
+#define STAGE_IDLE 0
+#define STAGE_OPEN 1
+#define STAGE_COMMIT 2
+
+#define STAGED_DUTY 0x01
+#define STAGED_PERIOD 0x02
+#define STAGED_RATIO 0x04
+#define STAGED_MODE 0x08
+// Open staged sets are dropped after this long
+#define STAGE_TIMEOUT_MS 250
+
+#define CAL_STATE_NONE 0
+#define CAL_STATE_RUNNING 1
+#define CAL_STATE_VALID 2
+#define CAL_STATE_FAILED 3
+#define CAL_POINTS 16
+// The real sweep waits for each step to settle, which takes a good deal
+// longer than this
+#define CAL_STEP_MS 250
+
+#define CAPTURE_ENDPOINT 0x84
+#define CAPTURE_ENTRIES 255
+#define CAPTURE_TICK_US 4
+#define CAPTURE_GAP 0xffff
+#define STATS_TICK_US 4
+
+#define HISTORY_DEFAULT_INTERVAL_MS 1000
+#define HISTORY_MIN_INTERVAL_MS 100
+#define HISTORY_ENTRIES 96
+#define HISTORY_READ_ENTRIES 14
+#define HISTORY_FLAG_STALL 0x01
+
+// Made up, but about what the firmware handlers take, in 8 cycle counts
+#define COUNTERS_TACH_TICKS 22
+// About what the firmware measures from start to boot PWM on real hardware
+#define BOOT_PWM_US 6
+
+#define IDENTITY_SERIAL 0
+#define IDENTITY_NAME 1
+#define IDENTITY_LOCATION 2
+#define IDENTITY_SERIAL_MAX 16
+#define IDENTITY_TEXT_MAX 32
+// String descriptor index of the interface name
+#define INAME 0x10
+
+// Tach sample span covers this many edges
+#define TACH_SAMPLE_EDGES 16
+
+#define SCHEDULE_ENTRIES 8
+#define SCHEDULE_WRITE_LENGTH 7
+#define SCHEDULE_FLAG_FRAME 0x01
+#define SCHEDULE_FLAG_CLEAR 0x80
+
+#define COUNTERS_SETUP_TICKS 90
+#define COUNTERS_SETUP_BYTE_TICKS 3
+
+// Time constant for fan speed to follow duty changes
+#define FAN_LAG_SECONDS 1.0
+// Below this, the firmware sees the tach signal as stalled
+#define FAN_MIN_RPM 100
+
+const uint8_t EmulatedBoard::DEVICE_DESCRIPTOR[18] = {
+    0x12, 0x01, 0x10, 0x02, 0xef, 0x02, 0x01, 0x40,
+    0x41, 0x23, 0x36, 0x80, 0x00, 0x01, 0x01, 0x02,
+    0x03, 0x01
+};
+
+// CDC ACM interfaces as set up by the Arduino core, then the fan interface
+const uint8_t EmulatedBoard::CONFIG_DESCRIPTOR[91] = {
+    0x09, 0x02, 0x5b, 0x00, 0x03, 0x01, 0x00, 0x80, 0xfa,
+    0x08, 0x0b, 0x00, 0x02, 0x02, 0x02, 0x01, 0x00,
+    0x09, 0x04, 0x00, 0x00, 0x01, 0x02, 0x02, 0x00, 0x00,
+    0x05, 0x24, 0x00, 0x10, 0x01,
+    0x05, 0x24, 0x01, 0x01, 0x01,
+    0x04, 0x24, 0x02, 0x06,
+    0x05, 0x24, 0x06, 0x00, 0x01,
+    0x07, 0x05, 0x81, 0x03, 0x10, 0x00, 0x40,
+    0x09, 0x04, 0x01, 0x00, 0x02, 0x0a, 0x00, 0x00, 0x00,
+    0x07, 0x05, 0x02, 0x02, 0x40, 0x00, 0x00,
+    0x07, 0x05, 0x83, 0x02, 0x40, 0x00, 0x00,
+    0x09, 0x04, FAN_INTERFACE, 0x00, 0x01, 0xff, 0xfd, 0xff, 0x00,
+    0x07, 0x05, CAPTURE_ENDPOINT, 0x02, 0x40, 0x00, 0x00
+};
+
+const uint8_t EmulatedBoard::BOS_DESCRIPTOR[59] = {
+    0x05, 0x0f, 0x3b, 0x00, 0x02, 0x1c, 0x10, 0x05,
+    0x00, 0xdf, 0x60, 0xdd, 0xd8, 0x89, 0x45, 0xc7,
+    0x4c, 0x9c, 0xd2, 0x65, 0x9d, 0x9e, 0x64, 0x8a,
+    0x9f, 0x00, 0x00, 0x03, 0x06, 0xb2, 0x00, 0x02,
+    0x00, 0x1a, 0x10, 0x05, 0x00, 0x3b, 0xf9, 0xd9,
+    0x1a, 0x4c, 0x49, 0xda, 0x4d, 0xa1, 0xe5, 0x2e,
+    0x2b, 0xab, 0x18, 0x10, 0x52, VERSION_MINOR, VERSION_MAJOR, FAN_INTERFACE,
+    CAPABILITIES & 0xff, CAPABILITIES >> 8, FAN_CHANNELS
+};
+
+static const uint8_t MS_OS_20_DESCRIPTORS[] = {
+    0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x06,
+    0xb2, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0xa8, 0x00, 0x08, 0x00, 0x02, 0x00, 0x02, 0x00,
+    0xa0, 0x00, 0x14, 0x00, 0x03, 0x00, 0x57, 0x49,
+    0x4e, 0x55, 0x53, 0x42, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x84, 0x00,
+    0x04, 0x00, 0x07, 0x00, 0x2a, 0x00, 0x44, 0x00,
+    0x65, 0x00, 0x76, 0x00, 0x69, 0x00, 0x63, 0x00,
+    0x65, 0x00, 0x49, 0x00, 0x6e, 0x00, 0x74, 0x00,
+    0x65, 0x00, 0x72, 0x00, 0x66, 0x00, 0x61, 0x00,
+    0x63, 0x00, 0x65, 0x00, 0x47, 0x00, 0x55, 0x00,
+    0x49, 0x00, 0x44, 0x00, 0x73, 0x00, 0x00, 0x00,
+    0x50, 0x00, 0x7b, 0x00, 0x31, 0x00, 0x41, 0x00,
+    0x44, 0x00, 0x39, 0x00, 0x46, 0x00, 0x39, 0x00,
+    0x33, 0x00, 0x42, 0x00, 0x2d, 0x00, 0x34, 0x00,
+    0x39, 0x00, 0x34, 0x00, 0x43, 0x00, 0x2d, 0x00,
+    0x34, 0x00, 0x44, 0x00, 0x44, 0x00, 0x41, 0x00,
+    0x2d, 0x00, 0x41, 0x00, 0x31, 0x00, 0x45, 0x00,
+    0x35, 0x00, 0x2d, 0x00, 0x32, 0x00, 0x45, 0x00,
+    0x32, 0x00, 0x42, 0x00, 0x41, 0x00, 0x42, 0x00,
+    0x31, 0x00, 0x38, 0x00, 0x31, 0x00, 0x30, 0x00,
+    0x35, 0x00, 0x32, 0x00, 0x7d, 0x00, 0x00, 0x00,
+    0x00, 0x00
+};
+
+static const char* const STRINGS[] = { "Arduino LLC", "Arduino Leonardo" };
+
+#define REG_READ 0x01
+#define REG_WRITE 0x02
+#define REG_BLOCK 0x04
+#define REG_STAGED 0x08
+#define REG_FAN_CONTROL 0x10
+#define REG_CLEAR_ON_READ 0x20
+#define REG_WRITE_BLOCK 0x40
+#define SCHEMA_ENTRY_LENGTH 7
+#define SCHEMA_READ_ENTRIES 8
+
+// Same as the firmware's register table, which answers schema reads and
+// does the access and range checks
+struct SchemaEntry {
+    uint8_t reg;
+    uint8_t flags;
+    uint8_t length;
+    uint16_t min;
+    uint16_t max;
+};
+
+static const SchemaEntry SCHEMA[] = {
+    { 0x00, REG_READ, 2, 0, 0 },
+    { 0x01, REG_READ | REG_BLOCK, 2 + SCHEMA_READ_ENTRIES * SCHEMA_ENTRY_LENGTH, 0, 0 },
+    { 0x02, REG_READ | REG_BLOCK, 4, 0, 0 },
+    { 0x03, REG_READ | REG_BLOCK, 4, 0, 0 },
+    { 0x10, REG_READ | REG_WRITE | REG_STAGED | REG_FAN_CONTROL, 2, 0, 0xffff },
+    { 0x11, REG_READ | REG_WRITE | REG_STAGED, 2, 0, 0xffff },
+    { 0x12, REG_READ, 2, 0, 0 },
+    { 0x13, REG_READ | REG_WRITE, 2, STAGE_IDLE, STAGE_COMMIT },
+    { 0x14, REG_READ | REG_WRITE | REG_STAGED | REG_FAN_CONTROL, 2, 0, 0xffff },
+    { 0x15, REG_READ | REG_WRITE | REG_STAGED, 2, 0, PWM_MODE_DITHER },
+    { 0x16, REG_READ | REG_BLOCK | REG_CLEAR_ON_READ, 18, 0, 0 },
+    { 0x17, REG_READ | REG_WRITE, 2, 0, 0xffff },
+    { 0x18, REG_READ | REG_BLOCK, 8, 0, 0 },
+    { 0x19, REG_READ | REG_BLOCK, 16, 0, 0 },
+    { 0x1a, REG_READ | REG_BLOCK, 12, 0, 0 },
+    { 0x1b, REG_READ | REG_BLOCK | REG_WRITE_BLOCK, 1 + SCHEDULE_ENTRIES * 6, 0, 0 },
+    { 0x20, REG_READ | REG_WRITE, 2, 0, 1 },
+    { 0x21, REG_READ | REG_BLOCK, 6 + CAL_POINTS * 2, 0, 0 },
+    { 0x30, REG_READ | REG_WRITE, 2, 0, 1 },
+    { 0x31, REG_READ | REG_BLOCK, 4, 0, 0 },
+    { 0x40, REG_READ | REG_WRITE, 2, 0, 0xffff },
+    { 0x41, REG_READ | REG_BLOCK, 6 + HISTORY_READ_ENTRIES * 4, 0, 0 },
+    { 0x50, REG_READ | REG_WRITE | REG_BLOCK, 26, 0, 0 },
+    { 0xf0, REG_WRITE, 2, 0, 0xffff },
+    { 0xf1, REG_READ | REG_WRITE, 2, 0, LED_MODE_MAX },
+    { 0xf8, REG_READ | REG_BLOCK | REG_WRITE_BLOCK, IDENTITY_SERIAL_MAX, 0, 0 },
+    { 0xf9, REG_READ | REG_BLOCK | REG_WRITE_BLOCK, IDENTITY_TEXT_MAX, 0, 0 },
+    { 0xfa, REG_READ | REG_BLOCK | REG_WRITE_BLOCK, IDENTITY_TEXT_MAX, 0, 0 },
+};
+
+// Frames on the emulated bus count from when the first board was made,
+// and every board sees the same ones
+static EmulatedBoard::Clock::time_point bus_start = EmulatedBoard::Clock::now();
+
+static uint32_t bus_frame(EmulatedBoard::Clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t - bus_start).count();
+}
+
+static const SchemaEntry* find_register(uint8_t reg)
+{
+    for (const SchemaEntry& entry : SCHEMA) {
+        if (entry.reg == reg) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+static int send(uint8_t* data, uint16_t length, const void* src, size_t size)
+{
+    size_t count = std::min<size_t>(length, size);
+    memcpy(data, src, count);
+    return count;
+}
+
+static int send16(uint8_t* data, uint16_t length, uint16_t value)
+{
+    uint8_t buf[2] = { (uint8_t)value, (uint8_t)(value >> 8) };
+    return send(data, length, buf, sizeof(buf));
+}
+
+static uint16_t step_ratio(unsigned i)
+{
+    return (uint32_t)65535 * i / (CAL_POINTS - 1);
+}
+
+EmulatedBoard::EmulatedBoard(const std::string& serialNumber, unsigned seed)
+    : resetRequest(RESET_NONE), serial(serialNumber), calState(CAL_STATE_NONE),
+      captureRunning(false), captureLost(false), captureDropped(0), watchdogResets(0),
+      bootDuty(0), rpm(0),
+      noise(seed * 2654435761u + 1), lastIntervalUs(0), lastUpdate(Clock::now())
+{
+    memset(calTable, 0, sizeof(calTable));
+    maxRpm = 1200 + (seed * 337) % 1800;
+    startRatio = 0.12 + (seed % 5) * 0.02;
+    resetStats();
+    reboot();
+}
+
+void EmulatedBoard::reboot()
+{
+    resetConfig();
+    ledMode = 0;
+    captureBuffer.clear();
+    history.clear();
+    historyInterval = HISTORY_DEFAULT_INTERVAL_MS;
+    historyNextSeq = 0;
+    // First sample is taken right at startup
+    historyNextSample = Clock::now();
+    clearCounters(Clock::now());
+    bootTime = Clock::now();
+    bootConfiguredUs = 0;
+}
+
+void EmulatedBoard::clearCounters(Clock::time_point now)
+{
+    counterTachEdges = 0;
+    counterSetupServed = 0;
+    counterSetupRejected = 0;
+    counterTachMax = 0;
+    counterSetupMax = 0;
+    counterClearTime = now;
+}
+
+void EmulatedBoard::resetConfig()
+{
+    if (calState == CAL_STATE_RUNNING) {
+        calState = calTable[1] = CAL_STATE_FAILED;
+    }
+    period = DEFAULT_PERIOD;
+    duty = 0;
+    ratioValue = 0;
+    ratioMode = false;
+    dither = false;
+    stageState = STAGE_IDLE;
+    stagedMask = 0;
+    captureRunning = false;
+    schedule.clear();
+    if (bootDuty) {
+        setDuty(bootDuty, true);
+    }
+}
+
+int EmulatedBoard::control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+                           uint8_t* data, uint16_t length, Clock::time_point now)
+{
+    if (!bootConfiguredUs) {
+        // Near enough to when the host gets it configured
+        bootConfiguredUs =
+            std::chrono::duration_cast<std::chrono::microseconds>(now - bootTime).count();
+    }
+    if (requestType == 0x80 && request == 0x06) {
+        return getDescriptor(value, index, data, length);
+    } else if (requestType == 0x80 && request == 0x00) {
+        return send16(data, length, 0);
+    } else if (requestType == 0x80 && request == 0x08) {
+        uint8_t config = 1;
+        return send(data, length, &config, 1);
+    } else if ((requestType & 0x60) == 0 && !(requestType & 0x80)) {
+        // Standard requests like SET_CONFIGURATION just get accepted
+        return 0;
+    }
+
+    // Everything else goes through the firmware's setup handler
+    int rv = -1;
+    if (requestType == 0xc0 && request == 0x02 && index == 0x07) {
+        rv = send(data, length, MS_OS_20_DESCRIPTORS, sizeof(MS_OS_20_DESCRIPTORS));
+    } else if (requestType == 0xc1 && index == FAN_INTERFACE) {
+        const SchemaEntry* entry = find_register(request);
+        if (entry && (entry->flags & REG_READ)) {
+            rv = readRegister(request, value, data, length, now);
+        }
+    } else if (requestType == 0x41 && index == FAN_INTERFACE && length) {
+        const SchemaEntry* entry = find_register(request);
+        if (entry && (entry->flags & REG_WRITE_BLOCK) && length <= entry->length) {
+            rv = writeRegisterBlock(request, data, length, now) ? 0 : -1;
+        }
+    } else if (requestType == 0x41 && index == FAN_INTERFACE) {
+        const SchemaEntry* entry = find_register(request);
+        if (entry && (entry->flags & REG_WRITE) && value >= entry->min && value <= entry->max) {
+            rv = writeRegister(request, value, now) ? 0 : -1;
+        }
+    }
+    if (rv >= 0) {
+        counterSetupServed++;
+        counterSetupMax = std::max<uint16_t>(counterSetupMax,
+                                             COUNTERS_SETUP_TICKS + rv * COUNTERS_SETUP_BYTE_TICKS);
+    } else {
+        counterSetupRejected++;
+    }
+    return rv;
+}
+
+int EmulatedBoard::bulkIn(uint8_t endpoint, uint8_t* data, int length, Clock::time_point now)
+{
+    if (endpoint != CAPTURE_ENDPOINT) {
+        return -1;
+    }
+    update(now);
+    int count = 0;
+    while (count + 2 <= length && !captureBuffer.empty()) {
+        data[count++] = (uint8_t)captureBuffer.front();
+        data[count++] = captureBuffer.front() >> 8;
+        captureBuffer.pop_front();
+    }
+    return count;
+}
+
+int EmulatedBoard::getDescriptor(uint16_t value, uint16_t index, uint8_t* data, uint16_t length)
+{
+    (void)index;
+    uint8_t type = value >> 8;
+    uint8_t i = value & 0xff;
+    if (type == 0x01 && i == 0) {
+        return send(data, length, DEVICE_DESCRIPTOR, sizeof(DEVICE_DESCRIPTOR));
+    } else if (type == 0x02 && i == 0) {
+        uint8_t config[sizeof(CONFIG_DESCRIPTOR)];
+        configDescriptor(config);
+        return send(data, length, config, sizeof(config));
+    } else if (type == 0x0f && i == 0) {
+        return send(data, length, BOS_DESCRIPTOR, sizeof(BOS_DESCRIPTOR));
+    } else if (type == 0x03) {
+        uint8_t buf[64];
+        if (i == 0) {
+            // US English only
+            const uint8_t langids[] = { 0x04, 0x03, 0x09, 0x04 };
+            return send(data, length, langids, sizeof(langids));
+        }
+        std::string str;
+        if (i <= 2) {
+            str = STRINGS[i - 1];
+        } else if (i == 3) {
+            str = currentSerial();
+        } else if (i == INAME && !identity[IDENTITY_NAME].empty()) {
+            str = identity[IDENTITY_NAME];
+        } else {
+            return -1;
+        }
+        size_t chars = std::min<size_t>(str.size(), (sizeof(buf) - 2) / 2);
+        buf[0] = 2 + chars * 2;
+        buf[1] = 0x03;
+        for (size_t c = 0; c < chars; c++) {
+            buf[2 + c * 2] = str[c];
+            buf[3 + c * 2] = 0;
+        }
+        return send(data, length, buf, buf[0]);
+    }
+    return -1;
+}
+
+double EmulatedBoard::effectiveRatio() const
+{
+    if (ratioMode) {
+        return ratioValue / 65535.0;
+    }
+    uint32_t cycles = (uint32_t)(uint16_t)(period - 1) + 1;
+    return std::min(1.0, (double)duty / cycles);
+}
+
+double EmulatedBoard::steadyRpm(double ratio) const
+{
+    if (ratio < startRatio) {
+        return 0;
+    }
+    // Most PWM fans bottom out around a quarter of full speed
+    return maxRpm * (0.25 + 0.75 * (ratio - startRatio) / (1 - startRatio));
+}
+
+void EmulatedBoard::update(Clock::time_point now)
+{
+    pollCalibration(now);
+    // Scheduled changes land at their time, with the fan stepped up to it
+    while (!schedule.empty() && schedule.front().when <= now) {
+        advance(schedule.front().when);
+        if (calState == CAL_STATE_RUNNING) {
+            calState = calTable[1] = CAL_STATE_FAILED;
+        }
+        setDuty(schedule.front().ratio, true);
+        schedule.erase(schedule.begin());
+    }
+    // Step the fan through every history sample time, so samples see the
+    // speed as it was then
+    while (historyInterval && historyNextSample <= now) {
+        advance(historyNextSample);
+        recordHistory();
+        historyNextSample += std::chrono::milliseconds(historyInterval);
+    }
+    advance(now);
+}
+
+void EmulatedBoard::advance(Clock::time_point now)
+{
+    double dt = std::chrono::duration<double>(now - lastUpdate).count();
+    if (dt <= 0) {
+        return;
+    }
+    lastUpdate = now;
+    double target = steadyRpm(effectiveRatio());
+    rpm += (target - rpm) * (1 - exp(-dt / FAN_LAG_SECONDS));
+    captureEdges(now);
+}
+
+void EmulatedBoard::captureEdges(Clock::time_point now)
+{
+    if (rpm < FAN_MIN_RPM) {
+        lastEdge = Clock::time_point();
+        lastIntervalUs = 0;
+        return;
+    }
+    if (lastEdge == Clock::time_point() || now - lastEdge > std::chrono::seconds(10)) {
+        // Starting up, or not looked at in a long while; skip ahead
+        captureLost = true;
+        lastEdge = now;
+        lastIntervalUs = 0;
+        return;
+    }
+    for (;;) {
+        // 2 pulses per revolution, with a little jitter
+        noise = noise * 1103515245 + 12345;
+        double jitter = ((int)((noise >> 16) % 1001) - 500) / 250000.0;
+        auto interval = std::chrono::microseconds((long)(30000000 / rpm * (1 + jitter)));
+        if (lastEdge + interval > now) {
+            break;
+        }
+        lastEdge += interval;
+        counterTachEdges++;
+        counterTachMax = std::max<uint16_t>(counterTachMax, COUNTERS_TACH_TICKS + (noise >> 28));
+
+        if (lastIntervalUs) {
+            long rev_ticks = (lastIntervalUs + interval.count()) / STATS_TICK_US;
+            uint16_t period = std::min(rev_ticks, 0xffffL);
+            statsMin = std::min(statsMin, period);
+            statsMax = std::max(statsMax, period);
+            if (statsCount != 0xffff) {
+                statsCount++;
+                statsSum += period;
+                statsSumSquares += (uint32_t)period * period;
+            }
+        }
+        lastIntervalUs = interval.count();
+
+        if (!captureRunning) {
+            continue;
+        }
+        if (captureBuffer.size() >= CAPTURE_ENTRIES) {
+            if (captureDropped < 0xffff) {
+                captureDropped++;
+            }
+            captureLost = true;
+            continue;
+        }
+        long ticks = interval.count() / CAPTURE_TICK_US;
+        captureBuffer.push_back(captureLost || ticks >= CAPTURE_GAP ? CAPTURE_GAP : ticks);
+        captureLost = false;
+    }
+}
+
+uint16_t EmulatedBoard::dutyRatio() const
+{
+    if (ratioMode) {
+        return ratioValue;
+    }
+    uint32_t cycles = (uint32_t)(uint16_t)(period - 1) + 1;
+    if (duty >= cycles) {
+        return 0xffff;
+    }
+    return ((uint32_t)duty * 65535 + cycles / 2) / cycles;
+}
+
+void EmulatedBoard::setDuty(uint16_t value, bool ratio)
+{
+    ratioMode = ratio;
+    if (ratio) {
+        ratioValue = value;
+    } else {
+        duty = value;
+    }
+}
+
+void EmulatedBoard::pollCalibration(Clock::time_point now)
+{
+    if (calState != CAL_STATE_RUNNING) {
+        return;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - calStart).count();
+    unsigned step = elapsed / CAL_STEP_MS;
+    if (step < CAL_POINTS) {
+        setDuty(step_ratio(step), true);
+        return;
+    }
+
+    uint16_t start_ratio = 0, max_rpm = 0;
+    for (unsigned i = 0; i < CAL_POINTS; i++) {
+        uint16_t step_rpm = (uint16_t)steadyRpm(step_ratio(i) / 65535.0);
+        if (step_rpm && !max_rpm) {
+            start_ratio = step_ratio(i);
+        }
+        max_rpm = std::max(max_rpm, step_rpm);
+        calTable[6 + i * 2] = (uint8_t)step_rpm;
+        calTable[7 + i * 2] = step_rpm >> 8;
+    }
+    calTable[0] = CAL_POINTS;
+    calTable[1] = calState = CAL_STATE_VALID;
+    calTable[2] = (uint8_t)start_ratio;
+    calTable[3] = start_ratio >> 8;
+    calTable[4] = (uint8_t)max_rpm;
+    calTable[5] = max_rpm >> 8;
+    setDuty(calSavedRatio, true);
+}
+
+void EmulatedBoard::recordHistory()
+{
+    bool stalled = effectiveRatio() > 0 && rpm < FAN_MIN_RPM;
+    history.push_back(HistoryEntry{ readRpm(), (uint8_t)(dutyRatio() >> 8),
+                                    (uint8_t)(stalled ? HISTORY_FLAG_STALL : 0) });
+    if (history.size() > HISTORY_ENTRIES) {
+        history.pop_front();
+    }
+    historyNextSeq++;
+}
+
+uint16_t EmulatedBoard::readRpm()
+{
+    if (rpm < FAN_MIN_RPM) {
+        return 0;
+    }
+    // Tach readings jitter a bit
+    noise = noise * 1103515245 + 12345;
+    double jitter = ((int)((noise >> 16) % 1001) - 500) / 100000.0;
+    return (uint16_t)(rpm * (1 + jitter) + 0.5);
+}
+
+void EmulatedBoard::resetStats()
+{
+    statsCount = 0;
+    statsMin = 0xffff;
+    statsMax = 0;
+    statsSum = 0;
+    statsSumSquares = 0;
+}
+
+int EmulatedBoard::readRegister(uint8_t reg, uint16_t value, uint8_t* data, uint16_t length,
+                                Clock::time_point now)
+{
+    update(now);
+    if (reg == 0x00) {
+        const uint8_t version[2] = { VERSION_MINOR, VERSION_MAJOR };
+        return send(data, length, version, sizeof(version));
+    } else if (reg == 0x01) {
+        const unsigned count = sizeof(SCHEMA) / sizeof(SCHEMA[0]);
+        unsigned first = std::min<unsigned>(value, count);
+        unsigned n = std::min<unsigned>(count - first, SCHEMA_READ_ENTRIES);
+        uint8_t reply[2 + SCHEMA_READ_ENTRIES * SCHEMA_ENTRY_LENGTH];
+        reply[0] = count;
+        reply[1] = first;
+        for (unsigned i = 0; i < n; i++) {
+            const SchemaEntry& entry = SCHEMA[first + i];
+            uint8_t* p = reply + 2 + i * SCHEMA_ENTRY_LENGTH;
+            p[0] = entry.reg;
+            p[1] = entry.flags;
+            p[2] = entry.length;
+            p[3] = (uint8_t)entry.min;
+            p[4] = entry.min >> 8;
+            p[5] = (uint8_t)entry.max;
+            p[6] = entry.max >> 8;
+        }
+        return send(data, length, reply, 2 + n * SCHEMA_ENTRY_LENGTH);
+    } else if (reg == 0x02) {
+        const uint8_t caps[4] = { CAPABILITIES & 0xff, CAPABILITIES >> 8, FAN_CHANNELS,
+                                  CAPTURE_ENDPOINT };
+        return send(data, length, caps, sizeof(caps));
+    } else if (reg == 0x03) {
+        const uint8_t image[4] = { IMAGE_LENGTH & 0xff, IMAGE_LENGTH >> 8,
+                                   IMAGE_CRC & 0xff, IMAGE_CRC >> 8 };
+        return send(data, length, image, sizeof(image));
+    } else if (reg == 0x10) {
+        uint16_t value = duty;
+        if (ratioMode) {
+            uint32_t cycles = (uint32_t)(uint16_t)(period - 1) + 1;
+            // Full duty on a 65536 cycle period reads back as near as it can
+            value = std::min<uint32_t>(((uint32_t)ratioValue * cycles + 32767) / 65535, 0xffff);
+        }
+        return send16(data, length, value);
+    } else if (reg == 0x11) {
+        return send16(data, length, period);
+    } else if (reg == 0x12) {
+        return send16(data, length, readRpm());
+    } else if (reg == 0x13) {
+        expireStage(now);
+        return send16(data, length, stageState);
+    } else if (reg == 0x14) {
+        return send16(data, length, dutyRatio());
+    } else if (reg == 0x15) {
+        return send16(data, length, dither ? PWM_MODE_DITHER : 0);
+    } else if (reg == 0x16) {
+        uint8_t stats[18];
+        const uint16_t words[3] = { statsCount, statsMin, statsMax };
+        for (int i = 0; i < 3; i++) {
+            stats[i * 2] = (uint8_t)words[i];
+            stats[i * 2 + 1] = words[i] >> 8;
+        }
+        for (int i = 0; i < 4; i++) {
+            stats[6 + i] = (uint8_t)(statsSum >> (i * 8));
+        }
+        for (int i = 0; i < 8; i++) {
+            stats[10 + i] = (uint8_t)(statsSumSquares >> (i * 8));
+        }
+        resetStats();
+        return send(data, length, stats, sizeof(stats));
+    } else if (reg == 0x17) {
+        return send16(data, length, bootDuty);
+    } else if (reg == 0x18) {
+        const uint32_t times[2] = { bootDuty ? (uint32_t)BOOT_PWM_US : 0, bootConfiguredUs };
+        uint8_t reply[8];
+        for (int i = 0; i < 8; i++) {
+            reply[i] = (uint8_t)(times[i / 4] >> (i % 4 * 8));
+        }
+        return send(data, length, reply, sizeof(reply));
+    } else if (reg == 0x19) {
+        // Device time runs from boot, as micros() does
+        auto since_boot = [this](Clock::time_point t) {
+            return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                t - bootTime).count();
+        };
+        const uint32_t times[3] = {
+            since_boot(now), lastEdge == Clock::time_point() ? 0 : since_boot(lastEdge),
+            (uint32_t)(lastIntervalUs * TACH_SAMPLE_EDGES)
+        };
+        const uint16_t values[2] = { readRpm(), dutyRatio() };
+        uint8_t reply[16];
+        for (int i = 0; i < 12; i++) {
+            reply[i] = (uint8_t)(times[i / 4] >> (i % 4 * 8));
+        }
+        for (int i = 0; i < 4; i++) {
+            reply[12 + i] = (uint8_t)(values[i / 2] >> (i % 2 * 8));
+        }
+        return send(data, length, reply, sizeof(reply));
+    } else if (reg == 0x1a) {
+        // Frames counted since boot on top of the bus frame number the board
+        // started at; emulated clocks don't drift, and lock on right away
+        uint32_t boot_frame = bus_frame(bootTime);
+        uint32_t frame = (boot_frame & 0x7ff) + bus_frame(now) - boot_frame;
+        uint16_t frame_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            now - bus_start).count() % 1000;
+        uint32_t device_us =
+            std::chrono::duration_cast<std::chrono::microseconds>(now - bootTime).count();
+        uint8_t reply[12];
+        for (int i = 0; i < 4; i++) {
+            reply[i] = (uint8_t)(frame >> (i * 8));
+            reply[6 + i] = (uint8_t)(device_us >> (i * 8));
+        }
+        reply[4] = (uint8_t)frame_us;
+        reply[5] = frame_us >> 8;
+        reply[10] = reply[11] = 0;
+        return send(data, length, reply, sizeof(reply));
+    } else if (reg == 0x1b) {
+        uint8_t reply[1 + SCHEDULE_ENTRIES * 6];
+        reply[0] = schedule.size();
+        for (size_t i = 0; i < schedule.size(); i++) {
+            uint32_t when = deviceTime(schedule[i].when);
+            uint8_t* entry = reply + 1 + i * 6;
+            for (int j = 0; j < 4; j++) {
+                entry[j] = (uint8_t)(when >> (j * 8));
+            }
+            entry[4] = (uint8_t)schedule[i].ratio;
+            entry[5] = schedule[i].ratio >> 8;
+        }
+        return send(data, length, reply, 1 + schedule.size() * 6);
+    } else if (reg == 0x20) {
+        return send16(data, length, calState);
+    } else if (reg == 0x21) {
+        return send(data, length, calTable, sizeof(calTable));
+    } else if (reg == 0x30) {
+        return send16(data, length, captureRunning);
+    } else if (reg == 0x31) {
+        const uint8_t status[4] = { (uint8_t)captureBuffer.size(), 0, (uint8_t)captureDropped,
+                                    (uint8_t)(captureDropped >> 8) };
+        return send(data, length, status, sizeof(status));
+    } else if (reg == 0x40) {
+        return send16(data, length, historyInterval);
+    } else if (reg == 0x41) {
+        uint16_t count = history.size();
+        uint16_t seq = value;
+        uint16_t oldest = historyNextSeq - count;
+        if ((uint16_t)(seq - oldest) > count) {
+            seq = oldest;
+        }
+        unsigned n = std::min<unsigned>((uint16_t)(historyNextSeq - seq), HISTORY_READ_ENTRIES);
+        uint8_t reply[6 + HISTORY_READ_ENTRIES * 4];
+        const uint16_t header[3] = { seq, historyNextSeq, historyInterval };
+        for (int i = 0; i < 3; i++) {
+            reply[i * 2] = (uint8_t)header[i];
+            reply[i * 2 + 1] = header[i] >> 8;
+        }
+        for (unsigned i = 0; i < n; i++) {
+            const HistoryEntry& entry = history[(uint16_t)(seq - oldest) + i];
+            reply[6 + i * 4] = (uint8_t)entry.rpm;
+            reply[7 + i * 4] = entry.rpm >> 8;
+            reply[8 + i * 4] = entry.duty;
+            reply[9 + i * 4] = entry.flags;
+        }
+        return send(data, length, reply, 6 + n * 4);
+    } else if (reg == 0x50) {
+        update(now);
+        uint32_t elapsedUs =
+            std::chrono::duration_cast<std::chrono::microseconds>(now - counterClearTime).count();
+        // The loop runs on every interrupt, the 1 ms timer tick included
+        uint32_t loops = elapsedUs / 1000 + counterTachEdges + counterSetupServed +
+                         counterSetupRejected;
+        const uint32_t longs[5] = { elapsedUs, counterTachEdges, loops, counterSetupServed,
+                                    counterSetupRejected };
+        const uint16_t words[3] = { counterTachMax, counterSetupMax, watchdogResets };
+        uint8_t reply[26];
+        for (int i = 0; i < 5; i++) {
+            for (int j = 0; j < 4; j++) {
+                reply[i * 4 + j] = (uint8_t)(longs[i] >> (j * 8));
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            reply[20 + i * 2] = (uint8_t)words[i];
+            reply[21 + i * 2] = words[i] >> 8;
+        }
+        return send(data, length, reply, sizeof(reply));
+    } else if (reg == 0xf1) {
+        return send16(data, length, ledMode);
+    } else if (reg == 0xf8) {
+        return send(data, length, currentSerial().data(), currentSerial().size());
+    } else if (reg == 0xf9 || reg == 0xfa) {
+        const std::string& str = identity[reg == 0xf9 ? IDENTITY_NAME : IDENTITY_LOCATION];
+        return send(data, length, str.data(), str.size());
+    }
+    return -1;
+}
+
+bool EmulatedBoard::writeRegisterBlock(uint8_t reg, const uint8_t* data, uint16_t length,
+                                       Clock::time_point now)
+{
+    if (reg == 0x1b) {
+        return writeSchedule(data, length, now);
+    }
+    unsigned which = reg == 0xf8 ? IDENTITY_SERIAL : reg == 0xf9 ? IDENTITY_NAME : IDENTITY_LOCATION;
+    std::string str;
+    for (uint16_t i = 0; i < length && data[i]; i++) {
+        if (data[i] < 0x20 || data[i] >= 0x7f ||
+            (which == IDENTITY_SERIAL && (data[i] == ' ' || data[i] == ','))) {
+            return false;
+        }
+        str += (char)data[i];
+    }
+    if (str.size() > (which == IDENTITY_SERIAL ? IDENTITY_SERIAL_MAX : IDENTITY_TEXT_MAX)) {
+        return false;
+    }
+    identity[which] = str;
+    return true;
+}
+
+bool EmulatedBoard::writeSchedule(const uint8_t* data, uint16_t length, Clock::time_point now)
+{
+    update(now);
+    if (length == 1 && data[0] == SCHEDULE_FLAG_CLEAR) {
+        schedule.clear();
+        return true;
+    }
+    if (length != SCHEDULE_WRITE_LENGTH) {
+        return false;
+    }
+    uint32_t when = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+    uint16_t ratio = data[5] | (data[6] << 8);
+    Clock::time_point at;
+    if (data[0] & SCHEDULE_FLAG_FRAME) {
+        // Undo the frame count's offset from the bus frame number, see the
+        // frame clock register
+        uint32_t boot_frame = bus_frame(bootTime);
+        at = bus_start + std::chrono::milliseconds(when - (boot_frame & 0x7ff) + boot_frame);
+    } else {
+        at = now + std::chrono::microseconds((int32_t)(when - deviceTime(now)));
+    }
+    if (at < now) {
+        return false;
+    }
+    if (data[0] & SCHEDULE_FLAG_CLEAR) {
+        schedule.clear();
+    }
+    if (schedule.size() == SCHEDULE_ENTRIES) {
+        return false;
+    }
+    auto pos = std::upper_bound(schedule.begin(), schedule.end(), at,
+                                [](Clock::time_point t, const ScheduleEntry& entry) {
+                                    return t < entry.when;
+                                });
+    schedule.insert(pos, { at, ratio });
+    return true;
+}
+
+// Microseconds since boot, as micros() counts
+uint32_t EmulatedBoard::deviceTime(Clock::time_point t) const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - bootTime).count();
+}
+
+const std::string& EmulatedBoard::currentSerial() const
+{
+    return identity[IDENTITY_SERIAL].empty() ? serial : identity[IDENTITY_SERIAL];
+}
+
+void EmulatedBoard::configDescriptor(uint8_t* data) const
+{
+    memcpy(data, CONFIG_DESCRIPTOR, sizeof(CONFIG_DESCRIPTOR));
+    if (!identity[IDENTITY_NAME].empty()) {
+        // iInterface of the fan interface, the second to last descriptor
+        data[sizeof(CONFIG_DESCRIPTOR) - 7 - 1] = INAME;
+    }
+}
+
+void EmulatedBoard::expireStage(Clock::time_point now)
+{
+    if (stageState == STAGE_OPEN &&
+        now - stageOpenTime >= std::chrono::milliseconds(STAGE_TIMEOUT_MS)) {
+        stagedMask = 0;
+        stageState = STAGE_IDLE;
+    }
+}
+
+bool EmulatedBoard::writeRegister(uint8_t reg, uint16_t value, Clock::time_point now)
+{
+    update(now);
+    if ((reg == 0x10 || reg == 0x14) && calState == CAL_STATE_RUNNING) {
+        calState = calTable[1] = CAL_STATE_FAILED;
+    }
+
+    expireStage(now);
+    if (stageState == STAGE_OPEN) {
+        if (reg == 0x10) {
+            stagedDuty = value;
+            stagedMask = (stagedMask & ~STAGED_RATIO) | STAGED_DUTY;
+            return true;
+        } else if (reg == 0x11) {
+            stagedPeriod = value;
+            stagedMask |= STAGED_PERIOD;
+            return true;
+        } else if (reg == 0x14) {
+            stagedRatio = value;
+            stagedMask = (stagedMask & ~STAGED_DUTY) | STAGED_RATIO;
+            return true;
+        } else if (reg == 0x15 && !(value & ~PWM_MODE_DITHER)) {
+            stagedMode = value;
+            stagedMask |= STAGED_MODE;
+            return true;
+        }
+    }
+
+    if (reg == 0x10) {
+        setDuty(value, false);
+    } else if (reg == 0x11) {
+        period = value;
+    } else if (reg == 0x13) {
+        if (value == STAGE_COMMIT) {
+            if (stageState == STAGE_OPEN) {
+                if (stagedMask & STAGED_MODE) {
+                    dither = stagedMode & PWM_MODE_DITHER;
+                }
+                if (stagedMask & STAGED_DUTY) {
+                    setDuty(stagedDuty, false);
+                } else if (stagedMask & STAGED_RATIO) {
+                    setDuty(stagedRatio, true);
+                }
+                if (stagedMask & STAGED_PERIOD) {
+                    period = stagedPeriod;
+                }
+                stagedMask = 0;
+                stageState = STAGE_IDLE;
+            }
+        } else if (value == STAGE_OPEN || value == STAGE_IDLE) {
+            stagedMask = 0;
+            stageState = value;
+            stageOpenTime = now;
+        } else {
+            return false;
+        }
+    } else if (reg == 0x14) {
+        setDuty(value, true);
+    } else if (reg == 0x15) {
+        if (value & ~PWM_MODE_DITHER) {
+            return false;
+        }
+        dither = value & PWM_MODE_DITHER;
+    } else if (reg == 0x17) {
+        bootDuty = value;
+    } else if (reg == 0x20) {
+        if (value == 1) {
+            calSavedRatio = dutyRatio();
+            memset(calTable, 0, sizeof(calTable));
+            calTable[0] = CAL_POINTS;
+            calTable[1] = calState = CAL_STATE_RUNNING;
+            calStart = now;
+            pollCalibration(now);
+        } else if (value == 0) {
+            if (calState == CAL_STATE_RUNNING) {
+                calState = calTable[1] = CAL_STATE_FAILED;
+            }
+        } else {
+            return false;
+        }
+    } else if (reg == 0x30) {
+        if (value == 1) {
+            captureBuffer.clear();
+            captureDropped = 0;
+            // The first edge only starts the first interval
+            captureLost = false;
+            captureRunning = true;
+            if (lastEdge != Clock::time_point()) {
+                lastEdge = now;
+            }
+        } else if (value == 0) {
+            captureRunning = false;
+        } else {
+            return false;
+        }
+    } else if (reg == 0x40) {
+        if (value && value < HISTORY_MIN_INTERVAL_MS) {
+            return false;
+        }
+        historyInterval = value;
+        history.clear();
+        historyNextSample = now + std::chrono::milliseconds(value);
+    } else if (reg == 0x50) {
+        if (value != 0) {
+            return false;
+        }
+        clearCounters(now);
+        watchdogResets = 0;
+    } else if (reg == 0xf0) {
+        if (value == 1) {
+            resetConfig();
+            if (historyInterval != HISTORY_DEFAULT_INTERVAL_MS) {
+                historyInterval = HISTORY_DEFAULT_INTERVAL_MS;
+                history.clear();
+                historyNextSample = now + std::chrono::milliseconds(historyInterval);
+            }
+        } else if (value == 2) {
+            resetRequest = RESET_REBOOT;
+        } else if (value == 255) {
+            // Watchdog test ends in a reboot too, one the firmware counts
+            if (watchdogResets != 0xffff) {
+                watchdogResets++;
+            }
+            resetRequest = RESET_REBOOT;
+        } else if (value == 3) {
+            resetRequest = RESET_BOOTLOADER;
+        }
+    } else if (reg == 0xf1) {
+        if (value <= LED_MODE_MAX) {
+            ledMode = value;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,148 @@
+#ifndef EmulatedBoard_h
+#define EmulatedBoard_h
+
+//
+// Software model of a board running the USB PWM fan firmware
+//
+// Answers control requests the way the firmware does: standard descriptor
+// requests (including BOS and the MS OS 2.0 descriptor set), and the vendor
+// register protocol. The fan itself is simulated well enough for control
+// loops to do something sensible: speed follows duty with some lag and
+// stops below a start threshold. Tach edges for raw capture are made up to
+// match the simulated speed.
+//
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+class EmulatedBoard
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum ResetRequest { RESET_NONE, RESET_REBOOT, RESET_BOOTLOADER };
+
+    // Seed varies the simulated fan from board to board
+    EmulatedBoard(const std::string& serialNumber, unsigned seed);
+
+    const std::string& serialNumber() const { return serial; }
+
+    // Back to power-on state; only the calibration table, boot duty and
+    // identity strings survive, as they do in EEPROM
+    void reboot();
+
+    // Returns number of bytes of data for IN requests, 0 for OUT requests,
+    // or -1 to stall
+    int control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+                uint8_t* data, uint16_t length, Clock::time_point now);
+
+    // Read from a bulk IN endpoint; returns number of bytes, which is 0 if
+    // there is nothing to send yet, or -1 to stall
+    int bulkIn(uint8_t endpoint, uint8_t* data, int length, Clock::time_point now);
+
+    // Set by reset register writes; the bus takes the board away and
+    // clears this
+    ResetRequest resetRequest;
+
+    // Raw descriptors, also used to answer descriptor queries that don't
+    // need a control transfer
+    static const uint8_t DEVICE_DESCRIPTOR[18];
+    static const uint8_t CONFIG_DESCRIPTOR[91];
+    static const uint8_t BOS_DESCRIPTOR[59];
+
+    // CONFIG_DESCRIPTOR as the board sends it, which names the fan
+    // interface once it has been given a name
+    void configDescriptor(uint8_t* data) const;
+
+private:
+    int getDescriptor(uint16_t value, uint16_t index, uint8_t* data, uint16_t length);
+    int readRegister(uint8_t reg, uint16_t value, uint8_t* data, uint16_t length,
+                     Clock::time_point now);
+    bool writeRegister(uint8_t reg, uint16_t value, Clock::time_point now);
+    bool writeRegisterBlock(uint8_t reg, const uint8_t* data, uint16_t length,
+                            Clock::time_point now);
+    bool writeSchedule(const uint8_t* data, uint16_t length, Clock::time_point now);
+    uint32_t deviceTime(Clock::time_point t) const;
+    const std::string& currentSerial() const;
+    void resetConfig();
+    void update(Clock::time_point now);
+    void advance(Clock::time_point now);
+    void recordHistory();
+    uint16_t readRpm();
+    double effectiveRatio() const;
+    double steadyRpm(double ratio) const;
+    uint16_t dutyRatio() const;
+    void setDuty(uint16_t value, bool ratio);
+    void expireStage(Clock::time_point now);
+    void pollCalibration(Clock::time_point now);
+    void captureEdges(Clock::time_point now);
+    void resetStats();
+    void clearCounters(Clock::time_point now);
+
+    std::string serial;
+
+    // Firmware state
+    uint16_t period;
+    uint16_t duty;
+    uint16_t ratioValue;
+    bool ratioMode;
+    bool dither;
+    uint8_t ledMode;
+    uint8_t stageState;
+    Clock::time_point stageOpenTime;
+    uint8_t stagedMask;
+    uint16_t stagedDuty, stagedPeriod, stagedRatio, stagedMode;
+    uint8_t calState;
+    Clock::time_point calStart;
+    uint16_t calSavedRatio;
+    uint8_t calTable[38];
+    bool captureRunning;
+    bool captureLost;
+    uint16_t captureDropped;
+    std::deque<uint16_t> captureBuffer;
+    uint16_t statsCount, statsMin, statsMax;
+    uint32_t statsSum;
+    uint64_t statsSumSquares;
+    struct HistoryEntry {
+        uint16_t rpm;
+        uint8_t duty;
+        uint8_t flags;
+    };
+    std::deque<HistoryEntry> history;
+    uint16_t historyInterval;
+    uint16_t historyNextSeq;
+    Clock::time_point historyNextSample;
+    uint32_t counterTachEdges;
+    uint32_t counterSetupServed, counterSetupRejected;
+    uint16_t counterTachMax, counterSetupMax;
+    // Survives reboots, as the firmware keeps it in RAM that isn't cleared
+    uint16_t watchdogResets;
+    Clock::time_point counterClearTime;
+    // Kept in EEPROM, so survives reboots too
+    uint16_t bootDuty;
+    Clock::time_point bootTime;
+    uint32_t bootConfiguredUs;
+    // Configured serial number, name and location, also in EEPROM
+    std::string identity[3];
+    struct ScheduleEntry {
+        Clock::time_point when;
+        uint16_t ratio;
+    };
+    // Soonest first
+    std::vector<ScheduleEntry> schedule;
+
+    // Fan model
+    double maxRpm;
+    double startRatio;
+    double rpm;
+    uint32_t noise;
+    // Last tach edge seen by capture, none if not spinning
+    Clock::time_point lastEdge;
+    long lastIntervalUs;
+    Clock::time_point lastUpdate;
+};
+
+#endif
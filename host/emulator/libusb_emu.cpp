@@ -0,0 +1,968 @@
+//
+// The libusb-1.0 API, implemented on top of emulated fan boards
+//
+// This builds into a shared library that stands in for libusb, so host
+// software can run against any number of virtual boards without hardware:
+//
+//   LD_PRELOAD=libusbfan_emu.so usb_fan_status
+//   USB_FAN_LIBUSB=libusbfan_emu.so python usb_fan_config.py list
+//
+// USBFAN_EMULATE sets the number of boards (default 1). Each control
+// transfer takes USBFAN_EMULATE_LATENCY_US microseconds (default 1000),
+// and transfers to a board are done one at a time, as they would be on EP0.
+//
+// Control transfers are supported, plus synchronous reads of the tach
+// capture endpoint, which is all the fan interface uses, and only from a
+// single thread. Boards that get rebooted through
+// the reset register drop off the bus and come back, with a new address,
+// half a second later; a reboot into the bootloader drops them for good.
+//
+
+#include "EmulatedBoard.h"
+
+#include <libusb.h>
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <sys/timerfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+typedef EmulatedBoard::Clock Clock;
+
+// Bus number unlikely to exist on the host, so sysfs lookups for emulated
+// devices can't find a real device by mistake
+#define EMU_BUS 250
+#define REBOOT_MS 500
+#define DEFAULT_LATENCY_US 1000
+
+struct Slot
+{
+    std::unique_ptr<EmulatedBoard> board;
+    bool present;
+    // When a rebooting board comes back
+    Clock::time_point arrival;
+    uint8_t address;
+    // Bumped every time the board enumerates
+    unsigned generation;
+    Clock::time_point busyUntil;
+};
+
+static std::vector<Slot> slots;
+static Clock::duration latency;
+static uint8_t next_address = 2;
+
+struct libusb_device
+{
+    libusb_context* ctx;
+    size_t slot;
+    unsigned generation;
+    uint8_t address;
+    int refs;
+    bool attached;
+};
+
+struct libusb_device_handle
+{
+    libusb_device* dev;
+};
+
+struct HotplugCallback
+{
+    int events;
+    libusb_hotplug_callback_fn fn;
+    void* userData;
+};
+
+struct PendingTransfer
+{
+    Clock::time_point due;
+    bool cancelled;
+};
+
+struct libusb_context
+{
+    int refs;
+    int timerFd;
+    std::vector<libusb_device*> devices;
+    std::map<libusb_transfer*, PendingTransfer> transfers;
+    std::map<libusb_hotplug_callback_handle, HotplugCallback> hotplug;
+    libusb_hotplug_callback_handle nextHotplug;
+    std::vector<std::pair<libusb_device*, libusb_hotplug_event>> events;
+};
+
+static libusb_context* default_ctx;
+
+static void bus_init()
+{
+    if (!slots.empty()) {
+        return;
+    }
+    const char* count_env = getenv("USBFAN_EMULATE");
+    const char* latency_env = getenv("USBFAN_EMULATE_LATENCY_US");
+    int count = count_env ? atoi(count_env) : 1;
+    latency = std::chrono::microseconds(latency_env ? atoi(latency_env) : DEFAULT_LATENCY_US);
+    // Ports are numbered from 1 and there are only so many of them
+    count = std::max(0, std::min(count, 127));
+    slots.resize(count);
+    for (int i = 0; i < count; i++) {
+        char serial[20];
+        snprintf(serial, sizeof(serial), "EMU%013d", i + 1);
+        slots[i].board.reset(new EmulatedBoard(serial, i + 1));
+        slots[i].present = true;
+        slots[i].address = next_address++;
+        slots[i].generation = 1;
+    }
+}
+
+static void bus_poll(Clock::time_point now)
+{
+    for (Slot& slot : slots) {
+        if (!slot.present && slot.arrival <= now) {
+            slot.present = true;
+            slot.address = next_address++;
+            if (next_address > 127) {
+                next_address = 2;
+            }
+            slot.generation++;
+            slot.board->reboot();
+        }
+    }
+}
+
+static Clock::time_point bus_next_arrival()
+{
+    Clock::time_point next = Clock::time_point::max();
+    for (const Slot& slot : slots) {
+        if (!slot.present) {
+            next = std::min(next, slot.arrival);
+        }
+    }
+    return next;
+}
+
+static bool device_present(const libusb_device* dev)
+{
+    const Slot& slot = slots[dev->slot];
+    return dev->attached && slot.present && slot.generation == dev->generation;
+}
+
+static libusb_context* get_ctx(libusb_context* ctx)
+{
+    return ctx ? ctx : default_ctx;
+}
+
+// Bring a context's device list in line with the bus
+static void sync_devices(libusb_context* ctx, Clock::time_point now)
+{
+    bus_poll(now);
+    for (auto it = ctx->devices.begin(); it != ctx->devices.end();) {
+        libusb_device* dev = *it;
+        if (!device_present(dev)) {
+            dev->attached = false;
+            // Context reference goes with the event
+            ctx->events.emplace_back(dev, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+            it = ctx->devices.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (!slots[i].present) {
+            continue;
+        }
+        bool known = false;
+        for (libusb_device* dev : ctx->devices) {
+            known |= dev->slot == i;
+        }
+        if (!known) {
+            libusb_device* dev =
+                new libusb_device{ ctx, i, slots[i].generation, slots[i].address, 1, true };
+            ctx->devices.push_back(dev);
+            libusb_ref_device(dev);
+            ctx->events.emplace_back(dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+        }
+    }
+}
+
+static void arm_timer(libusb_context* ctx)
+{
+    Clock::time_point next = bus_next_arrival();
+    for (auto& entry : ctx->transfers) {
+        next = std::min(next, entry.second.due);
+    }
+    itimerspec spec = {};
+    if (next != Clock::time_point::max()) {
+        // steady_clock is CLOCK_MONOTONIC on Linux
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch());
+        spec.it_value.tv_sec = ns.count() / 1000000000;
+        spec.it_value.tv_nsec = ns.count() % 1000000000;
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+    timerfd_settime(ctx->timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+// Run a control request on a board, as the firmware would; returns the
+// transfer status and sets the data length
+static libusb_transfer_status run_control(libusb_device* dev, const uint8_t* setup, uint8_t* data,
+                                          int* actual_length, Clock::time_point now)
+{
+    *actual_length = 0;
+    if (!device_present(dev)) {
+        return LIBUSB_TRANSFER_NO_DEVICE;
+    }
+    Slot& slot = slots[dev->slot];
+    uint8_t request_type = setup[0];
+    uint16_t value = setup[2] | (setup[3] << 8);
+    uint16_t index = setup[4] | (setup[5] << 8);
+    uint16_t length = setup[6] | (setup[7] << 8);
+    int rv = slot.board->control(request_type, setup[1], value, index, data, length, now);
+    if (slot.board->resetRequest != EmulatedBoard::RESET_NONE) {
+        slot.present = false;
+        slot.arrival = slot.board->resetRequest == EmulatedBoard::RESET_REBOOT
+            ? now + std::chrono::milliseconds(REBOOT_MS) : Clock::time_point::max();
+        slot.board->resetRequest = EmulatedBoard::RESET_NONE;
+    }
+    if (rv < 0) {
+        return LIBUSB_TRANSFER_STALL;
+    }
+    *actual_length = (request_type & LIBUSB_ENDPOINT_IN) ? rv : length;
+    return LIBUSB_TRANSFER_COMPLETED;
+}
+
+// EP0 handles one transfer at a time
+static Clock::time_point schedule(libusb_device* dev, Clock::time_point now)
+{
+    Slot& slot = slots[dev->slot];
+    slot.busyUntil = std::max(now, slot.busyUntil) + latency;
+    return slot.busyUntil;
+}
+
+static void finish_transfer(libusb_transfer* transfer)
+{
+    uint8_t flags = transfer->flags;
+    transfer->callback(transfer);
+    if (flags & LIBUSB_TRANSFER_FREE_BUFFER) {
+        free(transfer->buffer);
+    }
+    if (flags & LIBUSB_TRANSFER_FREE_TRANSFER) {
+        libusb_free_transfer(transfer);
+    }
+}
+
+// Returns true if anything happened
+static bool process_events(libusb_context* ctx)
+{
+    uint64_t expirations;
+    if (read(ctx->timerFd, &expirations, sizeof(expirations)) < 0) {
+        // Nothing expired, which is fine
+    }
+
+    Clock::time_point now = Clock::now();
+    sync_devices(ctx, now);
+
+    std::vector<std::pair<libusb_device*, libusb_hotplug_event>> events;
+    events.swap(ctx->events);
+    for (auto& event : events) {
+        // Copy, since callbacks may deregister themselves
+        auto callbacks = ctx->hotplug;
+        for (auto& entry : callbacks) {
+            if ((entry.second.events & event.second) &&
+                entry.second.fn(ctx, event.first, event.second, entry.second.userData)) {
+                ctx->hotplug.erase(entry.first);
+            }
+        }
+        // Arrival kept the context's reference, departure gives it up
+        libusb_unref_device(event.first);
+    }
+
+    // Collect first, since callbacks can submit more
+    std::vector<libusb_transfer*> due;
+    for (auto& entry : ctx->transfers) {
+        if (entry.second.due <= now) {
+            due.push_back(entry.first);
+        }
+    }
+    std::sort(due.begin(), due.end(), [ctx](libusb_transfer* a, libusb_transfer* b) {
+        return ctx->transfers[a].due < ctx->transfers[b].due;
+    });
+    for (libusb_transfer* transfer : due) {
+        bool cancelled = ctx->transfers[transfer].cancelled;
+        ctx->transfers.erase(transfer);
+        if (cancelled) {
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            transfer->actual_length = 0;
+        } else {
+            transfer->status = run_control(transfer->dev_handle->dev, transfer->buffer,
+                                           transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+                                           &transfer->actual_length, now);
+        }
+        finish_transfer(transfer);
+    }
+
+    arm_timer(ctx);
+    return !events.empty() || !due.empty();
+}
+
+static Clock::time_point next_event(libusb_context* ctx)
+{
+    Clock::time_point next = bus_next_arrival();
+    for (auto& entry : ctx->transfers) {
+        next = std::min(next, entry.second.due);
+    }
+    return next;
+}
+
+extern "C" {
+
+int libusb_init(libusb_context** ctx)
+{
+    if (!ctx && default_ctx) {
+        default_ctx->refs++;
+        return LIBUSB_SUCCESS;
+    }
+    bus_init();
+    libusb_context* new_ctx = new libusb_context();
+    new_ctx->refs = 1;
+    new_ctx->nextHotplug = 1;
+    new_ctx->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (new_ctx->timerFd < 0) {
+        delete new_ctx;
+        return LIBUSB_ERROR_OTHER;
+    }
+    sync_devices(new_ctx, Clock::now());
+    // Nobody is registered yet to hear about these
+    for (auto& event : new_ctx->events) {
+        libusb_unref_device(event.first);
+    }
+    new_ctx->events.clear();
+    if (ctx) {
+        *ctx = new_ctx;
+    } else {
+        default_ctx = new_ctx;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context* ctx)
+{
+    ctx = get_ctx(ctx);
+    if (!ctx || --ctx->refs > 0) {
+        return;
+    }
+    for (auto& event : ctx->events) {
+        libusb_unref_device(event.first);
+    }
+    for (libusb_device* dev : ctx->devices) {
+        libusb_unref_device(dev);
+    }
+    close(ctx->timerFd);
+    if (ctx == default_ctx) {
+        default_ctx = nullptr;
+    }
+    delete ctx;
+}
+
+const struct libusb_version* libusb_get_version(void)
+{
+    static const libusb_version version = { 1, 0, 22, 0, "", "usbfan emulator" };
+    return &version;
+}
+
+void libusb_set_debug(libusb_context* ctx, int level)
+{
+    (void)ctx;
+    (void)level;
+}
+
+int libusb_set_option(libusb_context* ctx, enum libusb_option option, ...)
+{
+    (void)ctx;
+    (void)option;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_has_capability(uint32_t capability)
+{
+    return capability == LIBUSB_CAP_HAS_CAPABILITY || capability == LIBUSB_CAP_HAS_HOTPLUG;
+}
+
+const char* libusb_error_name(int errcode)
+{
+    switch (errcode) {
+    case LIBUSB_SUCCESS: return "LIBUSB_SUCCESS";
+    case LIBUSB_ERROR_IO: return "LIBUSB_ERROR_IO";
+    case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+    case LIBUSB_ERROR_ACCESS: return "LIBUSB_ERROR_ACCESS";
+    case LIBUSB_ERROR_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+    case LIBUSB_ERROR_NOT_FOUND: return "LIBUSB_ERROR_NOT_FOUND";
+    case LIBUSB_ERROR_BUSY: return "LIBUSB_ERROR_BUSY";
+    case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+    case LIBUSB_ERROR_OVERFLOW: return "LIBUSB_ERROR_OVERFLOW";
+    case LIBUSB_ERROR_PIPE: return "LIBUSB_ERROR_PIPE";
+    case LIBUSB_ERROR_INTERRUPTED: return "LIBUSB_ERROR_INTERRUPTED";
+    case LIBUSB_ERROR_NO_MEM: return "LIBUSB_ERROR_NO_MEM";
+    case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+    default: return "LIBUSB_ERROR_OTHER";
+    }
+}
+
+ssize_t libusb_get_device_list(libusb_context* ctx, libusb_device*** list)
+{
+    ctx = get_ctx(ctx);
+    sync_devices(ctx, Clock::now());
+    libusb_device** devs = (libusb_device**)calloc(ctx->devices.size() + 1, sizeof(*devs));
+    if (!devs) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    for (size_t i = 0; i < ctx->devices.size(); i++) {
+        devs[i] = libusb_ref_device(ctx->devices[i]);
+    }
+    *list = devs;
+    return ctx->devices.size();
+}
+
+void libusb_free_device_list(libusb_device** list, int unref_devices)
+{
+    if (!list) {
+        return;
+    }
+    if (unref_devices) {
+        for (libusb_device** dev = list; *dev; dev++) {
+            libusb_unref_device(*dev);
+        }
+    }
+    free(list);
+}
+
+libusb_device* libusb_ref_device(libusb_device* dev)
+{
+    dev->refs++;
+    return dev;
+}
+
+void libusb_unref_device(libusb_device* dev)
+{
+    if (dev && --dev->refs == 0) {
+        delete dev;
+    }
+}
+
+int libusb_get_device_descriptor(libusb_device* dev, struct libusb_device_descriptor* desc)
+{
+    (void)dev;
+    const uint8_t* raw = EmulatedBoard::DEVICE_DESCRIPTOR;
+    desc->bLength = raw[0];
+    desc->bDescriptorType = raw[1];
+    desc->bcdUSB = raw[2] | (raw[3] << 8);
+    desc->bDeviceClass = raw[4];
+    desc->bDeviceSubClass = raw[5];
+    desc->bDeviceProtocol = raw[6];
+    desc->bMaxPacketSize0 = raw[7];
+    desc->idVendor = raw[8] | (raw[9] << 8);
+    desc->idProduct = raw[10] | (raw[11] << 8);
+    desc->bcdDevice = raw[12] | (raw[13] << 8);
+    desc->iManufacturer = raw[14];
+    desc->iProduct = raw[15];
+    desc->iSerialNumber = raw[16];
+    desc->bNumConfigurations = raw[17];
+    return LIBUSB_SUCCESS;
+}
+
+// Parsed form of the config descriptor, in one allocation
+struct EmuConfig
+{
+    libusb_config_descriptor config;
+    libusb_interface interfaces[3];
+    libusb_interface_descriptor altsettings[3];
+    libusb_endpoint_descriptor endpoints[4];
+};
+
+int libusb_get_config_descriptor(libusb_device* dev, uint8_t config_index,
+                                 struct libusb_config_descriptor** config)
+{
+    if (config_index != 0) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    EmuConfig* emu = new EmuConfig();
+    uint8_t raw[sizeof(EmulatedBoard::CONFIG_DESCRIPTOR)];
+    slots[dev->slot].board->configDescriptor(raw);
+    int length = sizeof(raw);
+    emu->config.bLength = raw[0];
+    emu->config.bDescriptorType = raw[1];
+    emu->config.wTotalLength = raw[2] | (raw[3] << 8);
+    emu->config.bNumInterfaces = raw[4];
+    emu->config.bConfigurationValue = raw[5];
+    emu->config.iConfiguration = raw[6];
+    emu->config.bmAttributes = raw[7];
+    emu->config.MaxPower = raw[8];
+    emu->config.interface = emu->interfaces;
+
+    int iface = -1, endpoint = 0;
+    for (int pos = raw[0]; pos + 2 <= length && raw[pos] >= 2; pos += raw[pos]) {
+        const uint8_t* d = &raw[pos];
+        if (d[1] == 0x04 && iface < 2) {
+            libusb_interface_descriptor& alt = emu->altsettings[++iface];
+            alt.bLength = d[0];
+            alt.bDescriptorType = d[1];
+            alt.bInterfaceNumber = d[2];
+            alt.bAlternateSetting = d[3];
+            alt.bNumEndpoints = d[4];
+            alt.bInterfaceClass = d[5];
+            alt.bInterfaceSubClass = d[6];
+            alt.bInterfaceProtocol = d[7];
+            alt.iInterface = d[8];
+            alt.endpoint = &emu->endpoints[endpoint];
+            emu->interfaces[iface].altsetting = &alt;
+            emu->interfaces[iface].num_altsetting = 1;
+        } else if (d[1] == 0x05 && iface >= 0 && endpoint < 4) {
+            libusb_endpoint_descriptor& ep = emu->endpoints[endpoint++];
+            ep.bLength = d[0];
+            ep.bDescriptorType = d[1];
+            ep.bEndpointAddress = d[2];
+            ep.bmAttributes = d[3];
+            ep.wMaxPacketSize = d[4] | (d[5] << 8);
+            ep.bInterval = d[6];
+        }
+    }
+    *config = &emu->config;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_get_active_config_descriptor(libusb_device* dev, struct libusb_config_descriptor** config)
+{
+    return libusb_get_config_descriptor(dev, 0, config);
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor* config)
+{
+    // config is the first member
+    delete (EmuConfig*)config;
+}
+
+uint8_t libusb_get_bus_number(libusb_device* dev)
+{
+    (void)dev;
+    return EMU_BUS;
+}
+
+uint8_t libusb_get_device_address(libusb_device* dev)
+{
+    return dev->address;
+}
+
+uint8_t libusb_get_port_number(libusb_device* dev)
+{
+    return dev->slot + 1;
+}
+
+int libusb_get_port_numbers(libusb_device* dev, uint8_t* port_numbers, int port_numbers_len)
+{
+    if (port_numbers_len < 1) {
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+    port_numbers[0] = dev->slot + 1;
+    return 1;
+}
+
+libusb_device* libusb_get_parent(libusb_device* dev)
+{
+    (void)dev;
+    return nullptr;
+}
+
+int libusb_get_device_speed(libusb_device* dev)
+{
+    (void)dev;
+    return LIBUSB_SPEED_FULL;
+}
+
+int libusb_get_max_packet_size(libusb_device* dev, unsigned char endpoint)
+{
+    (void)dev;
+    (void)endpoint;
+    return 64;
+}
+
+int libusb_get_max_iso_packet_size(libusb_device* dev, unsigned char endpoint)
+{
+    (void)dev;
+    (void)endpoint;
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_open(libusb_device* dev, libusb_device_handle** dev_handle)
+{
+    if (!device_present(dev)) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    *dev_handle = new libusb_device_handle{ libusb_ref_device(dev) };
+    return LIBUSB_SUCCESS;
+}
+
+libusb_device_handle* libusb_open_device_with_vid_pid(libusb_context* ctx, uint16_t vendor_id,
+                                                      uint16_t product_id)
+{
+    libusb_device_descriptor desc;
+    libusb_get_device_descriptor(nullptr, &desc);
+    ctx = get_ctx(ctx);
+    libusb_device_handle* handle = nullptr;
+    if (desc.idVendor == vendor_id && desc.idProduct == product_id && !ctx->devices.empty()) {
+        libusb_open(ctx->devices.front(), &handle);
+    }
+    return handle;
+}
+
+void libusb_close(libusb_device_handle* dev_handle)
+{
+    if (dev_handle) {
+        libusb_unref_device(dev_handle->dev);
+        delete dev_handle;
+    }
+}
+
+libusb_device* libusb_get_device(libusb_device_handle* dev_handle)
+{
+    return dev_handle->dev;
+}
+
+int libusb_get_configuration(libusb_device_handle* dev_handle, int* config)
+{
+    if (!device_present(dev_handle->dev)) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    *config = 1;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_set_configuration(libusb_device_handle* dev_handle, int configuration)
+{
+    (void)configuration;
+    return device_present(dev_handle->dev) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_claim_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+    if (interface_number < 0 || interface_number > 2) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    return device_present(dev_handle->dev) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_release_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+    return libusb_claim_interface(dev_handle, interface_number);
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle* dev_handle, int interface_number,
+                                     int alternate_setting)
+{
+    if (alternate_setting != 0) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    return libusb_claim_interface(dev_handle, interface_number);
+}
+
+int libusb_clear_halt(libusb_device_handle* dev_handle, unsigned char endpoint)
+{
+    (void)dev_handle;
+    (void)endpoint;
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_reset_device(libusb_device_handle* dev_handle)
+{
+    return device_present(dev_handle->dev) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    (void)interface_number;
+    return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    (void)interface_number;
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_attach_kernel_driver(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    (void)interface_number;
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_set_auto_detach_kernel_driver(libusb_device_handle* dev_handle, int enable)
+{
+    (void)dev_handle;
+    (void)enable;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_control_transfer(libusb_device_handle* dev_handle, uint8_t request_type,
+                            uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                            unsigned char* data, uint16_t wLength, unsigned int timeout)
+{
+    (void)timeout;
+    libusb_device* dev = dev_handle->dev;
+    if (!device_present(dev)) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    Clock::time_point done = schedule(dev, Clock::now());
+    std::this_thread::sleep_until(done);
+
+    uint8_t setup[LIBUSB_CONTROL_SETUP_SIZE] = {
+        request_type, bRequest, (uint8_t)wValue, (uint8_t)(wValue >> 8),
+        (uint8_t)wIndex, (uint8_t)(wIndex >> 8), (uint8_t)wLength, (uint8_t)(wLength >> 8)
+    };
+    int actual_length;
+    switch (run_control(dev, setup, data, &actual_length, done)) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return actual_length;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    default:
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+}
+
+int libusb_bulk_transfer(libusb_device_handle* dev_handle, unsigned char endpoint,
+                         unsigned char* data, int length, int* actual_length, unsigned int timeout)
+{
+    libusb_device* dev = dev_handle->dev;
+    *actual_length = 0;
+    if (!(endpoint & LIBUSB_ENDPOINT_IN)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    // Zero means no timeout
+    Clock::time_point deadline = Clock::now() + (timeout ? std::chrono::milliseconds(timeout)
+                                                         : std::chrono::hours(24));
+    for (;;) {
+        if (!device_present(dev)) {
+            return LIBUSB_ERROR_NO_DEVICE;
+        }
+        Clock::time_point now = Clock::now();
+        int rv = slots[dev->slot].board->bulkIn(endpoint, data, length, now);
+        if (rv < 0) {
+            return LIBUSB_ERROR_PIPE;
+        } else if (rv > 0) {
+            *actual_length = rv;
+            return LIBUSB_SUCCESS;
+        } else if (now >= deadline) {
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        // Device gets polled once a frame
+        std::this_thread::sleep_until(std::min(deadline, now + std::chrono::milliseconds(1)));
+        bus_poll(Clock::now());
+    }
+}
+
+int libusb_interrupt_transfer(libusb_device_handle* dev_handle, unsigned char endpoint,
+                              unsigned char* data, int length, int* actual_length,
+                              unsigned int timeout)
+{
+    return libusb_bulk_transfer(dev_handle, endpoint, data, length, actual_length, timeout);
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle* dev_handle, uint8_t desc_index,
+                                       unsigned char* data, int length)
+{
+    uint8_t buf[255];
+    int rv = libusb_control_transfer(dev_handle, LIBUSB_ENDPOINT_IN,
+                                     LIBUSB_REQUEST_GET_DESCRIPTOR,
+                                     (LIBUSB_DT_STRING << 8) | desc_index, 0x0409, buf,
+                                     sizeof(buf), 1000);
+    if (rv < 0) {
+        return rv;
+    }
+    if (rv < 2 || buf[1] != LIBUSB_DT_STRING) {
+        return LIBUSB_ERROR_IO;
+    }
+    int count = 0;
+    for (int i = 2; i + 1 < std::min<int>(rv, buf[0]) && count < length - 1; i += 2) {
+        data[count++] = buf[i + 1] ? '?' : buf[i];
+    }
+    data[count] = '\0';
+    return count;
+}
+
+struct libusb_transfer* libusb_alloc_transfer(int iso_packets)
+{
+    size_t size = sizeof(libusb_transfer) + iso_packets * sizeof(libusb_iso_packet_descriptor);
+    libusb_transfer* transfer = (libusb_transfer*)calloc(1, size);
+    if (transfer) {
+        transfer->num_iso_packets = iso_packets;
+    }
+    return transfer;
+}
+
+void libusb_free_transfer(struct libusb_transfer* transfer)
+{
+    if (transfer && (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)) {
+        free(transfer->buffer);
+    }
+    free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer* transfer)
+{
+    libusb_device* dev = transfer->dev_handle->dev;
+    libusb_context* ctx = dev->ctx;
+    if (ctx->transfers.count(transfer)) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    if (transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    if (!device_present(dev)) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    ctx->transfers[transfer] = PendingTransfer{ schedule(dev, Clock::now()), false };
+    arm_timer(ctx);
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer* transfer)
+{
+    libusb_context* ctx = transfer->dev_handle->dev->ctx;
+    auto it = ctx->transfers.find(transfer);
+    if (it == ctx->transfers.end() || it->second.cancelled) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    // Completes with cancelled status from event handling, as in libusb
+    it->second.cancelled = true;
+    it->second.due = Clock::now();
+    arm_timer(ctx);
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context* ctx, struct timeval* tv, int* completed)
+{
+    ctx = get_ctx(ctx);
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(tv ? tv->tv_sec : 60) +
+                                 std::chrono::microseconds(tv ? tv->tv_usec : 0);
+    for (;;) {
+        if (process_events(ctx) || (completed && *completed)) {
+            return LIBUSB_SUCCESS;
+        }
+        if (Clock::now() >= deadline) {
+            return LIBUSB_SUCCESS;
+        }
+        std::this_thread::sleep_until(std::min(deadline, next_event(ctx)));
+    }
+}
+
+int libusb_handle_events_timeout(libusb_context* ctx, struct timeval* tv)
+{
+    return libusb_handle_events_timeout_completed(ctx, tv, nullptr);
+}
+
+int libusb_handle_events_completed(libusb_context* ctx, int* completed)
+{
+    return libusb_handle_events_timeout_completed(ctx, nullptr, completed);
+}
+
+int libusb_handle_events(libusb_context* ctx)
+{
+    return libusb_handle_events_timeout_completed(ctx, nullptr, nullptr);
+}
+
+int libusb_get_next_timeout(libusb_context* ctx, struct timeval* tv)
+{
+    (void)ctx;
+    (void)tv;
+    // Everything is driven by the timer fd
+    return 0;
+}
+
+int libusb_pollfds_handle_timeouts(libusb_context* ctx)
+{
+    (void)ctx;
+    return 1;
+}
+
+const struct libusb_pollfd** libusb_get_pollfds(libusb_context* ctx)
+{
+    ctx = get_ctx(ctx);
+    // Array and entry in one allocation
+    struct PollfdList {
+        const libusb_pollfd* list[2];
+        libusb_pollfd pollfd;
+    };
+    PollfdList* fds = (PollfdList*)calloc(1, sizeof(PollfdList));
+    if (!fds) {
+        return nullptr;
+    }
+    fds->pollfd.fd = ctx->timerFd;
+    fds->pollfd.events = POLLIN;
+    fds->list[0] = &fds->pollfd;
+    return fds->list;
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd** pollfds)
+{
+    free(pollfds);
+}
+
+void libusb_set_pollfd_notifiers(libusb_context* ctx, libusb_pollfd_added_cb added_cb,
+                                 libusb_pollfd_removed_cb removed_cb, void* user_data)
+{
+    // The one fd never changes
+    (void)ctx;
+    (void)added_cb;
+    (void)removed_cb;
+    (void)user_data;
+}
+
+int libusb_hotplug_register_callback(libusb_context* ctx, int events, int flags, int vendor_id,
+                                     int product_id, int dev_class,
+                                     libusb_hotplug_callback_fn cb_fn, void* user_data,
+                                     libusb_hotplug_callback_handle* callback_handle)
+{
+    ctx = get_ctx(ctx);
+    libusb_device_descriptor desc;
+    libusb_get_device_descriptor(nullptr, &desc);
+    if ((vendor_id != LIBUSB_HOTPLUG_MATCH_ANY && vendor_id != desc.idVendor) ||
+        (product_id != LIBUSB_HOTPLUG_MATCH_ANY && product_id != desc.idProduct) ||
+        (dev_class != LIBUSB_HOTPLUG_MATCH_ANY && dev_class != desc.bDeviceClass)) {
+        // Will never match anything, but that's not an error
+        events = 0;
+    }
+
+    libusb_hotplug_callback_handle handle = ctx->nextHotplug++;
+    ctx->hotplug[handle] = HotplugCallback{ events, cb_fn, user_data };
+    if (callback_handle) {
+        *callback_handle = handle;
+    }
+    if ((flags & LIBUSB_HOTPLUG_ENUMERATE) && (events & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)) {
+        std::vector<libusb_device*> devices = ctx->devices;
+        for (libusb_device* dev : devices) {
+            if (cb_fn(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data)) {
+                ctx->hotplug.erase(handle);
+                break;
+            }
+        }
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void libusb_hotplug_deregister_callback(libusb_context* ctx,
+                                        libusb_hotplug_callback_handle callback_handle)
+{
+    get_ctx(ctx)->hotplug.erase(callback_handle);
+}
+
+} // extern "C"
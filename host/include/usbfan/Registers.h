@@ -0,0 +1,198 @@
+#ifndef usbfan_Registers_h
+#define usbfan_Registers_h
+
+#include <cstdint>
+
+//
+// Vendor interface register map of the PWM fan firmware. See
+// firmware/src/UsbPwmDevice.cpp for the device side.
+//
+// NOTE: These are subject to change until DEVICE_MAJOR changes to 1
+//
+
+namespace usbfan {
+
+// Register map version this describes; firmware with the same major version
+// and at least DEVICE_MIN_MINOR works, and capability bits say what else it
+// has
+constexpr uint8_t DEVICE_MAJOR = 0;
+constexpr uint8_t DEVICE_MINOR = 3;
+constexpr uint8_t DEVICE_MIN_MINOR = 2;
+
+// {1ad9f93b-494c-4dda-a1e5-2e2bab181052}, as it appears in the BOS platform
+// capability descriptor
+constexpr uint8_t DEVICE_UUID[16] = {
+    0x3b, 0xf9, 0xd9, 0x1a, 0x4c, 0x49, 0xda, 0x4d,
+    0xa1, 0xe5, 0x2e, 0x2b, 0xab, 0x18, 0x10, 0x52
+};
+
+constexpr uint8_t REGISTER_VERSION = 0x00;
+constexpr uint8_t REGISTER_SCHEMA = 0x01;
+constexpr uint8_t REGISTER_CAPABILITIES = 0x02;
+constexpr uint8_t REGISTER_IMAGE = 0x03;
+constexpr uint8_t REGISTER_PWM_DUTY = 0x10;
+constexpr uint8_t REGISTER_PWM_PERIOD = 0x11;
+constexpr uint8_t REGISTER_TACHOMETER = 0x12;
+constexpr uint8_t REGISTER_STAGE_CONTROL = 0x13;
+constexpr uint8_t REGISTER_PWM_DUTY_RATIO = 0x14;
+constexpr uint8_t REGISTER_PWM_MODE = 0x15;
+constexpr uint8_t REGISTER_TACHOMETER_STATS = 0x16;
+constexpr uint8_t REGISTER_BOOT_DUTY = 0x17;
+constexpr uint8_t REGISTER_BOOT_TIMES = 0x18;
+constexpr uint8_t REGISTER_TACH_SAMPLE = 0x19;
+constexpr uint8_t REGISTER_FRAME_CLOCK = 0x1a;
+constexpr uint8_t REGISTER_SCHEDULE = 0x1b;
+constexpr uint8_t REGISTER_CALIBRATION_CONTROL = 0x20;
+constexpr uint8_t REGISTER_CALIBRATION_TABLE = 0x21;
+constexpr uint8_t REGISTER_CAPTURE_CONTROL = 0x30;
+constexpr uint8_t REGISTER_CAPTURE_STATUS = 0x31;
+constexpr uint8_t REGISTER_HISTORY_INTERVAL = 0x40;
+constexpr uint8_t REGISTER_HISTORY = 0x41;
+constexpr uint8_t REGISTER_COUNTERS = 0x50;
+constexpr uint8_t REGISTER_RESET_CONTROL = 0xf0;
+constexpr uint8_t REGISTER_LED_CONTROL = 0xf1;
+constexpr uint8_t REGISTER_SERIAL_NUMBER = 0xf8;
+constexpr uint8_t REGISTER_NAME = 0xf9;
+constexpr uint8_t REGISTER_LOCATION = 0xfa;
+
+// Capability bits, in the BOS descriptor after the interface number (with
+// a u8 count of fan channels after them), and in REGISTER_CAPABILITIES
+// (followed by u8 fan channels, u8 tach capture endpoint). Firmware older
+// than minor version 3 has neither.
+constexpr uint16_t CAP_STAGING = 0x0001;
+constexpr uint16_t CAP_DUTY_RATIO = 0x0002;
+constexpr uint16_t CAP_DITHER = 0x0004;
+constexpr uint16_t CAP_FAST_PWM = 0x0008;
+constexpr uint16_t CAP_CALIBRATION = 0x0010;
+constexpr uint16_t CAP_CAPTURE = 0x0020;
+constexpr uint16_t CAP_TACH_STATS = 0x0040;
+constexpr uint16_t CAP_HISTORY = 0x0080;
+constexpr uint16_t CAP_COUNTERS = 0x0100;
+constexpr uint16_t CAP_SCHEMA = 0x0200;
+constexpr uint16_t CAP_IMAGE_CRC = 0x0400;
+constexpr uint16_t CAP_BOOT_DUTY = 0x0800;
+constexpr uint16_t CAP_IDENTITY = 0x1000;
+constexpr uint16_t CAP_TACH_SAMPLE = 0x2000;
+constexpr uint16_t CAP_FRAME_CLOCK = 0x4000;
+constexpr uint16_t CAP_SCHEDULE = 0x8000;
+constexpr uint16_t CAPABILITIES_LENGTH = 4;
+
+// Firmware image in flash: u16 length in bytes (0 while the device is still
+// working out the CRC after start), u16 CRC-16/MODBUS of the image,
+// little-endian. Matches the bytes of the .hex file it was built as.
+constexpr uint16_t IMAGE_INFO_LENGTH = 4;
+
+// Writing STAGE_OPEN holds PWM writes until STAGE_COMMIT applies them
+// together at the end of a PWM period. A set not committed within
+// STAGE_TIMEOUT_MS is dropped, and writes go straight through again.
+constexpr unsigned STAGE_TIMEOUT_MS = 250;
+constexpr uint16_t STAGE_IDLE = 0;
+constexpr uint16_t STAGE_OPEN = 1;
+constexpr uint16_t STAGE_COMMIT = 2;
+
+constexpr uint16_t PWM_MODE_DITHER = 0x01;
+
+// Revolution period statistics since the last read, which resets them:
+// u16 count, u16 min, u16 max, u32 sum, u64 sum of squares, little-endian,
+// with periods in units of this many microseconds
+constexpr unsigned STATS_TICK_US = 4;
+constexpr uint16_t TACHOMETER_STATS_LENGTH = 18;
+
+// Boot duty is a duty ratio (0 for off) the fan gets within microseconds of
+// power on, kept in EEPROM. Boot times are u32 microseconds from start to
+// the boot PWM coming on (0 if off), u32 microseconds from start to the host
+// configuring the device, little-endian.
+constexpr uint16_t BOOT_TIMES_LENGTH = 8;
+
+// Tach sample, all taken at the same moment: u32 device time, u32 device
+// time of the last tach edge (0 if none yet), u32 microseconds the last
+// TACH_SAMPLE_EDGES edges took, u16 RPM, u16 duty ratio, little-endian.
+// Device time is microseconds since the firmware started, wrapping about
+// every 71 minutes.
+constexpr unsigned TACH_SAMPLE_EDGES = 16;
+constexpr uint16_t TACH_SAMPLE_LENGTH = 16;
+
+// Frame clock: the device's time locked to the host's 1 ms USB frames, which
+// all devices on the same bus share. u32 frame count, whose low 11 bits are
+// the bus frame number (the rest count wraps since the device started, so
+// differ from board to board), u16 microseconds into the frame
+// (FRAME_US_UNLOCKED until the device has locked on), u32 device time at the
+// same moment, i16 how much faster device time runs than the frames, in
+// parts per million, little-endian.
+constexpr uint16_t FRAME_CLOCK_LENGTH = 12;
+constexpr uint16_t FRAME_US_UNLOCKED = 0xffff;
+
+// Schedule writes queue a duty ratio to be set at a device time, or at the
+// start of a frame (as counted by the frame clock, which has to be locked)
+// with SCHEDULE_FLAG_FRAME: u8 flags, u32 when, u16 duty ratio,
+// little-endian. Times already past, and more than SCHEDULE_ENTRIES queued,
+// are refused. SCHEDULE_FLAG_CLEAR drops what is queued first; it can also
+// be written on its own. Reads return u8 count, then u32 device time, u16
+// duty ratio for each queued change, soonest first. The duty changes at the
+// end of the PWM period the time falls in, as for a duty register write,
+// and config resets clear the queue.
+constexpr unsigned SCHEDULE_ENTRIES = 8;
+constexpr uint16_t SCHEDULE_WRITE_LENGTH = 7;
+constexpr uint16_t SCHEDULE_LENGTH = 1 + SCHEDULE_ENTRIES * 6;
+constexpr uint8_t SCHEDULE_FLAG_FRAME = 0x01;
+constexpr uint8_t SCHEDULE_FLAG_CLEAR = 0x80;
+
+// Identity strings are ASCII, not terminated, and kept in EEPROM. Writing
+// the serial number replaces the one made from the chip's (which comes back
+// when it is cleared); the name is also the fan interface's string
+// descriptor. Both take effect from the next enumeration. Writes carry the
+// string in the data stage, ending at the first NUL, so a lone NUL clears
+// it. Serial numbers can't have spaces or commas.
+constexpr uint16_t IDENTITY_SERIAL_MAX = 16;
+constexpr uint16_t IDENTITY_TEXT_MAX = 32;
+
+// Tach capture intervals are counts of this many microseconds, with
+// CAPTURE_GAP standing in for ones too long to count or after lost edges
+constexpr unsigned CAPTURE_TICK_US = 4;
+constexpr uint16_t CAPTURE_GAP = 0xffff;
+
+// History reads take the first wanted sequence number in wValue and return
+// u16 first, u16 next, u16 interval (ms), then up to HISTORY_READ_ENTRIES
+// entries of u16 rpm, u8 duty (ratio / 256), u8 flags. first is clamped to
+// the oldest entry still held; first == next means caught up
+constexpr unsigned HISTORY_READ_ENTRIES = 14;
+constexpr uint16_t HISTORY_LENGTH = 6 + HISTORY_READ_ENTRIES * 4;
+constexpr uint8_t HISTORY_FLAG_STALL = 0x01;
+
+// Performance counters, cleared by writing 0: u32 microseconds since clear,
+// u32 tach edges, u32 main loop iterations, u32 setup requests served,
+// u32 setup requests rejected, u16 worst tach interrupt duration, u16 worst
+// setup request duration, u16 watchdog resets, little-endian, with
+// durations in units of this many CPU cycles
+constexpr unsigned COUNTERS_TICK_CYCLES = 8;
+constexpr uint16_t COUNTERS_LENGTH = 26;
+
+// Schema reads take the index of the first wanted entry in wValue and
+// return u8 total entries, u8 index of first entry sent, then up to
+// SCHEMA_READ_ENTRIES entries of u8 register, u8 flags, u8 length (2 for
+// values, most bytes for blocks), u16 min, u16 max (range writes accept)
+constexpr unsigned SCHEMA_ENTRY_LENGTH = 7;
+constexpr unsigned SCHEMA_READ_ENTRIES = 8;
+constexpr uint16_t SCHEMA_LENGTH = 2 + SCHEMA_READ_ENTRIES * SCHEMA_ENTRY_LENGTH;
+
+// Schema entry flags
+constexpr uint8_t REG_READ = 0x01;
+constexpr uint8_t REG_WRITE = 0x02;
+// Reads return a block of up to length bytes, not a 16-bit value
+constexpr uint8_t REG_BLOCK = 0x04;
+// Writes are held while a staged set is open
+constexpr uint8_t REG_STAGED = 0x08;
+// Writes take the fan over from calibration
+constexpr uint8_t REG_FAN_CONTROL = 0x10;
+// Reads reset what they return
+constexpr uint8_t REG_CLEAR_ON_READ = 0x20;
+// Writes carry up to length bytes in the data stage, not a value
+constexpr uint8_t REG_WRITE_BLOCK = 0x40;
+
+// Vendor control requests, bRequest is the register number
+constexpr uint8_t REQUEST_READ = 0xC1;
+constexpr uint8_t REQUEST_WRITE = 0x41;
+
+} // namespace usbfan
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef usbfan_UsbFan_h
+#define usbfan_UsbFan_h
+
+//
+// Host side access to USB PWM fan devices
+//
+// Register reads and writes can be done one at a time, synchronously, or
+// queued up in a Batch, which submits them to all devices at once as
+// asynchronous libusb transfers and completes when all of them are done.
+//
+// Functions that talk to a device return a libusb error code (negative) on
+// failure.
+//
+
+#include "usbfan/Registers.h"
+
+#include <libusb.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace usbfan {
+
+constexpr unsigned DEFAULT_TIMEOUT_MS = 1000;
+
+// Devices that take longer than this to return their BOS descriptor during
+// discovery aren't ours
+constexpr unsigned PROBE_TIMEOUT_MS = 200;
+
+// Longest register block the firmware will return
+constexpr uint16_t MAX_REGISTER_LENGTH = 64;
+
+// What the BOS descriptor says about one fan interface of a device
+struct FanInterface {
+    uint8_t number;
+    uint8_t minor;
+    // CAP_* bits, 0 if the firmware is too old to say
+    uint16_t capabilities;
+    uint8_t channels;
+};
+
+// Entry of the register schema the firmware describes itself with
+struct RegisterInfo {
+    uint8_t reg;
+    uint8_t flags;
+    uint16_t length;
+    uint16_t min;
+    uint16_t max;
+};
+
+// REGISTER_TACH_SAMPLE, unpacked
+struct TachSample {
+    uint32_t nowUs;
+    uint32_t edgeUs;
+    uint32_t spanUs;
+    uint16_t rpm;
+    uint16_t dutyRatio;
+
+    // How long before the sample the last edge came, in microseconds
+    uint32_t edgeAgeUs() const { return nowUs - edgeUs; }
+};
+
+// REGISTER_FRAME_CLOCK, unpacked
+struct FrameClock {
+    uint32_t frame;
+    uint16_t frameUs;
+    uint32_t deviceUs;
+    int16_t driftPpm;
+
+    bool locked() const { return frameUs != FRAME_US_UNLOCKED; }
+    // Frame time, in microseconds, of another device time, such as a tach
+    // sample's, taken not too long before or after this was read; only
+    // meaningful when locked
+    int64_t frameTimeUs(uint32_t otherDeviceUs) const
+    {
+        int32_t elapsed = (int32_t)(otherDeviceUs - deviceUs);
+        return (int64_t)frame * 1000 + frameUs + elapsed - (int64_t)elapsed * driftPpm / 1000000;
+    }
+};
+
+// A REGISTER_SCHEDULE entry
+struct ScheduledDuty {
+    uint32_t deviceUs;
+    uint16_t dutyRatio;
+};
+
+class Device
+{
+public:
+    Device(libusb_device_handle* handle, const FanInterface& fan, const std::string& serialNumber);
+    ~Device();
+    Device(const Device&) = delete;
+    Device& operator=(const Device&) = delete;
+
+    libusb_device_handle* handle() const { return devHandle; }
+    uint8_t interfaceNumber() const { return iface; }
+    uint8_t firmwareMinor() const { return info.minor; }
+    uint16_t capabilities() const { return info.capabilities; }
+    uint8_t channels() const { return info.channels; }
+    // Whether the firmware says it doesn't have a feature, so there is no
+    // need to try it
+    bool lacks(uint16_t capability) const
+    {
+        return info.minor >= 3 && !(info.capabilities & capability);
+    }
+    const std::string& serialNumber() const { return serial; }
+    uint8_t bus() const;
+    uint8_t address() const;
+
+    // Returns number of bytes read
+    int readRegister(uint8_t reg, uint8_t* data, uint16_t length,
+                     unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+    int readRegister(uint8_t reg, uint16_t& value, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+    int writeRegister(uint8_t reg, uint16_t value, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+    // For REG_WRITE_BLOCK registers
+    int writeRegister(uint8_t reg, const uint8_t* data, uint16_t length,
+                      unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+
+    // Read or set an identity string register, see Registers.h. Reading
+    // returns number of bytes read, or LIBUSB_ERROR_NOT_SUPPORTED if the
+    // firmware doesn't have them.
+    int readString(uint8_t reg, std::string& text, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+    int writeString(uint8_t reg, const std::string& text, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+
+    // Read REGISTER_HISTORY from sequence number since onwards, see
+    // Registers.h for the layout. Returns number of bytes read.
+    int readHistory(uint16_t since, uint8_t* data, uint16_t length,
+                    unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+
+    // Read tach speed along with the device time it was taken at and the
+    // time of the last edge. Returns LIBUSB_ERROR_NOT_SUPPORTED if the
+    // firmware doesn't have it.
+    int readTachSample(TachSample& sample, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+
+    // Read where the device is in the bus's frames. Returns
+    // LIBUSB_ERROR_NOT_SUPPORTED if the firmware doesn't have it.
+    int readFrameClock(FrameClock& clock, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+
+    // Queue a duty ratio to be set at a device time, or a frame with
+    // SCHEDULE_FLAG_FRAME; see Registers.h. The device refuses times already
+    // past, which comes back as LIBUSB_ERROR_PIPE. Returns
+    // LIBUSB_ERROR_NOT_SUPPORTED if the firmware doesn't have it.
+    int scheduleDuty(uint32_t when, uint16_t ratio, uint8_t flags = 0,
+                     unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+    int clearSchedule(unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+    int readSchedule(std::vector<ScheduledDuty>& entries, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+
+    // Download the whole register schema. Returns LIBUSB_ERROR_NOT_SUPPORTED
+    // if the capabilities say there isn't one; firmware too old to say
+    // stalls, which comes back as LIBUSB_ERROR_PIPE.
+    int readSchema(std::vector<RegisterInfo>& schema, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+
+    // Read tach edge intervals from the capture endpoint, once capture has
+    // been started through REGISTER_CAPTURE_CONTROL. Returns the number of
+    // intervals read, which is 0 if none turned up before the timeout.
+    int readCapture(uint16_t* intervals, int maxCount, unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+
+private:
+    int findCaptureEndpoint();
+
+    libusb_device_handle* devHandle;
+    uint8_t iface;
+    FanInterface info;
+    bool claimed;
+    std::string serial;
+    // 0 until looked up
+    uint8_t captureEndpoint;
+};
+
+class Context
+{
+public:
+    // Throws std::runtime_error if libusb can't be initialized
+    Context();
+    ~Context();
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    libusb_context* get() const { return ctx; }
+
+    // Open every attached fan device with a compatible firmware version.
+    // Uses the kernel's copy of the BOS descriptor where there is one, and
+    // otherwise remembers which devices are ours between runs, so other
+    // USB devices don't normally get opened at all.
+    std::vector<std::unique_ptr<Device>> findDevices();
+
+    // Open the fan interface(s) of one USB device, if it has any
+    int openDevice(libusb_device* dev, std::vector<std::unique_ptr<Device>>& found);
+
+    // Process libusb events until completed is set or timeout expires
+    int handleEvents(unsigned timeoutMs, int* completed = nullptr);
+
+private:
+    libusb_context* ctx;
+};
+
+// Find fan interfaces in a raw BOS descriptor; returns false if there are
+// none with a compatible version.
+bool parseBos(const uint8_t* buf, int length, std::vector<FanInterface>& interfaces);
+
+class Batch
+{
+public:
+    struct Op {
+        Device* device;
+        bool write;
+        uint8_t reg;
+        uint16_t value;
+        uint16_t length;
+        // 0 on success, else libusb error code
+        int status;
+        int actualLength;
+        uint8_t data[MAX_REGISTER_LENGTH];
+
+        uint16_t value16() const { return data[0] | (data[1] << 8); }
+    };
+
+    explicit Batch(Context& context);
+    ~Batch();
+    Batch(const Batch&) = delete;
+    Batch& operator=(const Batch&) = delete;
+
+    // Queue an operation, returns its index
+    size_t read(Device& device, uint8_t reg, uint16_t length = 2);
+    size_t write(Device& device, uint8_t reg, uint16_t value);
+
+    // Submit everything queued, then call done (from within libusb event
+    // handling) once all operations complete. Returns 0 if submitted,
+    // even if some operations failed to submit.
+    int submit(std::function<void(Batch&)> done = nullptr,
+               unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+    // Submit and wait for all operations to complete
+    int run(unsigned timeoutMs = DEFAULT_TIMEOUT_MS);
+    // Abort anything still in flight, returning once it has all completed
+    void cancel();
+
+    bool busy() const { return outstanding != 0; }
+    size_t size() const { return ops.size(); }
+    const Op& operator[](size_t i) const { return ops[i]; }
+    // Drop all queued operations; must not be busy
+    void clear();
+
+private:
+    static void transferDone(libusb_transfer* transfer);
+    void finish();
+
+    Context& ctx;
+    std::vector<Op> ops;
+    std::vector<libusb_transfer*> transfers;
+    std::vector<uint8_t> buffers;
+    size_t outstanding;
+    int completed;
+    std::function<void(Batch&)> doneCallback;
+};
+
+} // namespace usbfan
+
+#endif
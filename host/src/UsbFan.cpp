@@ -0,0 +1,706 @@
+//
+// Host side access to USB PWM fan devices
+//
+
+#include "usbfan/UsbFan.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <sys/stat.h>
+
+namespace usbfan {
+
+// Room for the 8 byte setup packet ahead of the data
+static constexpr size_t BUFFER_SIZE = LIBUSB_CONTROL_SETUP_SIZE + MAX_REGISTER_LENGTH;
+
+static int transferError(libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return LIBUSB_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return LIBUSB_ERROR_INTERRUPTED;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+static uint32_t readU32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+Device::Device(libusb_device_handle* handle, const FanInterface& fan, const std::string& serialNumber)
+    : devHandle(handle), iface(fan.number), info(fan), serial(serialNumber), captureEndpoint(0)
+{
+    // The interface would get claimed implicitly on first use on Linux, but
+    // be explicit so conflicts show up here.
+    claimed = libusb_claim_interface(devHandle, iface) == LIBUSB_SUCCESS;
+}
+
+Device::~Device()
+{
+    if (claimed) {
+        libusb_release_interface(devHandle, iface);
+    }
+    libusb_close(devHandle);
+}
+
+uint8_t Device::bus() const
+{
+    return libusb_get_bus_number(libusb_get_device(devHandle));
+}
+
+uint8_t Device::address() const
+{
+    return libusb_get_device_address(libusb_get_device(devHandle));
+}
+
+int Device::readRegister(uint8_t reg, uint8_t* data, uint16_t length, unsigned timeoutMs)
+{
+    return libusb_control_transfer(devHandle, REQUEST_READ, reg, 0, iface, data, length, timeoutMs);
+}
+
+int Device::readRegister(uint8_t reg, uint16_t& value, unsigned timeoutMs)
+{
+    uint8_t buf[2];
+    int rv = readRegister(reg, buf, sizeof(buf), timeoutMs);
+    if (rv < 0) {
+        return rv;
+    } else if (rv < (int)sizeof(buf)) {
+        return LIBUSB_ERROR_IO;
+    }
+    value = buf[0] | (buf[1] << 8);
+    return rv;
+}
+
+int Device::writeRegister(uint8_t reg, uint16_t value, unsigned timeoutMs)
+{
+    return libusb_control_transfer(devHandle, REQUEST_WRITE, reg, value, iface, nullptr, 0, timeoutMs);
+}
+
+int Device::writeRegister(uint8_t reg, const uint8_t* data, uint16_t length, unsigned timeoutMs)
+{
+    return libusb_control_transfer(devHandle, REQUEST_WRITE, reg, 0, iface,
+                                   const_cast<uint8_t*>(data), length, timeoutMs);
+}
+
+int Device::readString(uint8_t reg, std::string& text, unsigned timeoutMs)
+{
+    if (reg != REGISTER_SERIAL_NUMBER && lacks(CAP_IDENTITY)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    uint8_t buf[IDENTITY_TEXT_MAX];
+    int rv = readRegister(reg, buf, sizeof(buf), timeoutMs);
+    if (rv >= 0) {
+        text.assign((const char*)buf, rv);
+    }
+    return rv;
+}
+
+int Device::writeString(uint8_t reg, const std::string& text, unsigned timeoutMs)
+{
+    if (lacks(CAP_IDENTITY)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    if (text.empty()) {
+        uint8_t clear = 0;
+        return writeRegister(reg, &clear, 1, timeoutMs);
+    }
+    return writeRegister(reg, (const uint8_t*)text.data(), (uint16_t)text.size(), timeoutMs);
+}
+
+int Device::readHistory(uint16_t since, uint8_t* data, uint16_t length, unsigned timeoutMs)
+{
+    return libusb_control_transfer(devHandle, REQUEST_READ, REGISTER_HISTORY, since, iface,
+                                   data, length, timeoutMs);
+}
+
+int Device::readTachSample(TachSample& sample, unsigned timeoutMs)
+{
+    if (lacks(CAP_TACH_SAMPLE)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    uint8_t buf[TACH_SAMPLE_LENGTH];
+    int rv = readRegister(REGISTER_TACH_SAMPLE, buf, sizeof(buf), timeoutMs);
+    if (rv < 0) {
+        return rv;
+    } else if (rv < (int)sizeof(buf)) {
+        return LIBUSB_ERROR_IO;
+    }
+    sample.nowUs = readU32(buf);
+    sample.edgeUs = readU32(buf + 4);
+    sample.spanUs = readU32(buf + 8);
+    sample.rpm = buf[12] | (buf[13] << 8);
+    sample.dutyRatio = buf[14] | (buf[15] << 8);
+    return rv;
+}
+
+int Device::readFrameClock(FrameClock& clock, unsigned timeoutMs)
+{
+    if (lacks(CAP_FRAME_CLOCK)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    uint8_t buf[FRAME_CLOCK_LENGTH];
+    int rv = readRegister(REGISTER_FRAME_CLOCK, buf, sizeof(buf), timeoutMs);
+    if (rv < 0) {
+        return rv;
+    } else if (rv < (int)sizeof(buf)) {
+        return LIBUSB_ERROR_IO;
+    }
+    clock.frame = readU32(buf);
+    clock.frameUs = buf[4] | (buf[5] << 8);
+    clock.deviceUs = readU32(buf + 6);
+    clock.driftPpm = (int16_t)(buf[10] | (buf[11] << 8));
+    return rv;
+}
+
+int Device::scheduleDuty(uint32_t when, uint16_t ratio, uint8_t flags, unsigned timeoutMs)
+{
+    if (lacks(CAP_SCHEDULE)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    uint8_t buf[SCHEDULE_WRITE_LENGTH] = {
+        flags,
+        (uint8_t)when, (uint8_t)(when >> 8), (uint8_t)(when >> 16), (uint8_t)(when >> 24),
+        (uint8_t)ratio, (uint8_t)(ratio >> 8)
+    };
+    return writeRegister(REGISTER_SCHEDULE, buf, sizeof(buf), timeoutMs);
+}
+
+int Device::clearSchedule(unsigned timeoutMs)
+{
+    if (lacks(CAP_SCHEDULE)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    uint8_t clear = SCHEDULE_FLAG_CLEAR;
+    return writeRegister(REGISTER_SCHEDULE, &clear, 1, timeoutMs);
+}
+
+int Device::readSchedule(std::vector<ScheduledDuty>& entries, unsigned timeoutMs)
+{
+    entries.clear();
+    if (lacks(CAP_SCHEDULE)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    uint8_t buf[SCHEDULE_LENGTH];
+    int rv = readRegister(REGISTER_SCHEDULE, buf, sizeof(buf), timeoutMs);
+    if (rv < 0) {
+        return rv;
+    } else if (rv < 1 || rv < 1 + buf[0] * 6) {
+        return LIBUSB_ERROR_IO;
+    }
+    for (int i = 0; i < buf[0]; i++) {
+        const uint8_t* entry = buf + 1 + i * 6;
+        entries.push_back({ readU32(entry), (uint16_t)(entry[4] | (entry[5] << 8)) });
+    }
+    return rv;
+}
+
+int Device::readSchema(std::vector<RegisterInfo>& schema, unsigned timeoutMs)
+{
+    schema.clear();
+    if (lacks(CAP_SCHEMA)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    for (;;) {
+        uint8_t buf[SCHEMA_LENGTH];
+        int rv = libusb_control_transfer(devHandle, REQUEST_READ, REGISTER_SCHEMA,
+                                         (uint16_t)schema.size(), iface, buf, sizeof(buf),
+                                         timeoutMs);
+        if (rv < 0) {
+            return rv;
+        } else if (rv < 2 || buf[1] != schema.size()) {
+            return LIBUSB_ERROR_IO;
+        }
+        for (int pos = 2; pos + (int)SCHEMA_ENTRY_LENGTH <= rv; pos += SCHEMA_ENTRY_LENGTH) {
+            schema.push_back(RegisterInfo{ buf[pos], buf[pos + 1], buf[pos + 2],
+                                           (uint16_t)(buf[pos + 3] | (buf[pos + 4] << 8)),
+                                           (uint16_t)(buf[pos + 5] | (buf[pos + 6] << 8)) });
+        }
+        if (schema.size() >= buf[0]) {
+            return 0;
+        } else if (rv < (int)sizeof(buf)) {
+            // Short of a full reply but not done either
+            return LIBUSB_ERROR_IO;
+        }
+    }
+}
+
+int Device::findCaptureEndpoint()
+{
+    if (lacks(CAP_CAPTURE)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    libusb_config_descriptor* config;
+    int rv = libusb_get_active_config_descriptor(libusb_get_device(devHandle), &config);
+    if (rv != LIBUSB_SUCCESS) {
+        return rv;
+    }
+    for (int i = 0; i < config->bNumInterfaces && !captureEndpoint; i++) {
+        const libusb_interface& interface = config->interface[i];
+        if (interface.num_altsetting < 1 || interface.altsetting[0].bInterfaceNumber != iface) {
+            continue;
+        }
+        const libusb_interface_descriptor& alt = interface.altsetting[0];
+        for (int e = 0; e < alt.bNumEndpoints; e++) {
+            const libusb_endpoint_descriptor& ep = alt.endpoint[e];
+            if ((ep.bEndpointAddress & LIBUSB_ENDPOINT_IN) &&
+                (ep.bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_BULK) {
+                captureEndpoint = ep.bEndpointAddress;
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    // Older firmware has no endpoint
+    return captureEndpoint ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int Device::readCapture(uint16_t* intervals, int maxCount, unsigned timeoutMs)
+{
+    if (!captureEndpoint) {
+        int rv = findCaptureEndpoint();
+        if (rv != LIBUSB_SUCCESS) {
+            return rv;
+        }
+    }
+    // Intervals come little-endian, so can't be read straight into place
+    // everywhere
+    std::vector<uint8_t> buf(maxCount * 2);
+    int length = 0;
+    int rv = libusb_bulk_transfer(devHandle, captureEndpoint, buf.data(), buf.size(), &length,
+                                  timeoutMs);
+    if (rv != LIBUSB_SUCCESS && rv != LIBUSB_ERROR_TIMEOUT) {
+        return rv;
+    }
+    for (int i = 0; i < length / 2; i++) {
+        intervals[i] = buf[i * 2] | (buf[i * 2 + 1] << 8);
+    }
+    return length / 2;
+}
+
+Context::Context()
+{
+    int rv = libusb_init(&ctx);
+    if (rv != LIBUSB_SUCCESS) {
+        throw std::runtime_error(std::string("libusb init failed: ") + libusb_error_name(rv));
+    }
+}
+
+Context::~Context()
+{
+    libusb_exit(ctx);
+}
+
+bool parseBos(const uint8_t* buf, int length, std::vector<FanInterface>& interfaces)
+{
+    if (length < 5 || buf[0] < 5 || buf[1] != LIBUSB_DT_BOS) {
+        return false;
+    }
+    int end = buf[2] | (buf[3] << 8);
+    if (end > length) {
+        end = length;
+    }
+    bool found = false;
+    int num_caps = buf[4];
+    int pos = buf[0];
+    while (num_caps-- && end - pos >= 3) {
+        uint8_t cap_len = buf[pos];
+        // Device capability descriptor type
+        if (cap_len < 3 || cap_len > end - pos || buf[pos + 1] != 0x10) {
+            break;
+        }
+        // Platform capability, followed by UUID then our version, interface
+        // number, and from minor version 3, capabilities and channel count
+        if (buf[pos + 2] == 0x05 && cap_len >= 23 &&
+            memcmp(&buf[pos + 4], DEVICE_UUID, sizeof(DEVICE_UUID)) == 0) {
+            const uint8_t* data = &buf[pos + 20];
+            if (data[1] == DEVICE_MAJOR && data[0] >= DEVICE_MIN_MINOR) {
+                FanInterface info = { data[2], data[0], 0, 1 };
+                if (cap_len >= 26) {
+                    info.capabilities = data[3] | (data[4] << 8);
+                    info.channels = data[5];
+                }
+                interfaces.push_back(info);
+                found = true;
+            }
+        }
+        pos += cap_len;
+    }
+    return found;
+}
+
+// Remembers BOS descriptors of USB devices between runs, in a file shared
+// with the Python script. Entries are keyed by location and device address
+// as well as IDs, and the address changes every time a device enumerates,
+// so an entry stops matching once the device is unplugged, reset or
+// reflashed.
+class DiscoveryCache
+{
+public:
+    DiscoveryCache()
+    {
+        const char* base = getenv("XDG_CACHE_HOME");
+        if (base && *base) {
+            dir = std::string(base) + "/usb-pwm-fan";
+        } else if ((base = getenv("HOME")) && *base) {
+            dir = std::string(base) + "/.cache/usb-pwm-fan";
+        } else {
+            return;
+        }
+        std::ifstream file(dir + "/discovery");
+        std::string line;
+        while (std::getline(file, line)) {
+            std::string::size_type space = line.find(' ');
+            if (line[0] != '#' && space != std::string::npos) {
+                entries[line.substr(0, space)] = line.substr(space + 1);
+            }
+        }
+    }
+
+    bool lookup(const std::string& key, std::vector<uint8_t>& bos) const
+    {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return false;
+        }
+        bos.clear();
+        if (it->second != "-") {
+            for (size_t i = 0; i + 1 < it->second.size(); i += 2) {
+                bos.push_back(strtoul(it->second.substr(i, 2).c_str(), nullptr, 16));
+            }
+        }
+        return true;
+    }
+
+    void store(const std::string& key, const std::vector<uint8_t>& bos)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (uint8_t byte : bos) {
+            hex += digits[byte >> 4];
+            hex += digits[byte & 0xf];
+        }
+        seen[key] = hex.empty() ? "-" : hex;
+    }
+
+    void save() const
+    {
+        // Only keep devices that are still attached
+        if (dir.empty() || seen == entries) {
+            return;
+        }
+        std::string::size_type slash = dir.rfind('/');
+        mkdir(dir.substr(0, slash).c_str(), 0755);
+        mkdir(dir.c_str(), 0755);
+        std::string path = dir + "/discovery";
+        {
+            std::ofstream file(path + ".tmp");
+            file << "# usb-pwm-fan device discovery cache\n";
+            for (auto& entry : seen) {
+                file << entry.first << " " << entry.second << "\n";
+            }
+            if (!file) {
+                return;
+            }
+        }
+        rename((path + ".tmp").c_str(), path.c_str());
+    }
+
+private:
+    std::string dir;
+    std::map<std::string, std::string> entries;
+    std::map<std::string, std::string> seen;
+};
+
+static std::string port_path(libusb_device* dev)
+{
+    uint8_t ports[8];
+    int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    std::string path = std::to_string(libusb_get_bus_number(dev)) + "-";
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            path += ".";
+        }
+        path += std::to_string(ports[i]);
+    }
+    return path;
+}
+
+static std::string cache_key(libusb_device* dev, const libusb_device_descriptor& desc)
+{
+    char ids[32];
+    snprintf(ids, sizeof(ids), "/%u/%04x:%04x:%04x", libusb_get_device_address(dev),
+             desc.idVendor, desc.idProduct, desc.bcdDevice);
+    return port_path(dev) + ids;
+}
+
+// The kernel keeps a copy of the BOS descriptor in sysfs since Linux 6.x
+static bool read_sysfs_bos(libusb_device* dev, std::vector<uint8_t>& bos)
+{
+#ifdef __linux__
+    std::ifstream file("/sys/bus/usb/devices/" + port_path(dev) + "/bos_descriptors",
+                       std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    bos.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+#else
+    (void)dev;
+    (void)bos;
+    return false;
+#endif
+}
+
+static int open_device(libusb_device* dev, std::vector<std::unique_ptr<Device>>& found,
+                       DiscoveryCache* cache)
+{
+    libusb_device_descriptor desc;
+    int rv = libusb_get_device_descriptor(dev, &desc);
+    if (rv != LIBUSB_SUCCESS) {
+        return rv;
+    }
+    // BOS descriptor requires USB 2.1 or later, and hubs can be skipped
+    // outright
+    if (desc.bcdUSB < 0x0201 || desc.bDeviceClass == LIBUSB_CLASS_HUB) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    // Check for our capability before opening, if possible
+    std::string key = cache_key(dev, desc);
+    std::vector<uint8_t> bos;
+    bool have_bos = read_sysfs_bos(dev, bos) || (cache && cache->lookup(key, bos));
+    std::vector<FanInterface> interfaces;
+    if (have_bos && !parseBos(bos.data(), bos.size(), interfaces)) {
+        if (cache) {
+            cache->store(key, bos);
+        }
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    libusb_device_handle* handle;
+    rv = libusb_open(dev, &handle);
+    if (rv != LIBUSB_SUCCESS) {
+        return rv;
+    }
+
+    if (!have_bos) {
+        bos.resize(1024);
+        rv = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+                                     LIBUSB_DT_BOS << 8, 0, bos.data(), bos.size(),
+                                     PROBE_TIMEOUT_MS);
+        if (rv < 0) {
+            // Could be transient, so don't remember it
+            libusb_close(handle);
+            return rv;
+        }
+        bos.resize(rv);
+        if (cache) {
+            cache->store(key, bos);
+        }
+        if (!parseBos(bos.data(), bos.size(), interfaces)) {
+            libusb_close(handle);
+            return LIBUSB_ERROR_NOT_FOUND;
+        }
+    } else if (cache) {
+        cache->store(key, bos);
+    }
+
+    char serial[64] = "";
+    if (desc.iSerialNumber) {
+        rv = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                                (unsigned char*)serial, sizeof(serial));
+        if (rv < 0) {
+            serial[0] = '\0';
+        }
+    }
+
+    for (size_t i = 0; i < interfaces.size(); i++) {
+        libusb_device_handle* iface_handle = handle;
+        if (i > 0) {
+            // Each Device owns its handle, so open another one
+            rv = libusb_open(dev, &iface_handle);
+            if (rv != LIBUSB_SUCCESS) {
+                return rv;
+            }
+        }
+        found.emplace_back(new Device(iface_handle, interfaces[i], serial));
+    }
+    return LIBUSB_SUCCESS;
+}
+
+int Context::openDevice(libusb_device* dev, std::vector<std::unique_ptr<Device>>& found)
+{
+    return open_device(dev, found, nullptr);
+}
+
+std::vector<std::unique_ptr<Device>> Context::findDevices()
+{
+    std::vector<std::unique_ptr<Device>> found;
+    DiscoveryCache cache;
+    libusb_device** list;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    for (ssize_t i = 0; i < count; i++) {
+        open_device(list[i], found, &cache);
+    }
+    if (count >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    cache.save();
+    return found;
+}
+
+int Context::handleEvents(unsigned timeoutMs, int* completed)
+{
+    timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+Batch::Batch(Context& context) : ctx(context), outstanding(0), completed(0)
+{
+}
+
+Batch::~Batch()
+{
+    if (busy()) {
+        cancel();
+    }
+    for (libusb_transfer* transfer : transfers) {
+        libusb_free_transfer(transfer);
+    }
+}
+
+size_t Batch::read(Device& device, uint8_t reg, uint16_t length)
+{
+    if (length > MAX_REGISTER_LENGTH) {
+        length = MAX_REGISTER_LENGTH;
+    }
+    Op op = { &device, false, reg, 0, length, LIBUSB_SUCCESS, 0, {} };
+    ops.push_back(op);
+    return ops.size() - 1;
+}
+
+size_t Batch::write(Device& device, uint8_t reg, uint16_t value)
+{
+    Op op = { &device, true, reg, value, 0, LIBUSB_SUCCESS, 0, {} };
+    ops.push_back(op);
+    return ops.size() - 1;
+}
+
+void Batch::transferDone(libusb_transfer* transfer)
+{
+    Batch* batch = (Batch*)transfer->user_data;
+    size_t i = (transfer->buffer - batch->buffers.data()) / BUFFER_SIZE;
+    Op& op = batch->ops[i];
+    op.status = transferError(transfer->status);
+    op.actualLength = transfer->actual_length;
+    if (!op.write && op.actualLength > 0) {
+        memcpy(op.data, libusb_control_transfer_get_data(transfer), op.actualLength);
+    }
+    if (--batch->outstanding == 0) {
+        batch->finish();
+    }
+}
+
+void Batch::finish()
+{
+    completed = 1;
+    if (doneCallback) {
+        // Let the callback reuse this batch
+        std::function<void(Batch&)> done;
+        done.swap(doneCallback);
+        done(*this);
+    }
+}
+
+int Batch::submit(std::function<void(Batch&)> done, unsigned timeoutMs)
+{
+    if (busy()) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    while (transfers.size() < ops.size()) {
+        libusb_transfer* transfer = libusb_alloc_transfer(0);
+        if (!transfer) {
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        transfers.push_back(transfer);
+    }
+    buffers.resize(ops.size() * BUFFER_SIZE);
+
+    doneCallback = done;
+    completed = 0;
+    // Count everything up front so completions during submit can't finish
+    // the batch early
+    outstanding = ops.size() + 1;
+    for (size_t i = 0; i < ops.size(); i++) {
+        Op& op = ops[i];
+        uint8_t* buffer = &buffers[i * BUFFER_SIZE];
+        libusb_fill_control_setup(buffer, op.write ? REQUEST_WRITE : REQUEST_READ, op.reg,
+                                  op.value, op.device->interfaceNumber(), op.length);
+        libusb_fill_control_transfer(transfers[i], op.device->handle(), buffer,
+                                     transferDone, this, timeoutMs);
+        op.actualLength = 0;
+        op.status = libusb_submit_transfer(transfers[i]);
+        if (op.status != LIBUSB_SUCCESS) {
+            outstanding--;
+        }
+    }
+    if (--outstanding == 0) {
+        finish();
+    }
+    return LIBUSB_SUCCESS;
+}
+
+int Batch::run(unsigned timeoutMs)
+{
+    int rv = submit(nullptr, timeoutMs);
+    if (rv != LIBUSB_SUCCESS) {
+        return rv;
+    }
+    while (busy()) {
+        // Transfers time out on their own, this just bounds each wait
+        rv = ctx.handleEvents(timeoutMs, &completed);
+        if (rv != LIBUSB_SUCCESS && rv != LIBUSB_ERROR_INTERRUPTED) {
+            cancel();
+            return rv;
+        }
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void Batch::cancel()
+{
+    for (size_t i = 0; i < ops.size() && i < transfers.size(); i++) {
+        libusb_cancel_transfer(transfers[i]);
+    }
+    // Cancellation still completes through the callback, and until it
+    // has, libusb still owns the transfers and calls back into this batch.
+    // So keep going through errors, such as being interrupted, rather than
+    // leave them for the destructor to free.
+    while (busy()) {
+        ctx.handleEvents(DEFAULT_TIMEOUT_MS, &completed);
+    }
+}
+
+void Batch::clear()
+{
+    ops.clear();
+}
+
+} // namespace usbfan
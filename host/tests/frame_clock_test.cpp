@@ -0,0 +1,129 @@
+//
+// Runs the firmware's frame clock against a simulated bus
+//
+// The device's micros() runs fast or slow against the host's frames by the
+// parts per million given on the command line, with the main loop taking a
+// random time per pass and interrupts now and then delaying things. Once
+// it has had time to settle, the frame time the clock works out for
+// micros() has to stay close to the true host time, and the drift it
+// reports close to the simulated one.
+//
+
+#include "Arduino.h"
+#include "FrameClock.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+volatile uint8_t UDFNUML;
+volatile uint8_t UDFNUMH;
+volatile uint8_t SREG;
+USBDevice_ USBDevice;
+
+bool USBDevice_::configured()
+{
+    return true;
+}
+
+// Time in device microseconds, which the firmware sees in steps of 4
+static double device_us = 5000000;
+static double ppm;
+static std::mt19937 rng(1);
+
+static double host_us(double at_device_us)
+{
+    return at_device_us / (1 + ppm * 1e-6) + 123.4;
+}
+
+static void advance(double us)
+{
+    // Timer 0 ticks every 1024us, and its interrupt takes a few of them
+    static double next_tick;
+    device_us += us;
+    if (device_us >= next_tick) {
+        device_us += 6;
+        next_tick = device_us + 1024;
+    }
+    long frame = (long)floor(host_us(device_us) / 1000);
+    UDFNUML = frame & 0xff;
+    UDFNUMH = (frame >> 8) & 0x07;
+}
+
+unsigned long micros()
+{
+    // A few cycles per call, and now and then a longer USB interrupt
+    advance(2 + (rng() % 1000 == 0 ? 10 + rng() % 20 : 0));
+    return (unsigned long)device_us & ~3UL;
+}
+
+unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+void cli()
+{
+}
+
+static uint8_t reply[FRAME_CLOCK_LENGTH];
+
+static int send(uint8_t flags, const void* data, int length)
+{
+    (void)flags;
+    memcpy(reply, data, length);
+    return length;
+}
+
+int main(int argc, char** argv)
+{
+    ppm = argc > 1 ? atof(argv[1]) : 3000;
+    // Loop passes, about 10 minutes' worth
+    const int PASSES = 2000000;
+    // Allowed once settled; the odd measurement delayed by a long interrupt
+    // pulls it off further for a while
+    const double MAX_RMS_ERROR_US = 4;
+    const double MAX_ERROR_US = 25;
+    const double MAX_DRIFT_ERROR_PPM = 30;
+
+    advance(0);
+    double worst_us = 0;
+    double sum_squares = 0;
+    int checks = 0;
+    for (int i = 0; i < PASSES; i++) {
+        frame_clock_poll();
+        // Rest of the main loop
+        advance(200 + rng() % 300);
+        if (i < PASSES / 10 || i % 1000) {
+            continue;
+        }
+        unsigned long now = micros();
+        uint32_t frame;
+        uint16_t frame_us;
+        if (!frame_clock_time(now, &frame, &frame_us)) {
+            printf("FAIL: not locked after %d passes\n", i);
+            return 1;
+        }
+        // Bus frame numbers wrap every 2048 frames
+        double error = remainder((frame & 0x7ff) * 1000.0 + frame_us - host_us(now), 2048000);
+        worst_us = fmax(worst_us, fabs(error));
+        sum_squares += error * error;
+        checks++;
+    }
+
+    // Drift as the host sees it
+    frame_clock_read(send);
+    int16_t drift_ppm = reply[10] | (reply[11] << 8);
+
+    double rms_us = sqrt(sum_squares / checks);
+    printf("%+.0f ppm: error %.1f us rms, %.1f us worst, reports %+d ppm\n",
+           ppm, rms_us, worst_us, drift_ppm);
+    if (rms_us > MAX_RMS_ERROR_US || worst_us > MAX_ERROR_US ||
+        fabs(drift_ppm - ppm) > MAX_DRIFT_ERROR_PPM) {
+        printf("FAIL\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+//
+// Checks the firmware's Timer1 PWM output: duty ratios scaled to the
+// period, including the 65536 cycle one, and sigma-delta dithering between
+// adjacent duty values
+//
+// The overflow interrupt gets called by hand wherever the timer would
+// reach the end of a PWM period.
+//
+
+#include "Arduino.h"
+#include "PwmOutput.h"
+
+#include <cmath>
+#include <cstdio>
+
+// Defined by ISR() in PwmOutput.cpp
+extern "C" void TIMER1_OVF_vect();
+
+static int failures;
+
+static void check(bool ok, const char* what, unsigned period, unsigned ratio)
+{
+    if (!ok) {
+        printf("FAIL: %s, period %u, ratio %u\n", what, period, ratio);
+        failures++;
+    }
+}
+
+// End of a PWM period
+static void overflow()
+{
+    if (TIMSK1 & _BV(TOIE1)) {
+        TIMER1_OVF_vect();
+    }
+}
+
+// Cycles the output is high for in the next PWM period
+static uint32_t high_cycles()
+{
+    return (TCCR1A & 0x80) ? OCR1A + 1 : 0;
+}
+
+static void set_period(uint32_t period)
+{
+    pwm_set_period((uint16_t)period, false);
+}
+
+static void check_ratios()
+{
+    static const uint32_t periods[] = { 640, 1000, 1280, 0xffff, 0x10000 };
+    static const uint16_t ratios[] = { 0, 1, 100, 0x4000, 0x8000, 0xc000, 0xfffe, 0xffff };
+    for (uint32_t period : periods) {
+        for (uint16_t ratio : ratios) {
+            set_period(period);
+            pwm_set_ratio(ratio);
+            overflow();
+            uint32_t expected = ((uint64_t)ratio * period + 32767) / 65535;
+            check(high_cycles() == expected, "duty off from ratio", period, ratio);
+            check(pwm_output_on() == (expected != 0), "output on/off doesn't match duty", period,
+                  ratio);
+            check(pwm_period() == (uint16_t)period, "period reads back wrong", period, ratio);
+        }
+    }
+
+    // Full duty on the 65536 cycle period, whose cycle count doesn't fit in
+    // 16 bits, still has to come out as full duty rather than off
+    set_period(0x10000);
+    pwm_set_ratio(0xffff);
+    overflow();
+    check(pwm_output_on() && OCR1A == 0xffff, "full duty lost", 0x10000, 0xffff);
+    check(pwm_duty() == 0xffff, "full duty reads back wrong", 0x10000, 0xffff);
+}
+
+static void check_dither()
+{
+    static const uint32_t periods[] = { 640, 1279, 0x10000 };
+    static const uint16_t ratios[] = { 0x0400, 0x1234, 0x8001, 0xabcd, 0xfff0 };
+    pwm_set_dither(true);
+    for (uint32_t period : periods) {
+        for (uint16_t ratio : ratios) {
+            set_period(period);
+            pwm_set_ratio(ratio);
+            // Ratio stretched to 0..65536, so full scale is the whole period
+            double exact = (ratio + (ratio >> 15)) * (double)period / 65536;
+            uint32_t low = (uint32_t)exact;
+            // The fraction is in 1/256 cycle steps, so over 256 periods the
+            // average has to come out within one step of exact
+            uint64_t total = 0;
+            bool adjacent = true;
+            for (int i = 0; i < 256; i++) {
+                overflow();
+                uint32_t cycles = high_cycles();
+                adjacent = adjacent && (cycles == low || cycles == low + 1);
+                total += cycles;
+            }
+            check(adjacent, "dither strays past adjacent duty values", period, ratio);
+            check(fabs(total / 256.0 - exact) <= 1 / 256.0, "dithered duty averages wrong", period,
+                  ratio);
+        }
+    }
+    pwm_set_dither(false);
+}
+
+static void check_synced_period()
+{
+    set_period(640);
+    pwm_set_ratio(0x8000);
+    overflow();
+    pwm_set_period(1280, true);
+    check(ICR1 == 639 && pwm_update_pending(), "synced period applied early", 1280, 0x8000);
+    check(pwm_period() == 1280, "pending period doesn't read back", 1280, 0x8000);
+    overflow();
+    check(ICR1 == 1279 && !pwm_update_pending(), "synced period not applied", 1280, 0x8000);
+}
+
+int main()
+{
+    pwm_begin();
+    check_ratios();
+    check_dither();
+    check_synced_period();
+    if (failures) {
+        return 1;
+    }
+    printf("PWM output checks passed\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+//
+// Checks staged PWM writes through the firmware's register handlers: they
+// are held until commit, land together at the end of a PWM period, and a
+// set left open gets dropped after STAGE_TIMEOUT_MS
+//
+// Built with every firmware source but the sketch itself, against the stub
+// core, whose clock this drives through stub_us.
+//
+
+#include "Arduino.h"
+#include "PwmOutput.h"
+#include "UsbPwmDevice.h"
+#include "stub_core.h"
+
+#include <cstdio>
+
+// Same as usbfan/Registers.h, which clashes with the firmware's flags
+#define REGISTER_PWM_DUTY 0x10
+#define REGISTER_PWM_PERIOD 0x11
+#define REGISTER_STAGE_CONTROL 0x13
+#define REGISTER_PWM_DUTY_RATIO 0x14
+
+// Same as UsbPwmDevice.cpp
+#define STAGE_TIMEOUT_MS 250
+
+// Defined by ISR() in PwmOutput.cpp
+extern "C" void TIMER1_OVF_vect();
+
+static int failures;
+
+static void check(bool ok, const char* what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static uint16_t read_value;
+
+static int capture_read(uint8_t, const void* data, int length)
+{
+    if (length == sizeof(read_value)) {
+        memcpy(&read_value, data, length);
+    }
+    return length;
+}
+
+static uint16_t read(uint8_t reg)
+{
+    read_value = 0xdead;
+    TheUsbPwmDevice.readRegister(reg, 0, capture_read);
+    return read_value;
+}
+
+static void write(uint8_t reg, uint16_t value)
+{
+    check(TheUsbPwmDevice.writeRegister(reg, value), "write refused");
+}
+
+// End of a PWM period
+static void overflow()
+{
+    if (TIMSK1 & _BV(TOIE1)) {
+        TIMER1_OVF_vect();
+    }
+}
+
+static void advance_ms(unsigned long ms)
+{
+    stub_us += ms * 1000;
+}
+
+static void check_commit()
+{
+    write(REGISTER_STAGE_CONTROL, STAGE_OPEN);
+    write(REGISTER_PWM_PERIOD, 1280);
+    write(REGISTER_PWM_DUTY_RATIO, 0x8000);
+    check(read(REGISTER_STAGE_CONTROL) == STAGE_OPEN, "stage not open");
+    check(ICR1 == 639 && !pwm_output_on(), "staged writes applied before commit");
+    check(read(REGISTER_PWM_PERIOD) == 640, "staged period reads back before commit");
+
+    write(REGISTER_STAGE_CONTROL, STAGE_COMMIT);
+    check(read(REGISTER_STAGE_CONTROL) == STAGE_COMMIT, "commit not pending until overflow");
+    check(ICR1 == 639, "committed period applied before overflow");
+    overflow();
+    check(read(REGISTER_STAGE_CONTROL) == STAGE_IDLE, "commit still pending after overflow");
+    check(ICR1 == 1279, "committed period not applied");
+    check(pwm_output_on() && OCR1A == 639, "committed ratio not applied at new period");
+    check(read(REGISTER_PWM_DUTY_RATIO) == 0x8000, "committed ratio reads back wrong");
+}
+
+static void check_last_duty_wins()
+{
+    write(REGISTER_STAGE_CONTROL, STAGE_OPEN);
+    write(REGISTER_PWM_DUTY_RATIO, 0x4000);
+    write(REGISTER_PWM_DUTY, 100);
+    write(REGISTER_STAGE_CONTROL, STAGE_COMMIT);
+    overflow();
+    check(OCR1A == 99, "duty staged after ratio lost");
+
+    write(REGISTER_STAGE_CONTROL, STAGE_OPEN);
+    write(REGISTER_PWM_DUTY, 200);
+    write(REGISTER_PWM_DUTY_RATIO, 0xc000);
+    write(REGISTER_STAGE_CONTROL, STAGE_COMMIT);
+    overflow();
+    check(OCR1A == 959 && read(REGISTER_PWM_DUTY_RATIO) == 0xc000,
+          "ratio staged after duty lost");
+}
+
+static void check_expiry()
+{
+    write(REGISTER_STAGE_CONTROL, STAGE_OPEN);
+    write(REGISTER_PWM_PERIOD, 2000);
+    advance_ms(STAGE_TIMEOUT_MS - 1);
+    check(read(REGISTER_STAGE_CONTROL) == STAGE_OPEN, "stage expired early");
+    advance_ms(1);
+    check(read(REGISTER_STAGE_CONTROL) == STAGE_IDLE, "stage not expired");
+    write(REGISTER_STAGE_CONTROL, STAGE_COMMIT);
+    overflow();
+    check(ICR1 == 1279, "expired stage committed");
+
+    // Writes after expiry apply straight away again
+    write(REGISTER_PWM_DUTY, 300);
+    check(OCR1A == 299, "write after expiry held");
+}
+
+static void check_discard()
+{
+    write(REGISTER_STAGE_CONTROL, STAGE_OPEN);
+    write(REGISTER_PWM_PERIOD, 2000);
+    write(REGISTER_PWM_DUTY, 400);
+    write(REGISTER_STAGE_CONTROL, STAGE_IDLE);
+    write(REGISTER_STAGE_CONTROL, STAGE_COMMIT);
+    overflow();
+    check(ICR1 == 1279 && OCR1A == 299, "discarded stage committed");
+}
+
+int main()
+{
+    stub_us = 1000000;
+    TheUsbPwmDevice.begin();
+    check_commit();
+    check_last_duty_wins();
+    check_expiry();
+    check_discard();
+    if (failures) {
+        return 1;
+    }
+    printf("Staging checks passed\n");
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+//
+// Just enough of the Arduino AVR core, and of avr-libc, to build the
+// firmware sources on the host. Registers are plain variables. stub_core.cpp
+// defines them along with the rest of the core, with a clock the tests set;
+// frame_clock_test.cpp brings its own instead.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#include "USBAPI.h"
+
+unsigned long micros();
+unsigned long millis();
+
+#endif
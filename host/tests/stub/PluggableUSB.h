@@ -0,0 +1,34 @@
+#ifndef PUSB_h
+#define PUSB_h
+
+#include "USBAPI.h"
+
+class PluggableUSBModule
+{
+public:
+    PluggableUSBModule(uint8_t numEps, uint8_t numIfs, uint8_t* epType)
+        : numEndpoints(numEps), numInterfaces(numIfs), endpointType(epType)
+    {
+    }
+
+protected:
+    virtual bool setup(USBSetup& setup) = 0;
+    virtual int getInterface(uint8_t* interfaceCount) = 0;
+    virtual int getDescriptor(USBSetup& setup) = 0;
+    virtual uint8_t getShortName(char* name) { name[0] = 'A'; return 1; }
+
+    uint8_t pluggedInterface = 0;
+    uint8_t pluggedEndpoint = 0;
+    const uint8_t numEndpoints;
+    const uint8_t numInterfaces;
+    const uint8_t* endpointType;
+};
+
+class PluggableUSB_
+{
+public:
+    bool plug(PluggableUSBModule* node);
+};
+PluggableUSB_& PluggableUSB();
+
+#endif
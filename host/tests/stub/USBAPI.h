@@ -0,0 +1,37 @@
+#ifndef USBAPI_h
+#define USBAPI_h
+
+#include <stdint.h>
+
+#define USB_EP_SIZE 64
+
+#define TRANSFER_PGM 0x80
+#define TRANSFER_RELEASE 0x40
+#define TRANSFER_ZERO 0x20
+
+#define ISERIAL_MAX_LEN 20
+#define MAGIC_KEY 0x7777
+#define MAGIC_KEY_POS 0x0800
+
+typedef struct {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint8_t wValueL;
+    uint8_t wValueH;
+    uint16_t wIndex;
+    uint16_t wLength;
+} USBSetup;
+
+class USBDevice_
+{
+public:
+    bool configured();
+};
+extern USBDevice_ USBDevice;
+
+int USB_SendControl(uint8_t flags, const void* data, int length);
+int USB_RecvControl(void* data, int length);
+int USB_SendSpace(uint8_t ep);
+int USB_Send(uint8_t ep, const void* data, int length);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef USBCore_h
+#define USBCore_h
+
+#include "USBAPI.h"
+
+#define REQUEST_HOSTTODEVICE 0x00
+#define REQUEST_DEVICETOHOST 0x80
+#define REQUEST_VENDOR 0x40
+#define REQUEST_DEVICE 0x00
+#define REQUEST_INTERFACE 0x01
+
+#define USB_DEVICE_CLASS_VENDOR_SPECIFIC 0xff
+#define USB_ENDPOINT_TYPE_BULK 0x02
+#define USB_ENDPOINT_IN(addr) ((uint8_t)((addr) | 0x80))
+#define USB_STRING_DESCRIPTOR_TYPE 3
+#define EP_TYPE_BULK_IN 0x81
+
+typedef struct {
+    uint8_t len, dtype, number, alternate, numEndpoints, interfaceClass, interfaceSubClass,
+        protocol, iInterface;
+} InterfaceDescriptor;
+
+typedef struct {
+    uint8_t len, dtype, addr, attr;
+    uint16_t packetSize;
+    uint8_t interval;
+} EndpointDescriptor;
+
+#define D_INTERFACE(n, endpoints, cls, subclass, protocol) \
+    { 9, 4, n, 0, endpoints, cls, subclass, protocol, 0 }
+#define D_ENDPOINT(addr, attr, packetSize, interval) { 7, 5, addr, attr, packetSize, interval }
+
+#endif
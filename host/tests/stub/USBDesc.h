@@ -0,0 +1,12 @@
+#ifndef USBDesc_h
+#define USBDesc_h
+
+#define CDC_ACM_INTERFACE 0
+#ifdef CDC_DISABLED
+#define CDC_INTERFACE_COUNT 0
+#else
+#define CDC_ENABLED
+#define CDC_INTERFACE_COUNT 2
+#endif
+
+#endif
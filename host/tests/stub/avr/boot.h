@@ -0,0 +1,8 @@
+#ifndef avr_boot_h
+#define avr_boot_h
+
+#include <stdint.h>
+
+uint8_t boot_signature_byte_get(int addr);
+
+#endif
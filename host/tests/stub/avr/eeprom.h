@@ -0,0 +1,14 @@
+#ifndef avr_eeprom_h
+#define avr_eeprom_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t eeprom_read_byte(const uint8_t* addr);
+uint16_t eeprom_read_word(const uint16_t* addr);
+void eeprom_read_block(void* dest, const void* src, size_t length);
+void eeprom_update_byte(uint8_t* addr, uint8_t value);
+void eeprom_update_word(uint16_t* addr, uint16_t value);
+void eeprom_update_block(const void* src, void* dest, size_t length);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef avr_interrupt_h
+#define avr_interrupt_h
+
+// Interrupt handlers are plain functions the tests call when the hardware
+// would
+#define ISR(vector, ...) extern "C" void vector()
+
+void cli();
+void sei();
+
+#endif
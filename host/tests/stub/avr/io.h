@@ -0,0 +1,64 @@
+#ifndef avr_io_h
+#define avr_io_h
+
+#include <stdint.h>
+
+#define F_CPU 16000000UL
+#define RAMEND 0x0aff
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t SREG;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t PRR0;
+extern volatile uint8_t EICRA;
+extern volatile uint8_t EIFR;
+extern volatile uint8_t EIMSK;
+
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint8_t TIFR1;
+extern volatile uint8_t TIMSK1;
+extern volatile uint16_t ICR1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t TCNT1;
+
+extern volatile uint8_t TCCR3A;
+extern volatile uint8_t TCCR3B;
+extern volatile uint8_t TCCR3C;
+extern volatile uint8_t TIFR3;
+extern volatile uint8_t TIMSK3;
+extern volatile uint16_t OCR3A;
+extern volatile uint16_t TCNT3;
+
+extern volatile uint8_t TCCR4A;
+extern volatile uint8_t TCCR4B;
+extern volatile uint8_t TCCR4C;
+extern volatile uint8_t TCCR4D;
+extern volatile uint8_t TCCR4E;
+extern volatile uint8_t TIFR4;
+extern volatile uint8_t TIMSK4;
+extern volatile uint8_t TC4H;
+extern volatile uint8_t OCR4B;
+extern volatile uint8_t OCR4C;
+extern volatile uint8_t TCNT4;
+extern volatile uint8_t DT4;
+extern volatile uint8_t PLLFRQ;
+
+extern volatile uint8_t UDFNUML;
+extern volatile uint8_t UDFNUMH;
+extern volatile uint8_t UEDATX;
+
+#define PRTIM1 3
+#define TOV1 0
+#define TOIE1 0
+#define COM1A1 7
+#define CS31 1
+#define OCF3A 1
+#define OCIE3A 1
+#define TOV4 2
+#define TOIE4 2
+#define PWM4B 0
+#define TLOCK4 7
+
+#endif
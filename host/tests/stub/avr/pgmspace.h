@@ -0,0 +1,23 @@
+#ifndef avr_pgmspace_h
+#define avr_pgmspace_h
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define memcpy_P memcpy
+
+// Flash, for code that reads it by address rather than through a pointer
+extern uint8_t stub_flash[0x8000];
+
+inline uint8_t pgm_read_byte(const void* addr)
+{
+    return *(const uint8_t*)addr;
+}
+
+inline uint8_t pgm_read_byte(uint16_t addr)
+{
+    return stub_flash[addr & 0x7fff];
+}
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef avr_sleep_h
+#define avr_sleep_h
+
+void sleep_mode();
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef avr_wdt_h
+#define avr_wdt_h
+
+#define WDTO_15MS 0
+#define WDTO_2S 7
+
+void wdt_enable(int timeout);
+
+#endif
@@ -0,0 +1,186 @@
+//
+// Definitions behind the stub core headers, for tests that build firmware
+// sources on the host
+//
+
+#include "Arduino.h"
+#include "PluggableUSB.h"
+#include "stub_core.h"
+
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+volatile uint8_t SREG;
+volatile uint8_t DDRB;
+volatile uint8_t PRR0;
+volatile uint8_t EICRA;
+volatile uint8_t EIFR;
+volatile uint8_t EIMSK;
+
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint8_t TIFR1;
+volatile uint8_t TIMSK1;
+volatile uint16_t ICR1;
+volatile uint16_t OCR1A;
+volatile uint16_t TCNT1;
+
+volatile uint8_t TCCR3A;
+volatile uint8_t TCCR3B;
+volatile uint8_t TCCR3C;
+volatile uint8_t TIFR3;
+volatile uint8_t TIMSK3;
+volatile uint16_t OCR3A;
+volatile uint16_t TCNT3;
+
+volatile uint8_t TCCR4A;
+volatile uint8_t TCCR4B;
+volatile uint8_t TCCR4C;
+volatile uint8_t TCCR4D;
+volatile uint8_t TCCR4E;
+volatile uint8_t TIFR4;
+volatile uint8_t TIMSK4;
+volatile uint8_t TC4H;
+volatile uint8_t OCR4B;
+volatile uint8_t OCR4C;
+volatile uint8_t TCNT4;
+volatile uint8_t DT4;
+volatile uint8_t PLLFRQ;
+
+volatile uint8_t UDFNUML;
+volatile uint8_t UDFNUMH;
+volatile uint8_t UEDATX;
+
+uint8_t stub_flash[0x8000];
+// Linker symbol for the end of the image in flash
+extern const uint8_t __data_load_end[1] = { 0 };
+
+unsigned long stub_us;
+
+// Kept inverted, so it starts out erased to 0xff
+static uint8_t eeprom[1024];
+
+unsigned long micros()
+{
+    return stub_us;
+}
+
+unsigned long millis()
+{
+    return stub_us / 1000;
+}
+
+void cli()
+{
+}
+
+void sei()
+{
+}
+
+uint8_t eeprom_read_byte(const uint8_t* addr)
+{
+    return eeprom[(uintptr_t)addr % sizeof(eeprom)] ^ 0xff;
+}
+
+uint16_t eeprom_read_word(const uint16_t* addr)
+{
+    uint16_t value;
+    eeprom_read_block(&value, addr, sizeof(value));
+    return value;
+}
+
+void eeprom_read_block(void* dest, const void* src, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        ((uint8_t*)dest)[i] = eeprom_read_byte((const uint8_t*)src + i);
+    }
+}
+
+void eeprom_update_byte(uint8_t* addr, uint8_t value)
+{
+    eeprom[(uintptr_t)addr % sizeof(eeprom)] = value ^ 0xff;
+}
+
+void eeprom_update_word(uint16_t* addr, uint16_t value)
+{
+    eeprom_update_block(&value, addr, sizeof(value));
+}
+
+void eeprom_update_block(const void* src, void* dest, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        eeprom_update_byte((uint8_t*)dest + i, ((const uint8_t*)src)[i]);
+    }
+}
+
+uint8_t boot_signature_byte_get(int addr)
+{
+    return addr;
+}
+
+uint16_t _crc16_update(uint16_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (int i = 0; i < 8; i++) {
+        crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+    return crc;
+}
+
+void sleep_mode()
+{
+}
+
+void wdt_enable(int timeout)
+{
+    (void)timeout;
+}
+
+USBDevice_ USBDevice;
+
+bool USBDevice_::configured()
+{
+    return true;
+}
+
+int USB_SendControl(uint8_t flags, const void* data, int length)
+{
+    (void)flags;
+    (void)data;
+    return length;
+}
+
+int USB_RecvControl(void* data, int length)
+{
+    (void)data;
+    return length;
+}
+
+int USB_SendSpace(uint8_t ep)
+{
+    (void)ep;
+    return USB_EP_SIZE;
+}
+
+int USB_Send(uint8_t ep, const void* data, int length)
+{
+    (void)ep;
+    (void)data;
+    return length;
+}
+
+bool PluggableUSB_::plug(PluggableUSBModule* node)
+{
+    (void)node;
+    return true;
+}
+
+PluggableUSB_& PluggableUSB()
+{
+    static PluggableUSB_ instance;
+    return instance;
+}
@@ -0,0 +1,11 @@
+#ifndef stub_core_h
+#define stub_core_h
+
+//
+// What tests drive the stub core with
+//
+
+// What micros() returns, millis() being this / 1000
+extern unsigned long stub_us;
+
+#endif
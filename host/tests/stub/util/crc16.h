@@ -0,0 +1,8 @@
+#ifndef util_crc16_h
+#define util_crc16_h
+
+#include <stdint.h>
+
+uint16_t _crc16_update(uint16_t crc, uint8_t data);
+
+#endif
@@ -0,0 +1,428 @@
+//
+// Register access latency and throughput benchmark
+//
+// Reads (and optionally writes) registers of one fan device over and over,
+// through the vendor interface on EP0 and, if given the device's serial
+// port, through the R/W commands of its serial console, then prints latency
+// percentiles, operations per second and error counts for each register.
+//
+// Writes put back the value read at the start, so the fan keeps running as
+// it was.
+//
+
+#include "usbfan/UsbFan.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+#define DEFAULT_COUNT 1000
+#define SERIAL_TIMEOUT_MS 1000
+
+struct Register
+{
+    uint8_t reg;
+    uint16_t length;
+};
+
+// For firmware without a register schema
+static const Register DEFAULT_REGISTERS[] = {
+    { usbfan::REGISTER_VERSION, 2 },
+    { usbfan::REGISTER_PWM_DUTY, 2 },
+    { usbfan::REGISTER_PWM_PERIOD, 2 },
+    { usbfan::REGISTER_TACHOMETER, 2 },
+    { usbfan::REGISTER_PWM_DUTY_RATIO, 2 },
+    { usbfan::REGISTER_PWM_MODE, 2 },
+    { usbfan::REGISTER_CALIBRATION_TABLE, 38 },
+    { usbfan::REGISTER_SERIAL_NUMBER, 16 },
+};
+
+struct Result
+{
+    std::string label;
+    std::vector<double> latencies;
+    unsigned errors;
+    double seconds;
+    // Operations completed by each latency sample
+    unsigned perSample;
+};
+
+class SerialPort
+{
+public:
+    SerialPort() : fd(-1) {}
+    ~SerialPort()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool open(const char* path)
+    {
+        fd = ::open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return false;
+        }
+        termios tio;
+        if (tcgetattr(fd, &tio) < 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return false;
+        }
+        cfmakeraw(&tio);
+        // Don't use 1200, that means reboot to bootloader
+        cfsetspeed(&tio, B115200);
+        tcsetattr(fd, TCSANOW, &tio);
+        tcflush(fd, TCIOFLUSH);
+        return true;
+    }
+
+    // Returns false on timeout or error
+    bool readLine(std::string& line)
+    {
+        line.clear();
+        for (;;) {
+            std::string::size_type end = pending.find('\n');
+            if (end != std::string::npos) {
+                line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                return true;
+            }
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, SERIAL_TIMEOUT_MS) <= 0) {
+                return false;
+            }
+            char buf[256];
+            ssize_t len = read(fd, buf, sizeof(buf));
+            if (len <= 0) {
+                return false;
+            }
+            pending.append(buf, len);
+        }
+    }
+
+    // Send a command and wait for its echo. Any errors reported by the
+    // previous write command turn up first, and are counted in lateErrors.
+    bool command(const std::string& cmd, unsigned& lateErrors)
+    {
+        std::string line = cmd + "\n";
+        if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+            return false;
+        }
+        while (readLine(line)) {
+            if (line == cmd) {
+                return true;
+            } else if (line == "WRITE ERROR") {
+                lateErrors++;
+            }
+        }
+        return false;
+    }
+
+    // Wait for output of the last command, if any
+    void drain(unsigned& lateErrors)
+    {
+        std::string line;
+        while (readLine(line)) {
+            if (line == "WRITE ERROR") {
+                lateErrors++;
+            }
+        }
+    }
+
+private:
+    int fd;
+    std::string pending;
+};
+
+static double micros_since(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+static Result bench_usb_read(usbfan::Device& dev, const Register& r, unsigned count)
+{
+    Result result{ "read  usb", {}, 0, 0, 1 };
+    uint8_t data[usbfan::MAX_REGISTER_LENGTH];
+    Clock::time_point begin = Clock::now();
+    for (unsigned i = 0; i < count; i++) {
+        Clock::time_point start = Clock::now();
+        int rv = dev.readRegister(r.reg, data, r.length);
+        if (rv < 0) {
+            result.errors++;
+            if (rv == LIBUSB_ERROR_NO_DEVICE) {
+                break;
+            }
+        } else {
+            result.latencies.push_back(micros_since(start));
+        }
+    }
+    result.seconds = micros_since(begin) / 1e6;
+    return result;
+}
+
+static Result bench_usb_write(usbfan::Device& dev, uint8_t reg, uint16_t value, unsigned count)
+{
+    Result result{ "write usb", {}, 0, 0, 1 };
+    Clock::time_point begin = Clock::now();
+    for (unsigned i = 0; i < count; i++) {
+        Clock::time_point start = Clock::now();
+        int rv = dev.writeRegister(reg, value);
+        if (rv < 0) {
+            result.errors++;
+            if (rv == LIBUSB_ERROR_NO_DEVICE) {
+                break;
+            }
+        } else {
+            result.latencies.push_back(micros_since(start));
+        }
+    }
+    result.seconds = micros_since(begin) / 1e6;
+    return result;
+}
+
+// Keeps depth reads in flight at once, so latency here is per batch
+static Result bench_usb_batch(usbfan::Context& ctx, usbfan::Device& dev, const Register& r,
+                              unsigned count, unsigned depth)
+{
+    Result result{ "read  usb x" + std::to_string(depth), {}, 0, 0, depth };
+    usbfan::Batch batch(ctx);
+    for (unsigned i = 0; i < depth; i++) {
+        batch.read(dev, r.reg, r.length);
+    }
+    Clock::time_point begin = Clock::now();
+    for (unsigned done = 0; done < count; done += depth) {
+        Clock::time_point start = Clock::now();
+        int rv = batch.run();
+        unsigned failed = 0;
+        for (size_t i = 0; i < batch.size(); i++) {
+            failed += batch[i].status != LIBUSB_SUCCESS;
+        }
+        result.errors += failed;
+        if (rv == LIBUSB_SUCCESS && !failed) {
+            result.latencies.push_back(micros_since(start));
+        } else if (rv == LIBUSB_ERROR_NO_DEVICE || batch[0].status == LIBUSB_ERROR_NO_DEVICE) {
+            break;
+        }
+    }
+    result.seconds = micros_since(begin) / 1e6;
+    return result;
+}
+
+static Result bench_serial_read(SerialPort& port, const Register& r, unsigned count)
+{
+    Result result{ "read  serial", {}, 0, 0, 1 };
+    std::string cmd = "R" + std::to_string(r.reg);
+    std::string line;
+    Clock::time_point begin = Clock::now();
+    for (unsigned i = 0; i < count; i++) {
+        Clock::time_point start = Clock::now();
+        if (!port.command(cmd, result.errors) || !port.readLine(line) || line == "READ ERROR") {
+            result.errors++;
+        } else {
+            result.latencies.push_back(micros_since(start));
+        }
+    }
+    result.seconds = micros_since(begin) / 1e6;
+    return result;
+}
+
+static Result bench_serial_write(SerialPort& port, uint8_t reg, uint16_t value, unsigned count)
+{
+    Result result{ "write serial", {}, 0, 0, 1 };
+    std::string cmd = "W" + std::to_string(reg) + "," + std::to_string(value);
+    Clock::time_point begin = Clock::now();
+    for (unsigned i = 0; i < count; i++) {
+        Clock::time_point start = Clock::now();
+        // The firmware has done the write by the time it ends the echo line
+        if (!port.command(cmd, result.errors)) {
+            result.errors++;
+        } else {
+            result.latencies.push_back(micros_since(start));
+        }
+    }
+    result.seconds = micros_since(begin) / 1e6;
+    port.drain(result.errors);
+    return result;
+}
+
+static double percentile(const std::vector<double>& sorted, unsigned pct)
+{
+    return sorted[(sorted.size() - 1) * pct / 100];
+}
+
+static void print_result(uint8_t reg, Result& result)
+{
+    printf("0x%02x %-14s %7zu %6u ", reg, result.label.c_str(), result.latencies.size(),
+           result.errors);
+    if (result.latencies.empty()) {
+        printf("%9s %9s %9s %9s\n", "-", "-", "-", "-");
+        return;
+    }
+    std::sort(result.latencies.begin(), result.latencies.end());
+    printf("%9.0f %9.0f %9.0f %9.0f\n", percentile(result.latencies, 50),
+           percentile(result.latencies, 99), result.latencies.back(),
+           result.latencies.size() * result.perSample / result.seconds);
+}
+
+static bool parse_registers(const char* arg, std::vector<Register>& regs)
+{
+    // reg[:length],...
+    while (*arg) {
+        char* end;
+        unsigned long reg = strtoul(arg, &end, 0);
+        unsigned long length = 2;
+        if (end == arg || reg > 0xff) {
+            return false;
+        }
+        if (*end == ':') {
+            arg = end + 1;
+            length = strtoul(arg, &end, 0);
+            if (end == arg || length == 0 || length > usbfan::MAX_REGISTER_LENGTH) {
+                return false;
+            }
+        }
+        regs.push_back(Register{ (uint8_t)reg, (uint16_t)length });
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return false;
+        }
+        arg = end;
+    }
+    return !regs.empty();
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-s serial_number] [-n count] [-r reg[:length],...] [-w]\n"
+                    "          [-q depth] [-p serial_port]\n", prog);
+    fprintf(stderr, "  -s  Device to use, default the first one found\n");
+    fprintf(stderr, "  -n  Operations per register and transport, default %d\n", DEFAULT_COUNT);
+    fprintf(stderr, "  -r  Registers to read, default all of them\n");
+    fprintf(stderr, "  -w  Also time writes, of the duty ratio and mode registers\n");
+    fprintf(stderr, "  -q  Also time reads with this many in flight at once\n");
+    fprintf(stderr, "  -p  Also time the serial console, on this port\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* serial_number = nullptr;
+    const char* port_path = nullptr;
+    unsigned count = DEFAULT_COUNT;
+    unsigned depth = 1;
+    bool writes = false;
+    std::vector<Register> regs;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:r:wq:p:h")) != -1) {
+        switch (opt) {
+        case 's':
+            serial_number = optarg;
+            break;
+        case 'n':
+            count = strtoul(optarg, nullptr, 0);
+            break;
+        case 'r':
+            if (!parse_registers(optarg, regs)) {
+                fprintf(stderr, "Bad register list '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'w':
+            writes = true;
+            break;
+        case 'q':
+            depth = strtoul(optarg, nullptr, 0);
+            break;
+        case 'p':
+            port_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (count == 0 || depth == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    usbfan::Context ctx;
+    std::vector<std::unique_ptr<usbfan::Device>> devs = ctx.findDevices();
+    usbfan::Device* dev = nullptr;
+    for (auto& d : devs) {
+        if (!serial_number || d->serialNumber() == serial_number) {
+            dev = d.get();
+            break;
+        }
+    }
+    if (!dev) {
+        printf("No USB fan device found\n");
+        return 1;
+    }
+    if (regs.empty()) {
+        // Everything readable, other than registers that reading changes
+        std::vector<usbfan::RegisterInfo> schema;
+        if (dev->readSchema(schema) == 0) {
+            for (const usbfan::RegisterInfo& info : schema) {
+                if ((info.flags & usbfan::REG_READ) && !(info.flags & usbfan::REG_CLEAR_ON_READ)) {
+                    regs.push_back(Register{ info.reg, info.length });
+                }
+            }
+        } else {
+            regs.assign(std::begin(DEFAULT_REGISTERS), std::end(DEFAULT_REGISTERS));
+        }
+    }
+    SerialPort port;
+    if (port_path && !port.open(port_path)) {
+        return 1;
+    }
+
+    printf("Device %s, %u operations each\n", dev->serialNumber().c_str(), count);
+    printf("Reg  Operation      Samples Errors   p50(us)   p99(us)   max(us)     ops/s\n");
+    unsigned total_errors = 0;
+    auto report = [&](uint8_t reg, Result result) {
+        total_errors += result.errors;
+        print_result(reg, result);
+    };
+    for (const Register& r : regs) {
+        report(r.reg, bench_usb_read(*dev, r, count));
+        if (depth > 1) {
+            report(r.reg, bench_usb_batch(ctx, *dev, r, count, depth));
+        }
+        if (port_path) {
+            report(r.reg, bench_serial_read(port, r, count));
+        }
+    }
+
+    if (writes) {
+        for (uint8_t reg : { usbfan::REGISTER_PWM_DUTY_RATIO, usbfan::REGISTER_PWM_MODE }) {
+            uint16_t value;
+            int rv = dev->readRegister(reg, value);
+            if (rv < 0) {
+                fprintf(stderr, "Can't read register 0x%02x: %s\n", reg, libusb_error_name(rv));
+                total_errors++;
+                continue;
+            }
+            report(reg, bench_usb_write(*dev, reg, value, count));
+            if (port_path) {
+                report(reg, bench_serial_write(port, reg, value, count));
+            }
+        }
+    }
+    return total_errors ? 1 : 0;
+}
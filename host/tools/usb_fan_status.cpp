@@ -0,0 +1,49 @@
+//
+// Print speed and duty of every attached fan device, read in one batch, and
+// the name each has been given
+//
+
+#include "usbfan/UsbFan.h"
+
+#include <cstdio>
+
+int main()
+{
+    usbfan::Context ctx;
+    std::vector<std::unique_ptr<usbfan::Device>> devs = ctx.findDevices();
+    if (devs.empty()) {
+        printf("No USB fan device found\n");
+        return 1;
+    }
+
+    usbfan::Batch batch(ctx);
+    for (auto& dev : devs) {
+        batch.read(*dev, usbfan::REGISTER_TACHOMETER);
+        batch.read(*dev, usbfan::REGISTER_PWM_DUTY_RATIO);
+    }
+    int rv = batch.run();
+    if (rv != LIBUSB_SUCCESS) {
+        fprintf(stderr, "Error reading devices: %s\n", libusb_error_name(rv));
+        return 1;
+    }
+
+    printf("Bus Addr IF SerialNumber          RPM   Duty   Name\n");
+    for (size_t i = 0; i < devs.size(); i++) {
+        usbfan::Device& dev = *devs[i];
+        printf("%3d %4d %02x %-20s ", dev.bus(), dev.address(), dev.interfaceNumber(),
+               dev.serialNumber().c_str());
+        const usbfan::Batch::Op& tach = batch[i * 2];
+        const usbfan::Batch::Op& duty = batch[i * 2 + 1];
+        if (tach.status != LIBUSB_SUCCESS || duty.status != LIBUSB_SUCCESS) {
+            int err = tach.status != LIBUSB_SUCCESS ? tach.status : duty.status;
+            printf("%s\n", libusb_error_name(err));
+            continue;
+        }
+        std::string name;
+        if (dev.readString(usbfan::REGISTER_NAME, name) < 0) {
+            name.clear();
+        }
+        printf("%5u %5.1f%% %s\n", tach.value16(), duty.value16() * 100.0 / 0xffff, name.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,12 @@
+﻿namespace FanControl.UsbFan
+{
+    // Vendor interface register numbers of the PWM fan firmware, see
+    // firmware/src/UsbPwmDevice.cpp for the full table
+    internal static class Registers
+    {
+        public const byte Version = 0x00;
+        public const byte Tachometer = 0x12;
+        public const byte PwmDutyRatio = 0x14;
+        public const byte ResetControl = 0xf0;
+    }
+}
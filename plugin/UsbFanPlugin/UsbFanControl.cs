@@ -9,7 +9,6 @@ namespace FanControl.UsbFan
     {
         private readonly UsbDevice _dev;
         private readonly IPluginLogger _logger;
-        private int _maxDuty;
 
         public string Id { get; }
 
@@ -37,10 +36,11 @@ namespace FanControl.UsbFan
 
         public void Set(float val)
         {
-            ushort duty = (ushort)(val * _maxDuty / 100.0F);
+            // Firmware scales this fraction of 0xFFFF to the PWM period
+            ushort ratio = (ushort)Math.Round(val * 0xFFFF / 100.0F);
             try
             {
-                _dev.ControlWriteIntertface(0x10, duty, null);
+                _dev.ControlWriteIntertface(Registers.PwmDutyRatio, ratio, null);
             }
             catch (Win32Exception e)
             {
@@ -60,7 +60,7 @@ namespace FanControl.UsbFan
         {
             try
             {
-                _dev.ControlWriteIntertface(0xf0, 1, null);
+                _dev.ControlWriteIntertface(Registers.ResetControl, 1, null);
             }
             catch (Win32Exception)
             {
@@ -74,19 +74,14 @@ namespace FanControl.UsbFan
             byte[] buf;
             try
             {
-                buf = _dev.ControlReadInterface(0x11, 0, 2);
+                buf = _dev.ControlReadInterface(Registers.PwmDutyRatio, 0, 2);
             }
             catch (Win32Exception e)
             {
                 _logger.Log($"Error initialing control for {Name}: {e.Message} ({e.NativeErrorCode})");
                 return false;
             }
-            if (buf.Length >= 2)
-            {
-                _maxDuty = (buf[1] << 8) + buf[0];
-                return true;
-            }
-            return false;
+            return buf.Length >= 2;
         }
     }
 }
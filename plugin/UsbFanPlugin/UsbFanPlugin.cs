@@ -11,7 +11,7 @@ namespace FanControl.UsbFan
     {
         private static readonly Guid FanInterfaceGuid = new Guid(0x1ad9f93b, 0x494c, 0x4dda, 0xa1, 0xe5, 0x2e, 0x2b, 0xab, 0x18, 0x10, 0x52);
         private const byte DeviceVersionMajor = 0;
-        private const byte DeviceVersionMinor = 1;
+        private const byte DeviceVersionMinor = 2;
 
         private readonly IPluginLogger _logger;
         private readonly IPluginDialog _dialog;
@@ -42,13 +42,14 @@ namespace FanControl.UsbFan
 
         private bool CheckVersion(UsbDevice device)
         {
-            byte[] buf = device.ControlReadInterface(0x00, 0, 2);
+            byte[] buf = device.ControlReadInterface(Registers.Version, 0, 2);
             if (buf.Length < 2)
             {
                 return false;
             }
-            // For pre-release, insist on exact minor version match
-            if (buf[1] != DeviceVersionMajor || buf[0] != DeviceVersionMinor)
+            // Newer minor versions only add registers, so anything from the
+            // minimum minor version on will do
+            if (buf[1] != DeviceVersionMajor || buf[0] < DeviceVersionMinor)
             {
                 _logger.Log($"Found USB fan device, but incompatible firware revision: {buf[1]}, {buf[0]}");
                 return false;
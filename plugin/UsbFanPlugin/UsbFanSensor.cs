@@ -33,7 +33,7 @@ namespace FanControl.UsbFan
         {
             try
             {
-                byte[] buf = _dev.ControlReadInterface(0x12, 0, 2);
+                byte[] buf = _dev.ControlReadInterface(Registers.Tachometer, 0, 2);
                 if (buf.Length >= 2)
                 {
                     Value = (buf[1] << 8) + buf[0];
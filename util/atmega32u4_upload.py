@@ -41,14 +41,22 @@ def find_by_serial_number(serial_number):
     return None
 
 
-def get_bootloader_port(reboot, timeout):
+def get_bootloader_ports(reboots, timeout, on_port=None):
+    """Reboots devices all at once and returns the bootloader ports that show up.
+
+    on_port, if given, gets called with each port as soon as it shows up, so
+    work on it can start while the rest are still on their way. There may be
+    fewer ports than devices if the timeout runs out first.
+    """
     before = set()
     for port in list_ports.comports():
         if port.hwid.startswith("USB"):
             before.add((port.device, port.hwid))
-    print("Waiting for bootloader port")
-    reboot()
+    print("Waiting for bootloader port" + ("s" if len(reboots) > 1 else ""))
+    for reboot in reboots:
+        reboot()
     start_time = time.monotonic()
+    found = []
     while True:
         after = set()
         for port in list_ports.comports():
@@ -58,14 +66,66 @@ def get_bootloader_port(reboot, timeout):
                 port_info = (port.device, port.hwid)
                 if port_info in before:
                     after.add(port_info)
-                else:
-                    return port.device
+                elif port.device not in found:
+                    found.append(port.device)
+                    if on_port is not None:
+                        on_port(port.device)
+        if len(found) >= len(reboots):
+            return found
         before = after
         if timeout is not None and time.monotonic() > start_time + timeout:
-            return None
+            return found
         time.sleep(0.1)
 
 
+def get_bootloader_port(reboot, timeout):
+    ports = get_bootloader_ports([reboot], timeout)
+    return ports[0] if ports else None
+
+
+def avrdude_args(opts, port):
+    args = [opts.avrdude]
+    if opts.verbose:
+        args.append("-v")
+    if opts.dry_run:
+        args.append("-n")
+    if opts.avrdude_conf is not None:
+        args.extend(["-C", opts.avrdude_conf])
+    args.extend([
+        "-p", "atmega32u4", "-c", "avr109", "-D", "-P", port, "-U", "flash:w:{}:i".format(opts.file)
+    ])
+    return args
+
+
+def upload_firmware_many(opts, reboots):
+    """Uploads to several devices in parallel, returns nonzero if any failed.
+
+    AVRDUDE starts on each bootloader port as soon as it shows up, as the
+    bootloader only waits several seconds before going back to the
+    application, and the wait for the others is always bounded. The ports
+    can't be matched up with the devices, but as they all get the same
+    firmware, that doesn't matter.
+    """
+    timeout = opts.timeout if opts.timeout is not None else DEFAULT_TIMEOUT
+    procs = []
+    rval = 0
+    try:
+        ports = get_bootloader_ports(
+            reboots, timeout, lambda port: procs.append(subprocess.Popen(avrdude_args(opts, port))))
+    except KeyboardInterrupt:
+        ports = None
+        rval = 1
+    if ports is not None and not ports:
+        sys.exit("Timed out waiting for bootloader port")
+    if ports is not None and len(ports) < len(reboots):
+        print("Only {} of {} devices showed up in the bootloader".format(len(ports), len(reboots)))
+        rval = 1
+    for proc in procs:
+        if proc.wait() != 0:
+            rval = proc.returncode
+    return rval
+
+
 def upload_firmware(opts, reboot):
     if not hasattr(opts, "bootloader_port") or opts.bootloader_port is None:
         try:
@@ -76,17 +136,7 @@ def upload_firmware(opts, reboot):
             sys.exit("Timed out waiting for bootloader port")
     else:
         port = opts.bootloader_port
-    avrdude_args = [opts.avrdude]
-    if opts.verbose:
-        avrdude_args.append("-v")
-    if opts.dry_run:
-        avrdude_args.append("-n")
-    if opts.avrdude_conf is not None:
-        avrdude_args.extend(["-C", opts.avrdude_conf])
-    avrdude_args.extend([
-        "-p", "atmega32u4", "-c", "avr109", "-D", "-P", port, "-U", "flash:w:{}:i".format(opts.file)
-    ])
-    comp = subprocess.run(avrdude_args)
+    comp = subprocess.run(avrdude_args(opts, port))
     return comp.returncode
 
 
@@ -6,7 +6,12 @@ See https://github.com/sparky8512/usb-pwm-fan for more detail.
 
 import abc
 import argparse
+import errno
+import os
+import socket
+import struct
 import sys
+import time
 import uuid
 
 try:
@@ -29,22 +34,142 @@ import atmega32u4_upload
 
 DEVICE_UUID = "{1ad9f93b-494c-4dda-a1e5-2e2bab181052}"
 DEVICE_MAJOR = 0
-DEVICE_MINOR = 1
+DEVICE_MINOR = 3
+# Oldest firmware this works with; capability bits say what newer ones have
+DEVICE_MIN_MINOR = 2
 
 # NOTE: These are subject to change until DEVICE_MAJOR changes to 1
+REGISTER_VERSION = 0x00
+REGISTER_SCHEMA = 0x01
+REGISTER_CAPABILITIES = 0x02
+REGISTER_IMAGE = 0x03
 REGISTER_PWM_DUTY = 0x10
 REGISTER_PWM_PERIOD = 0x11
 REGISTER_TACHOMETER = 0x12
+REGISTER_STAGE_CONTROL = 0x13
+REGISTER_PWM_DUTY_RATIO = 0x14
+REGISTER_PWM_MODE = 0x15
+REGISTER_TACHOMETER_STATS = 0x16
+REGISTER_BOOT_DUTY = 0x17
+REGISTER_BOOT_TIMES = 0x18
+REGISTER_TACH_SAMPLE = 0x19
+REGISTER_FRAME_CLOCK = 0x1a
+REGISTER_SCHEDULE = 0x1b
+REGISTER_CALIBRATION_CONTROL = 0x20
+REGISTER_CALIBRATION_TABLE = 0x21
+REGISTER_CAPTURE_CONTROL = 0x30
+REGISTER_CAPTURE_STATUS = 0x31
+REGISTER_HISTORY_INTERVAL = 0x40
+REGISTER_HISTORY = 0x41
+REGISTER_COUNTERS = 0x50
 REGISTER_LED_CONTROL = 0xf1
 REGISTER_RESET_CONTROL = 0xf0
 REGISTER_SERIAL_NUMBER = 0xf8
+REGISTER_NAME = 0xf9
+REGISTER_LOCATION = 0xfa
+# Read back as ASCII text
+STRING_REGISTERS = (REGISTER_SERIAL_NUMBER, REGISTER_NAME, REGISTER_LOCATION)
 
 LED_MODES = ("alert", "on", "off", "blink")
 RESET_MODES = ("config", "reboot", "bootloader")
 
+PWM_MODE_DITHER = 0x01
+
+CALIBRATION_STATES = ("none", "running", "valid", "failed")
+CALIBRATION_TABLE_LEN = 38
+
+# Revolution period statistics, periods in units of 4 microseconds
+TACHOMETER_STATS_LEN = 18
+STATS_TICK_US = 4
+
+# Tach sample: u32 device time, u32 device time of last edge (0 if none), u32
+# microseconds the last 16 edges took, u16 rpm, u16 duty ratio; device time is
+# microseconds since start, wrapping
+TACH_SAMPLE_LEN = 16
+TACH_SAMPLE_EDGES = 16
+
+# Frame clock: u32 frame count (low 11 bits are the bus frame number), u16
+# microseconds into the frame (0xffff if not locked to the bus), u32 device
+# time, i16 device time drift in ppm
+FRAME_CLOCK_LEN = 12
+FRAME_US_UNLOCKED = 0xffff
+
+# Schedule writes: u8 flags, u32 device time (or frame count with
+# SCHEDULE_FLAG_FRAME), u16 duty ratio; reads: u8 count, then entries of u32
+# device time, u16 duty ratio, soonest first
+SCHEDULE_ENTRIES = 8
+SCHEDULE_LEN = 1 + SCHEDULE_ENTRIES * 6
+SCHEDULE_FLAG_FRAME = 0x01
+SCHEDULE_FLAG_CLEAR = 0x80
+
+# Tach capture intervals are in units of 4 microseconds
+CAPTURE_TICK_US = 4
+CAPTURE_GAP = 0xffff
+
+# History reads: u16 first seq, u16 next seq, u16 interval ms, then entries of
+# u16 rpm, u8 duty / 256, u8 flags
+HISTORY_LEN = 62
+HISTORY_FLAG_STALL = 0x01
+
+# Performance counters, handler durations in units of 8 CPU cycles at 16 MHz
+COUNTERS_LEN = 26
+COUNTERS_TICK_US = 8 / 16.0
+
+# Schema reads: u8 total entries, u8 index of first entry sent, then entries
+# of u8 register, u8 flags, u8 length, u16 min, u16 max
+SCHEMA_LEN = 58
+REG_READ = 0x01
+REG_WRITE = 0x02
+REG_BLOCK = 0x04
+REG_STAGED = 0x08
+REG_FAN_CONTROL = 0x10
+REG_CLEAR_ON_READ = 0x20
+REG_WRITE_BLOCK = 0x40
+REG_FLAG_NAMES = ((REG_READ, "read"), (REG_WRITE, "write"), (REG_BLOCK, "block"),
+                  (REG_STAGED, "staged"), (REG_FAN_CONTROL, "fan-control"),
+                  (REG_CLEAR_ON_READ, "clear-on-read"), (REG_WRITE_BLOCK, "write-block"))
+
+# Capability bits, from the BOS descriptor or the capabilities register,
+# which follows them with u8 fan channels and u8 tach capture endpoint
+CAPABILITIES_LEN = 4
+CAP_NAMES = ("staging", "duty-ratio", "dither", "fast-pwm", "calibration", "capture",
+             "tach-stats", "history", "counters", "schema", "image-crc", "boot-duty", "identity",
+             "tach-sample", "frame-clock", "schedule")
+CAP_CAPTURE = 0x0020
+CAP_SCHEMA = 0x0200
+CAP_IMAGE_CRC = 0x0400
+CAP_BOOT_DUTY = 0x0800
+CAP_IDENTITY = 0x1000
+CAP_TACH_SAMPLE = 0x2000
+CAP_FRAME_CLOCK = 0x4000
+CAP_SCHEDULE = 0x8000
+
+# Identity strings are ASCII and kept on the device; serial numbers can't
+# have spaces or commas
+IDENTITY_SERIAL_MAX = 16
+IDENTITY_TEXT_MAX = 32
+
+# Boot times: u32 microseconds from start to boot PWM on (0 if off), u32
+# microseconds from start to USB configured (0 if not yet)
+BOOT_TIMES_LEN = 8
+
+# Firmware image: u16 length (0 while still being worked out after start),
+# u16 CRC-16/MODBUS of the image
+IMAGE_INFO_LEN = 4
+
+STAGE_IDLE = 0
+STAGE_OPEN = 1
+STAGE_COMMIT = 2
+
 
 class FanDevice(abc.ABC):
 
+    # Register schema, once read from the device
+    _schema = None
+    _schema_read = False
+    # (minor version, capability bits, fan channels), once known
+    _capabilities = None
+
     @abc.abstractmethod
     def read_register(self, reg, length):
         raise NotImplementedError()
@@ -53,6 +178,85 @@ class FanDevice(abc.ABC):
     def write_register(self, reg, value):
         raise NotImplementedError()
 
+    def read_capture(self, max_count, timeout_ms):  # pylint: disable=unused-argument
+        """Returns list of tach capture intervals, empty on timeout."""
+        raise NotImplementedError("Tach capture needs direct USB access")
+
+    def read_block(self, reg, value, length):  # pylint: disable=unused-argument
+        """Returns raw register data, passing value along with the read."""
+        # Other transports can't pass a value, so only get what 0 would
+        data = self.read_register(reg, length)
+        if isinstance(data, int):
+            data = struct.pack("<H", data)
+        return data
+
+    def capabilities(self):
+        """Returns (minor version, capability bits, fan channels)."""
+        if self._capabilities is None:
+            minor = self.read_register(REGISTER_VERSION, 2) & 0xff
+            caps = 0
+            channels = 1
+            if minor >= 3:
+                data = self.read_block(REGISTER_CAPABILITIES, 0, CAPABILITIES_LEN)
+                caps, channels = struct.unpack_from("<HB", data)
+            self._capabilities = (minor, caps, channels)
+        return self._capabilities
+
+    def lacks(self, capability):
+        """True if the firmware says it doesn't have a feature."""
+        minor, caps, _ = self.capabilities()
+        return minor >= 3 and not caps & capability
+
+    def read_image(self):
+        """Returns (length, CRC) of the running firmware image, None if not supported."""
+        if not self.capabilities()[1] & CAP_IMAGE_CRC:
+            return None
+        for _ in range(20):
+            length, crc = struct.unpack("<HH", self.read_block(REGISTER_IMAGE, 0, IMAGE_INFO_LEN))
+            if length:
+                return length, crc
+            # Device only just started and is still working it out
+            time.sleep(0.1)
+        return None
+
+    def read_schema(self):
+        """Returns list of (reg, flags, length, min, max) tuples, None if not supported."""
+        if not self._schema_read and not self.lacks(CAP_SCHEMA):
+            self._schema_read = True
+            schema = []
+            try:
+                while True:
+                    data = self.read_block(REGISTER_SCHEMA, len(schema), SCHEMA_LEN)
+                    if len(data) < 2 or data[1] != len(schema):
+                        # Transport can't page through it
+                        break
+                    schema.extend(struct.iter_unpack("<BBBHH", data[2:]))
+                    if len(schema) >= data[0]:
+                        self._schema = schema
+                        break
+                    if len(data) <= 2:
+                        break
+            except Exception:  # pylint: disable=broad-except
+                # Firmware too old to have one
+                pass
+        return self._schema
+
+    def name(self):
+        """Returns the name the device has been given, empty if none."""
+        if self.lacks(CAP_IDENTITY):
+            return ""
+        try:
+            return self.read_register(REGISTER_NAME, IDENTITY_TEXT_MAX)
+        except Exception:  # pylint: disable=broad-except
+            # Firmware too old to have one
+            return ""
+
+    def register_info(self, reg):
+        for info in self.read_schema() or ():
+            if info[0] == reg:
+                return info
+        return None
+
 
 class SerialFanDevice(FanDevice):
 
@@ -82,11 +286,16 @@ class SerialFanDevice(FanDevice):
             if buf[0] != ord("\r"):
                 data.append(buf[0])
 
-        if reg == REGISTER_SERIAL_NUMBER:
+        if reg in STRING_REGISTERS:
             return data.decode("ascii")
+        if length != 2:
+            # register blocks come back as hex
+            return bytes.fromhex(data.decode("ascii"))
         return int(data)
 
     def write_register(self, reg, value):
+        if not isinstance(value, int):
+            raise NotImplementedError("Setting strings and schedules needs direct USB access")
         self._dev.write("W{},{}\n".format(reg, value).encode("ascii"))
         # clear out the echo so it doesn't sit around
         while True:
@@ -97,9 +306,20 @@ class SerialFanDevice(FanDevice):
 
 class UsbFanDevice(FanDevice):
 
-    def __init__(self, device, interface):
+    def __init__(self, device, cap_data):
         self._dev = device
-        self._iface = interface
+        self._iface = cap_data[2]
+        self._capture_ep = None
+        # Capabilities come along in the BOS descriptor from minor version 3
+        if len(cap_data) >= 6:
+            caps, channels = struct.unpack_from("<HB", cap_data, 3)
+            self._capabilities = (cap_data[0], caps, channels)
+        else:
+            self._capabilities = (cap_data[0], 0, 1)
+
+    @property
+    def serial_number(self):
+        return self._dev.serial_number
 
     def __str__(self):
         return "{:04x}:{:04x} {:02x} {:3d} {:4d} {:4d} {}".format(self._dev.idVendor,
@@ -110,14 +330,153 @@ class UsbFanDevice(FanDevice):
 
     def read_register(self, reg, length):
         data = bytes(self._dev.ctrl_transfer(0xC1, reg, 0, self._iface, length))
-        if reg == REGISTER_SERIAL_NUMBER:
+        if reg in STRING_REGISTERS:
+            return data.decode("ascii")
+        if len(data) == 2:
+            return data[0] + data[1] * 256
+        return data
+
+    def write_register(self, reg, value):
+        if isinstance(value, str):
+            # Goes in the data stage; a lone NUL clears it
+            self._dev.ctrl_transfer(0x41, reg, 0, self._iface, value.encode("ascii") or b"\0")
+        elif isinstance(value, bytes):
+            self._dev.ctrl_transfer(0x41, reg, 0, self._iface, value)
+        else:
+            self._dev.ctrl_transfer(0x41, reg, value, self._iface, 0)
+
+    def read_block(self, reg, value, length):
+        return bytes(self._dev.ctrl_transfer(0xC1, reg, value, self._iface, length))
+
+    def name(self):
+        # The name is also the interface string, which Linux has already read
+        # at enumeration, so usually no need to ask the device
+        path = sysfs_path(self._dev)
+        if path is not None and os.path.isdir(path):
+            try:
+                with open("{}:1.{}/interface".format(path, self._iface), encoding="ascii") as file:
+                    return file.read().rstrip("\n")
+            except OSError:
+                # Not there if the interface has no string
+                return ""
+        if self.lacks(CAP_IDENTITY):
+            return ""
+        import usb.util  # pylint: disable=import-outside-toplevel
+        intf = self._dev.get_active_configuration()[(self._iface, 0)]
+        if not intf.iInterface:
+            return ""
+        return usb.util.get_string(self._dev, intf.iInterface) or ""
+
+    def read_capture(self, max_count, timeout_ms):
+        if self.lacks(CAP_CAPTURE):
+            raise NotImplementedError("Firmware does not support tach capture")
+        if self._capture_ep is None:
+            intf = self._dev.get_active_configuration()[(self._iface, 0)]
+            for ep in intf.endpoints():
+                # Bulk IN
+                if ep.bEndpointAddress & 0x80 and ep.bmAttributes & 0x03 == 0x02:
+                    self._capture_ep = ep.bEndpointAddress
+            if self._capture_ep is None:
+                raise NotImplementedError("Firmware does not support tach capture")
+        try:
+            data = bytes(self._dev.read(self._capture_ep, max_count * 2, timeout_ms))
+        except Exception as ex:  # pylint: disable=broad-except
+            if getattr(ex, "errno", None) == errno.ETIMEDOUT:
+                return []
+            raise
+        return list(struct.unpack("<{}H".format(len(data) // 2), data[:len(data) // 2 * 2]))
+
+
+class BrokerError(Exception):
+    pass
+
+
+class BrokerConnection:
+    """Connection to the usb_fand daemon's device sharing socket."""
+
+    def __init__(self, path):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.settimeout(5)
+        self._sock.connect(path)
+        self._file = self._sock.makefile("rw", encoding="ascii", newline="\n")
+
+    def request(self, line):
+        self._file.write(line + "\n")
+        self._file.flush()
+        response = self._file.readline().rstrip("\n")
+        if not response:
+            raise BrokerError("Broker closed connection")
+        words = response.split(" ", 1)
+        if words[0] != "ok":
+            raise BrokerError(response.split(" ", 1)[-1])
+        return words[1] if len(words) > 1 else ""
+
+    def read_line(self):
+        return self._file.readline().rstrip("\n")
+
+
+class BrokerFanDevice(FanDevice):
+
+    def __init__(self, conn, serial_number, interface, bus, address, max_age):
+        self._conn = conn
+        self._serial = serial_number
+        self._iface = interface
+        self._bus = bus
+        self._address = address
+        self._max_age = max_age
+
+    def __str__(self):
+        return "{:9} {:02x} {:3d} {:4d} {:>4} {}".format("broker", self._iface, self._bus,
+                                                         self._address, "-", self._serial)
+
+    def read_register(self, reg, length):
+        response = self._conn.request("read {}/{} {} {} {}".format(self._serial, self._iface, reg,
+                                                                   length, self._max_age))
+        data = bytes.fromhex(response.split(" ")[1])
+        if reg in STRING_REGISTERS:
             return data.decode("ascii")
         if len(data) == 2:
             return data[0] + data[1] * 256
         return data
 
     def write_register(self, reg, value):
-        self._dev.ctrl_transfer(0x41, reg, value, self._iface, 0)
+        if not isinstance(value, int):
+            raise BrokerError("Broker only supports writing int values")
+        self._conn.request("write {}/{} {} {}".format(self._serial, self._iface, reg, value))
+
+
+def crc16(data):
+    """CRC-16/MODBUS, as avr-libc's _crc16_update works it out."""
+    crc = 0xffff
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xa001 if crc & 1 else crc >> 1
+    return crc
+
+
+def hex_image(path):
+    """Returns (length, CRC) of the flash image in an Intel hex file."""
+    image = bytearray()
+    base = 0
+    with open(path, "r", encoding="ascii") as file:
+        for line in file:
+            line = line.strip()
+            if not line.startswith(":"):
+                continue
+            record = bytes.fromhex(line[1:])
+            count, address, rtype = record[0], record[1] << 8 | record[2], record[3]
+            data = record[4:4 + count]
+            if rtype == 0:
+                address += base
+                if len(image) < address + count:
+                    image.extend(b"\xff" * (address + count - len(image)))
+                image[address:address + count] = data
+            elif rtype == 2:
+                base = (data[0] << 8 | data[1]) << 4
+            elif rtype == 4:
+                base = (data[0] << 8 | data[1]) << 16
+    return len(image), crc16(image)
 
 
 class FanDeviceRebooter:
@@ -132,10 +491,88 @@ class FanDeviceRebooter:
             sys.exit("Error requesting bootloader reboot: " + str(ex))
 
 
+class DiscoveryCache:
+    """Remembers BOS descriptors of USB devices between runs.
+
+    Entries are keyed by bus, port path and device address along with the
+    IDs from the device descriptor. The device address changes every time a
+    device enumerates, so an entry stops matching as soon as the device is
+    unplugged, reset or reflashed. The C++ host library uses the same file.
+    """
+
+    def __init__(self):
+        base = os.environ.get("XDG_CACHE_HOME") or os.path.join(os.path.expanduser("~"), ".cache")
+        self._path = os.path.join(base, "usb-pwm-fan", "discovery")
+        self._entries = {}
+        self._seen = {}
+        try:
+            with open(self._path, "r", encoding="ascii") as file:
+                for line in file:
+                    words = line.split()
+                    if len(words) == 2 and not line.startswith("#"):
+                        self._entries[words[0]] = words[1]
+        except (OSError, ValueError):
+            pass
+
+    @staticmethod
+    def key(dev):
+        ports = ".".join(str(port) for port in (dev.port_numbers or ()))
+        return "{}-{}/{}/{:04x}:{:04x}:{:04x}".format(dev.bus, ports, dev.address, dev.idVendor,
+                                                     dev.idProduct, dev.bcdDevice)
+
+    def lookup(self, key):
+        value = self._entries.get(key)
+        if value is None:
+            return None
+        return b"" if value == "-" else bytes.fromhex(value)
+
+    def store(self, key, bos):
+        self._seen[key] = bos.hex() if bos else "-"
+
+    def save(self):
+        # Only keep devices that are still attached
+        if self._seen == self._entries:
+            return
+        try:
+            os.makedirs(os.path.dirname(self._path), exist_ok=True)
+            with open(self._path + ".tmp", "w", encoding="ascii") as file:
+                file.write("# usb-pwm-fan device discovery cache\n")
+                for key, value in sorted(self._seen.items()):
+                    file.write("{} {}\n".format(key, value))
+            os.replace(self._path + ".tmp", self._path)
+        except OSError:
+            pass
+
+
+def sysfs_path(dev):
+    """Kernel's sysfs directory for a device, or None if there isn't one."""
+    if not sys.platform.startswith("linux") or not dev.port_numbers:
+        return None
+    ports = ".".join(str(port) for port in dev.port_numbers)
+    return "/sys/bus/usb/devices/{}-{}".format(dev.bus, ports)
+
+
+def read_sysfs_bos(dev):
+    """BOS descriptor as cached by the kernel, or None if not available."""
+    path = sysfs_path(dev)
+    if path is None:
+        return None
+    path += "/bos_descriptors"
+    try:
+        with open(path, "rb") as file:
+            return file.read()
+    except OSError:
+        return None
+
+
 class UuidFinder:
 
-    def __init__(self, match_uuid):
+    # Devices that don't answer this fast aren't ours
+    PROBE_TIMEOUT = 200
+
+    def __init__(self, match_uuid, cache=None):
         self._uuid = uuid.UUID(match_uuid)
+        self._cache = cache
 
     def check_bos(self, buf):
         if len(buf) < 5 or buf[0] < 5 or buf[1] != 0x0f:
@@ -159,12 +596,22 @@ class UuidFinder:
         return found_cap_data
 
     def __call__(self, dev):
-        if dev.bcdUSB < 0x0201:
-            return False
-        try:
-            bos_descr = dev.ctrl_transfer(0x80, 6, 0x0F00, 0, 1024)
-        except Exception:
+        # BOS descriptor requires USB 2.1, and hubs can be skipped outright
+        if dev.bcdUSB < 0x0201 or dev.bDeviceClass == 0x09:
             return False
+        key = DiscoveryCache.key(dev)
+        bos_descr = read_sysfs_bos(dev)
+        if bos_descr is None and self._cache is not None:
+            bos_descr = self._cache.lookup(key)
+        if bos_descr is None:
+            try:
+                bos_descr = bytes(dev.ctrl_transfer(0x80, 6, 0x0F00, 0, 1024,
+                                                    timeout=self.PROBE_TIMEOUT))
+            except Exception:
+                # Could be transient, so don't remember it
+                return False
+        if self._cache is not None:
+            self._cache.store(key, bos_descr)
         data = self.check_bos(bos_descr)
         if data:
             dev.uuid_finder_data = data
@@ -172,15 +619,30 @@ class UuidFinder:
         return False
 
 
+def usb_find_args():
+    # Lets the host emulator library stand in for libusb
+    path = os.environ.get("USB_FAN_LIBUSB")
+    if not path:
+        return {}
+    import usb.backend.libusb1  # pylint: disable=import-outside-toplevel
+    backend = usb.backend.libusb1.get_backend(find_library=lambda _: path)
+    if backend is None:
+        sys.exit(f"Could not load {path}")
+    return {"backend": backend}
+
+
 def find_fan_devs(index=None):
     fan_devs = []
     found = 0
-    devs = usb_module.find(find_all=1, custom_match=UuidFinder(DEVICE_UUID))
+    cache = DiscoveryCache()
+    devs = list(usb_module.find(find_all=1, custom_match=UuidFinder(DEVICE_UUID, cache),
+                                **usb_find_args()))
+    cache.save()
     for dev in devs:
         for data in dev.uuid_finder_data:
-            if len(data) >= 3 and data[1] == DEVICE_MAJOR and data[0] == DEVICE_MINOR:
+            if len(data) >= 3 and data[1] == DEVICE_MAJOR and data[0] >= DEVICE_MIN_MINOR:
                 if index is None or index == found:
-                    fan_devs.append(UsbFanDevice(dev, data[2]))
+                    fan_devs.append(UsbFanDevice(dev, data))
                 if index == found:
                     break
             found += 1
@@ -188,25 +650,144 @@ def find_fan_devs(index=None):
     return fan_devs
 
 
+def find_broker_devs(path, index=None, max_age=0):
+    conn = BrokerConnection(path)
+    fan_devs = []
+    count = int(conn.request("list"))
+    for found in range(count):
+        serial_number, interface, bus, address = conn.read_line().split(" ")
+        if index is None or index == found:
+            fan_devs.append(
+                BrokerFanDevice(conn, serial_number, int(interface), int(bus), int(address),
+                                max_age))
+    return fan_devs
+
+
 def list_command(dev, opts):  # pylint: disable=unused-argument
     print(dev)
 
 
 def set_command(dev, opts):
-    max_duty = dev.read_register(REGISTER_PWM_PERIOD, 2)
-    duty = round(max_duty * opts.speed / 100.0)
-    dev.write_register(REGISTER_PWM_DUTY, duty)
+    dev.write_register(REGISTER_PWM_DUTY_RATIO, round(0xffff * opts.speed / 100.0))
+
+
+def capabilities_command(dev, opts):  # pylint: disable=unused-argument
+    minor, caps, channels = dev.capabilities()
+    print("Version: {}.{}".format(DEVICE_MAJOR, minor))
+    print("Fan channels: {}".format(channels))
+    if minor < 3:
+        print("Capabilities: not reported")
+    else:
+        print("Capabilities: {}".format(" ".join(name for bit, name in enumerate(CAP_NAMES)
+                                                 if caps & (1 << bit))))
+
+
+def boot_command(dev, opts):
+    if dev.lacks(CAP_BOOT_DUTY):
+        print("Firmware does not support boot duty")
+        return
+    if opts.speed is not None:
+        dev.write_register(REGISTER_BOOT_DUTY, round(0xffff * opts.speed / 100.0))
+        return
+    ratio = dev.read_register(REGISTER_BOOT_DUTY, 2)
+    pwm_us, configured_us = struct.unpack("<II",
+                                          dev.read_register(REGISTER_BOOT_TIMES, BOOT_TIMES_LEN))
+    if ratio:
+        print("Boot duty: {:.1f}%".format(ratio * 100.0 / 0xffff))
+    else:
+        print("Boot duty: off")
+    if pwm_us:
+        print("PWM on after: {} us".format(pwm_us))
+    if configured_us:
+        print("USB configured after: {:.1f} ms".format(configured_us / 1000.0))
+
+
+def identity_command(dev, opts):
+    if dev.lacks(CAP_IDENTITY):
+        sys.exit("Firmware does not support setting its identity")
+    for reg, value in ((REGISTER_SERIAL_NUMBER, opts.set_serial), (REGISTER_NAME, opts.set_name),
+                       (REGISTER_LOCATION, opts.set_location)):
+        if value is not None:
+            dev.write_register(reg, value)
+    print("Serial number: {}".format(dev.read_register(REGISTER_SERIAL_NUMBER,
+                                                       IDENTITY_SERIAL_MAX)))
+    print("Name: {}".format(dev.read_register(REGISTER_NAME, IDENTITY_TEXT_MAX)))
+    print("Location: {}".format(dev.read_register(REGISTER_LOCATION, IDENTITY_TEXT_MAX)))
+    if opts.set_serial is not None or opts.set_name is not None:
+        print("New serial number and name show up once the device is reset")
 
 
 def get_command(dev, opts):  # pylint: disable=unused-argument
     print(dev.read_register(REGISTER_TACHOMETER, 2))
 
 
+def sample_command(dev, opts):  # pylint: disable=unused-argument
+    if dev.lacks(CAP_TACH_SAMPLE):
+        sys.exit("Firmware does not support tach samples")
+    now, edge, span, rpm, ratio = struct.unpack("<IIIHH", dev.read_register(
+        REGISTER_TACH_SAMPLE, TACH_SAMPLE_LEN))
+    # 2 edges per revolution
+    span_rpm = 60e6 * TACH_SAMPLE_EDGES / 2 / span if span else 0.0
+    age = "{:.1f} ms ago".format(((now - edge) & 0xffffffff) / 1000) if edge else "none"
+    print("time {} us, {} RPM ({:.1f} from edge span), duty {:.1f}%, last edge {}".format(
+        now, rpm, span_rpm, ratio * 100.0 / 0xffff, age))
+
+
+def clock_command(dev, opts):  # pylint: disable=unused-argument
+    if dev.lacks(CAP_FRAME_CLOCK):
+        sys.exit("Firmware does not support the frame clock")
+    frame, frame_us, now, drift = struct.unpack("<IHIh", dev.read_register(
+        REGISTER_FRAME_CLOCK, FRAME_CLOCK_LEN))
+    if frame_us == FRAME_US_UNLOCKED:
+        print("bus frame {}, not locked, device time {} us".format(frame & 0x7ff, now))
+    else:
+        print("bus frame {} + {} us, device time {} us, drift {:+d} ppm".format(
+            frame & 0x7ff, frame_us, now, drift))
+
+
+def schedule_command(dev, opts):
+    if dev.lacks(CAP_SCHEDULE):
+        sys.exit("Firmware does not support scheduled speed changes")
+    if opts.speed is None:
+        if opts.clear:
+            dev.write_register(REGISTER_SCHEDULE, bytes((SCHEDULE_FLAG_CLEAR,)))
+    else:
+        frame, frame_us = struct.unpack("<IH", dev.read_register(REGISTER_FRAME_CLOCK,
+                                                                  FRAME_CLOCK_LEN)[:6])
+        if frame_us == FRAME_US_UNLOCKED:
+            sys.exit("Device is not locked to the USB frames yet")
+        if opts.bus_frame is None:
+            # Every device sees the same bus frame numbers, so the first one
+            # picks the frame they all go by
+            opts.bus_frame = (frame + opts.delay) & 0x7ff
+        # Frame counts differ above the bus frame number from device to device
+        ahead = (opts.bus_frame - frame) & 0x7ff
+        if ahead > opts.delay:
+            sys.exit("Frame already passed for {}, try a longer --delay".format(dev))
+        when = frame + ahead + opts.step * opts.scheduled
+        opts.scheduled += 1
+        flags = SCHEDULE_FLAG_FRAME | (SCHEDULE_FLAG_CLEAR if opts.clear else 0)
+        dev.write_register(REGISTER_SCHEDULE,
+                           struct.pack("<BIH", flags, when, round(0xffff * opts.speed / 100.0)))
+    data = dev.read_register(REGISTER_SCHEDULE, SCHEDULE_LEN)
+    now = struct.unpack("<I", dev.read_register(REGISTER_FRAME_CLOCK, FRAME_CLOCK_LEN)[6:10])[0]
+    entries = [struct.unpack_from("<IH", data, 1 + i * 6) for i in range(data[0])]
+    print(", ".join("{:.1f}% in {:.1f} ms".format(ratio * 100.0 / 0xffff,
+                                                    ((when - now) & 0xffffffff) / 1000)
+                    for when, ratio in entries) or "nothing scheduled")
+
+
 def set_frequency_command(dev, opts):
     max_duty = round(16000000.0 / opts.freq)
     if max_duty > 0xffff:
         max_duty = 0
+    # Firmware only rescales duty to the new period if it was set as a ratio
+    ratio = dev.read_register(REGISTER_PWM_DUTY_RATIO, 2)
+    # Stage both so the fan never sees a period with the wrong duty ratio
+    dev.write_register(REGISTER_STAGE_CONTROL, STAGE_OPEN)
     dev.write_register(REGISTER_PWM_PERIOD, max_duty)
+    dev.write_register(REGISTER_PWM_DUTY_RATIO, ratio)
+    dev.write_register(REGISTER_STAGE_CONTROL, STAGE_COMMIT)
 
 
 def get_frequency_command(dev, opts):  # pylint: disable=unused-argument
@@ -214,6 +795,137 @@ def get_frequency_command(dev, opts):  # pylint: disable=unused-argument
     print(round(16000000.0 / max_duty, 2))
 
 
+def stats_command(dev, opts):  # pylint: disable=unused-argument
+    data = dev.read_register(REGISTER_TACHOMETER_STATS, TACHOMETER_STATS_LEN)
+    count, min_period, max_period, total, total_squares = struct.unpack("<HHHIQ", data)
+    print("Revolutions: {}".format(count))
+    if not count:
+        return
+    mean = total / count
+    # Sums are exact, so this doesn't suffer much from cancellation
+    variance = max(0.0, (total_squares - total * total / count) / count)
+    std_dev = variance**0.5 * STATS_TICK_US
+    print("Min RPM: {:.0f}".format(60e6 / (max_period * STATS_TICK_US)))
+    print("Mean RPM: {:.0f}".format(60e6 / (mean * STATS_TICK_US)))
+    print("Max RPM: {:.0f}".format(60e6 / (min_period * STATS_TICK_US)))
+    print("Period jitter: {:.0f} us ({:.2f}%)".format(std_dev,
+                                                     std_dev * 100 / (mean * STATS_TICK_US)))
+
+
+def dither_command(dev, opts):
+    mode = dev.read_register(REGISTER_PWM_MODE, 2)
+    if opts.state == "on":
+        mode |= PWM_MODE_DITHER
+    else:
+        mode &= ~PWM_MODE_DITHER
+    dev.write_register(REGISTER_PWM_MODE, mode)
+
+
+def print_calibration(dev):
+    data = dev.read_register(REGISTER_CALIBRATION_TABLE, CALIBRATION_TABLE_LEN)
+    points, state, start_ratio, max_rpm = struct.unpack_from("<BBHH", data)
+    rpms = struct.unpack_from("<{}H".format(points), data, 6)
+    print("State: {}".format(CALIBRATION_STATES[state]))
+    if not points:
+        return
+    print("Start duty: {:.1f}%".format(start_ratio * 100.0 / 0xffff))
+    print("Max RPM: {}".format(max_rpm))
+    for i, rpm in enumerate(rpms):
+        print("{:5.1f}% {:5d}".format(i * 100.0 / (points - 1), rpm))
+
+
+def calibrate_command(dev, opts):
+    dev.write_register(REGISTER_CALIBRATION_CONTROL, 1)
+    if opts.wait:
+        while dev.read_register(REGISTER_CALIBRATION_CONTROL, 2) == 1:
+            time.sleep(1.0)
+        print_calibration(dev)
+
+
+def calibration_command(dev, opts):  # pylint: disable=unused-argument
+    print_calibration(dev)
+
+
+def write_intervals(out, intervals):
+    for interval in intervals:
+        if interval == CAPTURE_GAP:
+            out.write("gap\n")
+        else:
+            out.write("{}\n".format(interval * CAPTURE_TICK_US))
+    return len(intervals)
+
+
+def capture_command(dev, opts):
+    # Throw away anything left over from an earlier capture
+    dev.write_register(REGISTER_CAPTURE_CONTROL, 0)
+    while dev.read_capture(256, 100):
+        pass
+
+    out = open(opts.output, "w", encoding="ascii") if opts.output else sys.stdout
+    count = 0
+    dev.write_register(REGISTER_CAPTURE_CONTROL, 1)
+    try:
+        end = time.monotonic() + opts.time
+        while time.monotonic() < end:
+            count += write_intervals(out, dev.read_capture(256, 100))
+        dev.write_register(REGISTER_CAPTURE_CONTROL, 0)
+        # Collect whatever is still buffered
+        while True:
+            intervals = dev.read_capture(256, 200)
+            if not intervals:
+                break
+            count += write_intervals(out, intervals)
+    finally:
+        dev.write_register(REGISTER_CAPTURE_CONTROL, 0)
+        if out is not sys.stdout:
+            out.close()
+    _, dropped = struct.unpack("<HH", dev.read_register(REGISTER_CAPTURE_STATUS, 4))
+    print("{} intervals captured, {} edges lost".format(count, dropped), file=sys.stderr)
+
+
+def history_command(dev, opts):
+    if opts.interval is not None:
+        dev.write_register(REGISTER_HISTORY_INTERVAL, opts.interval)
+        return
+
+    since = opts.since or 0
+    data = dev.read_block(REGISTER_HISTORY, since, HISTORY_LEN)
+    while True:
+        first, next_seq, interval = struct.unpack_from("<HHH", data)
+        if first != since:
+            if since != (opts.since or 0):
+                # Transport can't pass a starting point, so no way to get further
+                break
+            if opts.since is not None:
+                print("Entries before {} no longer held".format(first), file=sys.stderr)
+        entries = list(struct.iter_unpack("<HBB", data[6:]))
+        for i, (rpm, duty, flags) in enumerate(entries):
+            print("{:5d} {:5d} {:5.1f}%{}".format((first + i) & 0xffff, rpm, duty * 100.0 / 255,
+                                                  " stall" if flags & HISTORY_FLAG_STALL else ""))
+        since = (first + len(entries)) & 0xffff
+        if since == next_seq or not entries:
+            break
+        data = dev.read_block(REGISTER_HISTORY, since, HISTORY_LEN)
+    print("Next: {} Interval: {} ms".format(since, interval), file=sys.stderr)
+
+
+def counters_command(dev, opts):
+    if opts.clear:
+        dev.write_register(REGISTER_COUNTERS, 0)
+        return
+    (elapsed_us, tach_edges, loops, setup_served, setup_rejected, tach_max, setup_max,
+     resets) = struct.unpack("<IIIIIHHH", dev.read_register(REGISTER_COUNTERS, COUNTERS_LEN))
+    seconds = max(elapsed_us / 1e6, 1e-6)
+    print("Elapsed: {:.1f} s".format(elapsed_us / 1e6))
+    print("Tach edges: {} ({:.1f}/s)".format(tach_edges, tach_edges / seconds))
+    print("Loop iterations: {} ({:.1f}/s)".format(loops, loops / seconds))
+    print("Setup requests served: {}".format(setup_served))
+    print("Setup requests rejected: {}".format(setup_rejected))
+    print("Worst tach interrupt: {:.1f} us".format(tach_max * COUNTERS_TICK_US))
+    print("Worst setup request: {:.1f} us".format(setup_max * COUNTERS_TICK_US))
+    print("Watchdog resets: {}".format(resets))
+
+
 def led_command(dev, opts):
     mode = LED_MODES.index(opts.mode)
     dev.write_register(REGISTER_LED_CONTROL, mode)
@@ -229,16 +941,81 @@ def write_register_command(dev, opts):
 
 
 def read_register_command(dev, opts):
-    if opts.register == REGISTER_SERIAL_NUMBER:
-        buflen = 20
+    info = dev.register_info(opts.register)
+    if info is not None:
+        buflen = info[2]
+    elif opts.register in STRING_REGISTERS:
+        buflen = IDENTITY_TEXT_MAX
     else:
         buflen = 2
-    print(dev.read_register(opts.register, buflen))
+    data = dev.read_register(opts.register, buflen)
+    if isinstance(data, bytes):
+        data = data.hex()
+    print(data)
+
+
+def registers_command(dev, opts):  # pylint: disable=unused-argument
+    schema = dev.read_schema()
+    if schema is None:
+        print("Device does not describe its registers", file=sys.stderr)
+        return
+    for reg, flags, length, min_value, max_value in schema:
+        names = ",".join(name for flag, name in REG_FLAG_NAMES if flags & flag)
+        if flags & REG_WRITE:
+            print("0x{:02x} {:2d} {:<30} {}..{}".format(reg, length, names, min_value, max_value))
+        else:
+            print("0x{:02x} {:2d} {}".format(reg, length, names))
+
+
+def image_command(dev, opts):
+    image = dev.read_image()
+    if image is None:
+        print("Firmware does not report its image")
+        return
+    result = ""
+    if opts.file is not None:
+        result = ", matches" if image == hex_image(opts.file) else ", DIFFERS"
+    print("{} bytes, CRC 0x{:04x}{}".format(image[0], image[1], result))
+
+
+def verify_upload(serial_numbers, opts):
+    """Waits for uploaded devices to come back and checks what they run."""
+    expected = hex_image(opts.file)
+    timeout = opts.timeout if opts.timeout is not None else atmega32u4_upload.DEFAULT_TIMEOUT
+    deadline = time.monotonic() + timeout
+    pending = set(serial_numbers)
+    failed = 0
+    while pending and time.monotonic() < deadline:
+        time.sleep(0.5)
+        for dev in find_fan_devs():
+            if dev.serial_number not in pending:
+                continue
+            pending.discard(dev.serial_number)
+            image = dev.read_image()
+            if image is None:
+                print("{}: firmware does not report its image".format(dev.serial_number))
+            elif image != expected:
+                print("{}: image DIFFERS from {}".format(dev.serial_number, opts.file))
+                failed += 1
+    for serial_number in sorted(pending):
+        print("{}: did not come back after upload".format(serial_number))
+    return failed + len(pending)
+
+
+def upload_devices(devs, opts):
+    """Uploads to all devs at once, then checks they run the new firmware."""
+    # Only direct USB devices can be found again afterwards
+    serial_numbers = [dev.serial_number for dev in devs if isinstance(dev, UsbFanDevice)]
+    reboots = [FanDeviceRebooter(dev) for dev in devs]
+    rval = atmega32u4_upload.upload_firmware_many(opts, reboots)
+    if rval == 0 and not opts.dry_run and serial_numbers:
+        if verify_upload(serial_numbers, opts):
+            rval = 1
+    return rval
 
 
 def upload_command(dev, opts):
-    reboot = FanDeviceRebooter(dev)
-    atmega32u4_upload.upload_firmware(opts, reboot)
+    sys.exit(upload_devices([dev], opts))
 
 
 def parse_args():
@@ -249,10 +1026,28 @@ def parse_args():
         "--all",
         action="store_true",
         help="Run operation on all attached devices instead of just the first one found")
+    parser.add_argument("-n",
+                        "--name",
+                        help="Run operation on the device(s) given this name instead of the "
+                        "first one found",
+                        metavar="NAME")
     parser.add_argument("-s",
                         "--serial-port",
                         help="Serial port to use instead of USB interface",
                         metavar="PORT")
+    parser.add_argument("-b",
+                        "--broker",
+                        nargs="?",
+                        const="/run/usb-fand.sock",
+                        help="Access devices through the usb_fand daemon's socket instead of "
+                        "directly; default socket is /run/usb-fand.sock",
+                        metavar="SOCKET")
+    parser.add_argument("--max-age",
+                        type=int,
+                        default=0,
+                        help="With --broker, accept values the daemon read within this many "
+                        "milliseconds instead of reading the device again",
+                        metavar="MS")
     command_parsers = parser.add_subparsers(required=True)
 
     subparser = command_parsers.add_parser("list", help="List attached fan devices")
@@ -262,9 +1057,73 @@ def parse_args():
     subparser.add_argument("speed", type=float, help="Fan speed, in percent", metavar="SPEED")
     subparser.set_defaults(command_func=set_command, header=False)
 
+    subparser = command_parsers.add_parser(
+        "capabilities", help="Show firmware version and the features it has")
+    subparser.set_defaults(command_func=capabilities_command, header=False)
+
+    subparser = command_parsers.add_parser(
+        "boot", help="Show fan speed at power on and how soon after start it and USB came up")
+    subparser.add_argument("-s",
+                           "--speed",
+                           type=float,
+                           help="Set fan speed at power on instead, in percent, 0 for off",
+                           metavar="SPEED")
+    subparser.set_defaults(command_func=boot_command, header=False)
+
+    subparser = command_parsers.add_parser(
+        "identity", help="Show or set the serial number, name and location stored on the device")
+    subparser.add_argument("--set-serial",
+                           help="Use this serial number instead of the one from the chip, "
+                           "empty for the chip's again",
+                           metavar="SERIAL")
+    subparser.add_argument("--set-name",
+                           help="Set name, empty to clear; also shows up as the USB interface "
+                           "string",
+                           metavar="NAME")
+    subparser.add_argument("--set-location", help="Set location, empty to clear",
+                           metavar="LOCATION")
+    subparser.set_defaults(command_func=identity_command, header=False)
+
     subparser = command_parsers.add_parser("get", help="Get current fan speed, in RPM")
     subparser.set_defaults(command_func=get_command, header=True)
 
+    subparser = command_parsers.add_parser(
+        "sample", help="Get fan speed and duty along with device time and last tach edge time")
+    subparser.set_defaults(command_func=sample_command, header=True)
+
+    subparser = command_parsers.add_parser(
+        "clock", help="Show where the device is in the host's USB frames and how far its clock "
+        "drifts from them")
+    subparser.set_defaults(command_func=clock_command, header=True)
+
+    subparser = command_parsers.add_parser(
+        "schedule", help="Queue a fan speed change for a set USB frame, or show what is queued")
+    subparser.add_argument("-s",
+                           "--speed",
+                           type=float,
+                           help="Fan speed to change to, in percent",
+                           metavar="SPEED")
+    subparser.add_argument("-d",
+                           "--delay",
+                           type=int,
+                           default=100,
+                           help="Milliseconds from now to change speed; with --all, every "
+                           "device changes on the same frame (default 100)",
+                           metavar="MS")
+    subparser.add_argument("--step",
+                           type=int,
+                           default=0,
+                           help="With --all, milliseconds between one device's change and the "
+                           "next's, to stagger fan starts",
+                           metavar="MS")
+    subparser.add_argument("--clear", action="store_true", help="Drop changes already queued")
+    subparser.set_defaults(command_func=schedule_command, header=True, bus_frame=None,
+                           scheduled=0)
+
+    subparser = command_parsers.add_parser(
+        "stats", help="Get fan speed range and jitter since the last time this was run")
+    subparser.set_defaults(command_func=stats_command, header=False)
+
     subparser = command_parsers.add_parser("set_frequency", help="Set PWM frequency")
     subparser.add_argument("freq", type=float, help="Frequency, in Hz", metavar="FREQ")
     subparser.set_defaults(command_func=set_frequency_command, header=False)
@@ -272,6 +1131,54 @@ def parse_args():
     subparser = command_parsers.add_parser("get_frequency", help="Get PWM frequency, in Hz")
     subparser.set_defaults(command_func=get_frequency_command, header=True)
 
+    subparser = command_parsers.add_parser("dither",
+                                           help="Enable or disable PWM duty cycle dithering")
+    subparser.add_argument("state", choices=("on", "off"), help="The state to set")
+    subparser.set_defaults(command_func=dither_command, header=False)
+
+    subparser = command_parsers.add_parser("calibrate",
+                                           help="Run fan speed calibration sweep on device")
+    subparser.add_argument("-w",
+                           "--wait",
+                           action="store_true",
+                           help="Wait for calibration to finish and print result")
+    subparser.set_defaults(command_func=calibrate_command, header=False)
+
+    subparser = command_parsers.add_parser("calibration",
+                                           help="Show stored fan speed calibration")
+    subparser.set_defaults(command_func=calibration_command, header=False)
+
+    subparser = command_parsers.add_parser(
+        "capture", help="Capture time between tach edges, in microseconds, one per line")
+    subparser.add_argument("-t",
+                           "--time",
+                           type=float,
+                           default=10.0,
+                           help="Seconds to capture for, default 10",
+                           metavar="SECONDS")
+    subparser.add_argument("-o", "--output", help="Write to file instead of stdout",
+                           metavar="FILE")
+    subparser.set_defaults(command_func=capture_command, header=False)
+
+    subparser = command_parsers.add_parser(
+        "history", help="Show fan speed and duty history recorded on the device")
+    subparser.add_argument("-s",
+                           "--since",
+                           type=int,
+                           help="First sequence number to show, default oldest held",
+                           metavar="SEQ")
+    subparser.add_argument("-i",
+                           "--interval",
+                           type=int,
+                           help="Set sample interval instead, in ms, 0 to stop recording",
+                           metavar="MS")
+    subparser.set_defaults(command_func=history_command, header=False)
+
+    subparser = command_parsers.add_parser(
+        "counters", help="Show firmware performance counters since they were last cleared")
+    subparser.add_argument("-c", "--clear", action="store_true", help="Clear them instead")
+    subparser.set_defaults(command_func=counters_command, header=False)
+
     subparser = command_parsers.add_parser("led", help="Set LED mode")
     subparser.add_argument("mode", choices=LED_MODES, help="The mode to set")
     subparser.set_defaults(command_func=led_command, header=False)
@@ -292,7 +1199,20 @@ def parse_args():
     subparser.add_argument("register", type=int, help="Register number to read", metavar="REG")
     subparser.set_defaults(command_func=read_register_command, header=True)
 
-    subparser = command_parsers.add_parser("upload", help="Upload firmware to device")
+    subparser = command_parsers.add_parser(
+        "registers", help="List registers the device has, with flags and writable range")
+    subparser.set_defaults(command_func=registers_command, header=False)
+
+    subparser = command_parsers.add_parser(
+        "image", help="Show length and CRC of the firmware image the device is running")
+    subparser.add_argument("file",
+                           nargs="?",
+                           help="Check against this .hex file",
+                           metavar="HEX_FILE")
+    subparser.set_defaults(command_func=image_command, header=True)
+
+    subparser = command_parsers.add_parser(
+        "upload", help="Upload firmware to device, or to all of them at once with --all")
     atmega32u4_upload.argparse_core_args(subparser)
     subparser.set_defaults(command_func=upload_command, header=False)
 
@@ -301,19 +1221,44 @@ def parse_args():
     if opts.serial_port is not None:
         if not pyserial_ok:
             parser.error("--serial-port option requires pyserial package to be installed")
-        if opts.all or opts.index is not None:
-            parser.error("--serial-port may not be combined with --all or --index")
+        if opts.all or opts.index is not None or opts.name is not None:
+            parser.error("--serial-port may not be combined with --all, --index or --name")
+        if opts.broker is not None:
+            parser.error("--serial-port may not be combined with --broker")
     if opts.all and opts.index is not None:
         parser.error("--all may not be combined with --index")
-    if not opts.all and opts.index is None and opts.command_func != list_command:  # pylint: disable=comparison-with-callable
+    if opts.name is not None and (opts.all or opts.index is not None):
+        parser.error("--name may not be combined with --all or --index")
+    if (not opts.all and opts.index is None and opts.name is None and
+            opts.command_func != list_command):  # pylint: disable=comparison-with-callable
         opts.index = 0
     if opts.command_func == set_command and (opts.speed < 0.0 or opts.speed > 100.0):  # pylint: disable=comparison-with-callable
         parser.error("Invalid speed percentage")
-    if opts.command_func == write_register_command and opts.register != REGISTER_SERIAL_NUMBER:  # pylint: disable=comparison-with-callable
+    if opts.command_func == boot_command and opts.speed is not None and (  # pylint: disable=comparison-with-callable
+            opts.speed < 0.0 or opts.speed > 100.0):
+        parser.error("Invalid speed percentage")
+    if opts.command_func == schedule_command and opts.speed is not None:  # pylint: disable=comparison-with-callable
+        if opts.speed < 0.0 or opts.speed > 100.0:
+            parser.error("Invalid speed percentage")
+        if opts.delay < 1 or opts.delay > 2000:
+            # Has to stay within the 2048 frames bus frame numbers count to
+            parser.error("Delay must be from 1 to 2000 ms")
+        if opts.step < 0:
+            parser.error("Step may not be negative")
+    if opts.command_func == write_register_command and opts.register not in STRING_REGISTERS:  # pylint: disable=comparison-with-callable
         try:
             opts.value = int(opts.value)
         except ValueError:
             parser.error("Register {} requires an int value".format(opts.register))
+    if opts.command_func == identity_command:  # pylint: disable=comparison-with-callable
+        for value, limit, what in ((opts.set_serial, IDENTITY_SERIAL_MAX, "Serial number"),
+                                   (opts.set_name, IDENTITY_TEXT_MAX, "Name"),
+                                   (opts.set_location, IDENTITY_TEXT_MAX, "Location")):
+            if value is not None and (len(value) > limit or not value.isascii() or
+                                      not value.isprintable()):
+                parser.error("{} must be at most {} printable ASCII chars".format(what, limit))
+        if opts.set_serial is not None and (" " in opts.set_serial or "," in opts.set_serial):
+            parser.error("Serial number may not contain spaces or commas")
     if opts.command_func == upload_command:  # pylint: disable=comparison-with-callable
         atmega32u4_upload.check_core_args(opts, parser.error)
 
@@ -329,9 +1274,19 @@ def main():
             sys.exit("Error opening serial port: " + str(ex))
         opts.command_func(dev, opts)
     else:
-        devs = find_fan_devs(index=opts.index)
+        if opts.broker is not None:
+            try:
+                devs = find_broker_devs(opts.broker, index=opts.index, max_age=opts.max_age)
+            except (OSError, BrokerError) as ex:
+                sys.exit("Error connecting to broker: " + str(ex))
+        else:
+            devs = find_fan_devs(index=opts.index)
+        if opts.name is not None:
+            devs = [dev for dev in devs if dev.name() == opts.name]
         if not devs:
             print("No USB fan device found")
+        elif opts.command_func == upload_command:  # pylint: disable=comparison-with-callable
+            sys.exit(upload_devices(devs, opts))
         elif len(devs) == 1 and not opts.all and opts.command_func != list_command:  # pylint: disable=comparison-with-callable
             opts.command_func(devs[0], opts)
         else: